@@ -14,19 +14,20 @@ def main() :
     ext = '.graph-text'
     basename = infilepath[:-len(ext)]
 
-    cmd = f'python3 split_graph-text.py {infilepath} {pardegree}'
-    os.system(cmd)
+    # One matrix with a few segments per thread, which the pthread drivers
+    # hand out to their threads as they become free.
+    num_segments = 4 * pardegree
 
-    for tid in range(pardegree) :
-        cmd = f'python3 graph-text2zkr-plain.py \
-              {basename}.{pardegree}.{tid}.graph-text \
-              {basename}.{pardegree}.{tid}.zkr-plain '
-        os.system(cmd)
+    cmd = f'python3 graph-txt2zkr-plain.py \
+          {infilepath} \
+          {basename}.zkr-plain'
+    os.system(cmd)
 
-        cmd = f'{builddir}/encoder \
-            --input_path {basename}.{pardegree}.{tid}.zkr-plain \
-            --output_path {basename}.{pardegree}.{tid}.zkr'
-        os.system(cmd)
+    cmd = f'{builddir}/encoder \
+        --input_path {basename}.zkr-plain \
+        --output_path {basename}.zkr \
+        --num_segments {num_segments}'
+    os.system(cmd)
 
 if __name__ == '__main__' :
     main()
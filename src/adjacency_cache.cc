@@ -0,0 +1,93 @@
+#include "adjacency_cache.h"
+
+namespace zuckerli {
+
+namespace {
+size_t RoundUpToPowerOfTwo(size_t n) {
+  ZKR_ASSERT(n >= 1);
+  return n == 1 ? 1 : size_t{2} << FloorLog2Nonzero(n - 1);
+}
+}  // namespace
+
+AdjacencyCache::AdjacencyCache(size_t capacity_bytes, size_t num_shards)
+    : shard_capacity_(capacity_bytes / RoundUpToPowerOfTwo(num_shards)),
+      shards_(RoundUpToPowerOfTwo(num_shards)) {}
+
+bool AdjacencyCache::Lookup(size_t node, std::vector<uint32_t> *out) {
+  Shard &shard = ShardOf(node);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.slots.find(node);
+  if (it == shard.slots.end()) {
+    shard.stats.misses++;
+    return false;
+  }
+  Entry &entry = shard.entries[it->second];
+  entry.referenced = true;
+  out->insert(out->end(), entry.list.begin(), entry.list.end());
+  shard.stats.hits++;
+  return true;
+}
+
+void AdjacencyCache::Insert(size_t node, const uint32_t *list, size_t size) {
+  const size_t bytes = EntryBytes(size);
+  if (bytes > shard_capacity_) return;
+  Shard &shard = ShardOf(node);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  // Another thread may have decoded and cached the same list meanwhile.
+  if (shard.slots.count(node)) return;
+  MakeRoom(&shard, bytes);
+  size_t slot;
+  if (!shard.free_slots.empty()) {
+    slot = shard.free_slots.back();
+    shard.free_slots.pop_back();
+  } else {
+    slot = shard.entries.size();
+    shard.entries.emplace_back();
+  }
+  Entry &entry = shard.entries[slot];
+  entry.node = node;
+  // New lists get a full turn of the hand before they can be evicted.
+  entry.referenced = true;
+  entry.list.assign(list, list + size);
+  shard.slots.emplace(node, slot);
+  shard.stats.insertions++;
+  shard.stats.entries++;
+  shard.stats.bytes += bytes;
+}
+
+void AdjacencyCache::MakeRoom(Shard *shard, size_t bytes) {
+  while (shard->stats.bytes + bytes > shard_capacity_) {
+    if (shard->hand >= shard->entries.size()) shard->hand = 0;
+    Entry &entry = shard->entries[shard->hand];
+    const size_t slot = shard->hand++;
+    // Free slots have no node in `slots`.
+    auto it = shard->slots.find(entry.node);
+    if (it == shard->slots.end() || it->second != slot) continue;
+    if (entry.referenced) {
+      entry.referenced = false;
+      continue;
+    }
+    shard->slots.erase(it);
+    shard->stats.bytes -= EntryBytes(entry.list.size());
+    shard->stats.entries--;
+    shard->stats.evictions++;
+    std::vector<uint32_t>().swap(entry.list);
+    shard->free_slots.push_back(slot);
+  }
+}
+
+AdjacencyCacheStats AdjacencyCache::Stats() const {
+  AdjacencyCacheStats total;
+  for (const Shard &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    total.hits += shard.stats.hits;
+    total.misses += shard.stats.misses;
+    total.insertions += shard.stats.insertions;
+    total.evictions += shard.stats.evictions;
+    total.entries += shard.stats.entries;
+    total.bytes += shard.stats.bytes;
+  }
+  return total;
+}
+
+}  // namespace zuckerli
@@ -0,0 +1,87 @@
+#ifndef ZUCKERLI_ADJACENCY_CACHE_H
+#define ZUCKERLI_ADJACENCY_CACHE_H
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+namespace zuckerli {
+
+struct AdjacencyCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t insertions = 0;
+  size_t evictions = 0;
+  // Lists and bytes held now, counted as in the budget of the cache.
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+// Bounded cache of decoded adjacency lists, keyed by node. Nodes are spread
+// over independently locked shards, each with an equal part of the memory
+// budget and CLOCK eviction: a lookup sets the reference bit of the list,
+// and insertions sweep the lists of the shard in a circle, evicting the
+// first one whose bit is clear and clearing the bits on the way. Lists larger
+// than the budget of a shard are not cached. Safe to use from several
+// threads.
+class AdjacencyCache {
+ public:
+  // Bytes counted for each list on top of its neighbours, for the slot and
+  // the hash table entry.
+  static constexpr size_t kEntryOverhead = 64;
+
+  // `num_shards` is rounded up to a power of two.
+  explicit AdjacencyCache(size_t capacity_bytes, size_t num_shards = 16);
+  AdjacencyCache(const AdjacencyCache &) = delete;
+  AdjacencyCache &operator=(const AdjacencyCache &) = delete;
+
+  // If the list of `node` is cached, appends it to `out` and returns true.
+  bool Lookup(size_t node, std::vector<uint32_t> *out);
+
+  // Caches the `size` neighbours of `node` at `list`, evicting other lists if
+  // needed; does nothing if the list is already cached.
+  void Insert(size_t node, const uint32_t *list, size_t size);
+
+  // Sum of the counters of the shards.
+  AdjacencyCacheStats Stats() const;
+
+ private:
+  struct Entry {
+    size_t node;
+    bool referenced;
+    std::vector<uint32_t> list;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    // Slot of each cached node in `entries`.
+    std::unordered_map<size_t, size_t> slots;
+    std::vector<Entry> entries;
+    // Slots of `entries` freed by evictions.
+    std::vector<size_t> free_slots;
+    size_t hand = 0;
+    AdjacencyCacheStats stats;
+  };
+
+  static ZKR_INLINE size_t EntryBytes(size_t size) {
+    return size * sizeof(uint32_t) + kEntryOverhead;
+  }
+
+  ZKR_INLINE Shard &ShardOf(size_t node) {
+    return shards_[node & (shards_.size() - 1)];
+  }
+
+  // Evicts lists of `shard` until `bytes` more fit in its budget.
+  void MakeRoom(Shard *shard, size_t bytes);
+
+  size_t shard_capacity_;
+  std::vector<Shard> shards_;
+};
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_ADJACENCY_CACHE_H
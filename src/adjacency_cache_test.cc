@@ -0,0 +1,92 @@
+#include "adjacency_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace zuckerli {
+namespace {
+
+// Bytes taken by a list of `size` neighbours.
+constexpr size_t Bytes(size_t size) {
+  return size * sizeof(uint32_t) + AdjacencyCache::kEntryOverhead;
+}
+
+TEST(AdjacencyCacheTest, TestLookup) {
+  AdjacencyCache cache(Bytes(4) * 10, /*num_shards=*/1);
+  std::vector<uint32_t> out = {7};
+  EXPECT_FALSE(cache.Lookup(3, &out));
+  const uint32_t list[] = {1, 5, 9, 12};
+  cache.Insert(3, list, 4);
+  cache.Insert(3, list, 2);
+  EXPECT_TRUE(cache.Lookup(3, &out));
+  EXPECT_EQ(out, std::vector<uint32_t>({7, 1, 5, 9, 12}));
+  AdjacencyCacheStats stats = cache.Stats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.insertions, 1);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(stats.bytes, Bytes(4));
+}
+
+TEST(AdjacencyCacheTest, TestClockEviction) {
+  // Room for three lists of one neighbour.
+  AdjacencyCache cache(Bytes(1) * 3, /*num_shards=*/1);
+  const uint32_t list[] = {42};
+  std::vector<uint32_t> out;
+  for (size_t node = 0; node < 3; node++) cache.Insert(node, list, 1);
+  // The hand clears the bits of 0, 1 and 2 and evicts 0.
+  cache.Insert(3, list, 1);
+  EXPECT_FALSE(cache.Lookup(0, &out));
+  // 1 gets a second chance, so 2 goes next.
+  EXPECT_TRUE(cache.Lookup(1, &out));
+  cache.Insert(4, list, 1);
+  EXPECT_TRUE(cache.Lookup(1, &out));
+  EXPECT_FALSE(cache.Lookup(2, &out));
+  EXPECT_TRUE(cache.Lookup(3, &out));
+  EXPECT_TRUE(cache.Lookup(4, &out));
+  AdjacencyCacheStats stats = cache.Stats();
+  EXPECT_EQ(stats.evictions, 2);
+  EXPECT_EQ(stats.entries, 3);
+  EXPECT_EQ(stats.bytes, Bytes(1) * 3);
+
+  // Lists larger than a shard are not cached.
+  std::vector<uint32_t> large(100);
+  cache.Insert(5, large.data(), large.size());
+  EXPECT_FALSE(cache.Lookup(5, &out));
+  EXPECT_EQ(cache.Stats().evictions, 2);
+}
+
+TEST(AdjacencyCacheTest, TestThreads) {
+  AdjacencyCache cache(Bytes(8) * 200, /*num_shards=*/5);
+  std::vector<std::thread> threads;
+  std::vector<size_t> errors(4);
+  for (size_t t = 0; t < errors.size(); t++) {
+    threads.emplace_back([&cache, &errors, t]() {
+      std::vector<uint32_t> list(8), out;
+      for (size_t i = 0; i < 20000; i++) {
+        size_t node = (i * 7 + t * 13) % 1000;
+        for (size_t j = 0; j < 8; j++) list[j] = node + j;
+        out.clear();
+        if (cache.Lookup(node, &out)) {
+          if (out != list) errors[t]++;
+        } else {
+          cache.Insert(node, list.data(), list.size());
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) thread.join();
+  for (size_t error : errors) EXPECT_EQ(error, 0);
+  AdjacencyCacheStats stats = cache.Stats();
+  EXPECT_EQ(stats.hits + stats.misses, 4 * 20000);
+  EXPECT_GT(stats.hits, 0);
+  EXPECT_GT(stats.evictions, 0);
+  EXPECT_LE(stats.bytes, Bytes(8) * 200);
+  EXPECT_EQ(stats.insertions - stats.evictions, stats.entries);
+}
+
+}  // namespace
+}  // namespace zuckerli
@@ -196,7 +196,10 @@ struct ANSEncSymbolInfo {
 }  // namespace
 
 void ANSEncode(const IntegerData& integers, size_t num_contexts,
-               BitWriter* writer, std::vector<double>* bits_per_ctx) {
+               BitWriter* writer, std::vector<double>* bits_per_ctx,
+               size_t num_states) {
+  ZKR_ASSERT(num_states >= 1 && num_states <= kMaxANSStates &&
+             (num_states & (num_states - 1)) == 0);
   // Compute histograms.
   std::vector<std::vector<size_t>> histograms;
   histograms.resize(num_contexts);
@@ -247,7 +250,8 @@ void ANSEncode(const IntegerData& integers, size_t num_contexts,
 
   size_t extra_bits = 0;
 
-  size_t ans_state = kANSSignature;
+  size_t ans_states[kMaxANSStates];
+  std::fill(ans_states, ans_states + num_states, kANSSignature);
 
   // Iterate through tokens **in reverse order** to compute state updates.
   integers.ForEachReversed([&](size_t ctx, size_t token, size_t nbits,
@@ -255,6 +259,7 @@ void ANSEncode(const IntegerData& integers, size_t num_contexts,
     (*bits_per_ctx)[ctx] += kProbBits[enc_symbol_info[ctx][token].freq] + nbits;
     extra_bits += nbits;
     const ANSEncSymbolInfo& info = enc_symbol_info[ctx][token];
+    size_t& ans_state = ans_states[i & (num_states - 1)];
     // Flush state.
     if ((ans_state >> (32 - kANSNumBits)) >= info.freq) {
       ans_output_bits.push_back(ans_state & 0xFFFF);
@@ -266,8 +271,10 @@ void ANSEncode(const IntegerData& integers, size_t num_contexts,
     ans_state = (v << kANSNumBits) + offset;
   });
 
-  writer->Reserve(extra_bits + ans_output_bits.size() * 16 + 32);
-  writer->Write(32, ans_state);
+  writer->Reserve(extra_bits + ans_output_bits.size() * 16 + 32 * num_states);
+  for (size_t i = 0; i < num_states; i++) {
+    writer->Write(32, ans_states[i]);
+  }
 
   size_t output_idx_pos = output_idx.size();
   // Iterate through tokens in forward order to produce output.
@@ -310,8 +317,13 @@ AliasTable::Symbol AliasTable::Lookup(const Entry* ZKR_RESTRICT table,
   return s;
 }
 
-bool ANSReader::Init(size_t num_contexts, BitReader* ZKR_RESTRICT br) {
+bool ANSReader::Init(size_t num_contexts, BitReader* ZKR_RESTRICT br,
+                     size_t num_states) {
   ZKR_ASSERT(num_contexts <= kMaxNumContexts);
+  if (num_states == 0 || num_states > kMaxANSStates ||
+      (num_states & (num_states - 1)) != 0) {
+    return ZKR_FAILURE("Invalid number of ANS states");
+  }
   std::vector<size_t> histogram;
   for (size_t i = 0; i < num_contexts; i++) {
     DecodeSymbolProbabilities(&histogram, br);
@@ -322,24 +334,34 @@ bool ANSReader::Init(size_t num_contexts, BitReader* ZKR_RESTRICT br) {
     }
     InitAliasTable(histogram, &entries_[i][0]);
   }
-  state_ = br->ReadBits(32);
+  num_states_ = num_states;
+  next_state_ = 0;
+  for (size_t i = 0; i < num_states_; i++) {
+    state_[i] = br->ReadBits(32);
+    initial_state_[i] = state_[i];
+  }
   return true;
 }
 
 size_t ANSReader::Read(size_t ctx, BitReader* reader) {
-  const uint32_t res = state_ & ((1 << kANSNumBits) - 1);
+  // Only the state of this symbol is updated, so the update chains of
+  // different states are independent of each other.
+  uint32_t state = state_[next_state_];
+  const uint32_t res = state & ((1 << kANSNumBits) - 1);
   const AliasTable::Entry* table = &entries_[ctx][0];
   const AliasTable::Symbol symbol = AliasTable::Lookup(table, res);
-  state_ = symbol.freq * (state_ >> kANSNumBits) + symbol.offset;
+  state = symbol.freq * (state >> kANSNumBits) + symbol.offset;
   const uint32_t new_state =
-      (state_ << 16u) | static_cast<uint32_t>(reader->PeekBits(16));
-  const bool normalize = state_ < (1u << 16u);
-  state_ = normalize ? new_state : state_;
+      (state << 16u) | static_cast<uint32_t>(reader->PeekBits(16));
+  const bool normalize = state < (1u << 16u);
+  state = normalize ? new_state : state;
   reader->Advance(normalize ? 16 : 0);
-  if (state_ < (1u << 16u)) {
-    state_ = (state_ << 16u) | reader->PeekBits(16);
+  if (state < (1u << 16u)) {
+    state = (state << 16u) | reader->PeekBits(16);
     reader->Advance(16);
   }
+  state_[next_state_] = state;
+  next_state_ = (next_state_ + 1) & (num_states_ - 1);
   return symbol.value;
 }
 
@@ -24,6 +24,8 @@ namespace zuckerli {
 
 static constexpr size_t kANSNumBits = 12;
 static constexpr size_t kANSSignature = 0x13 << 16;
+// Maximum number of interleaved ANS states.
+static constexpr size_t kMaxANSStates = 8;
 
 // An alias table implements a mapping from the [0, 1<<kANSNumBits) range into
 // the [0, kNumSymbols) range, satisfying the following conditions:
@@ -78,28 +80,50 @@ struct AliasTable {
 
 // Encodes the given sequence of integers into a BitWriter. The context id
 // for each integer must be in the range [0, num_contexts).
+// Tokens are assigned round-robin to `num_states` independent ANS states (a
+// power of two, at most kMaxANSStates) that share the same bitstream, which
+// shortens the dependency chain between consecutive symbols in the decoder.
 void ANSEncode(const IntegerData& integers, size_t num_contexts,
-               BitWriter* writer, std::vector<double>* bits_per_ctx);
+               BitWriter* writer, std::vector<double>* bits_per_ctx,
+               size_t num_states = 1);
 
 // Class to read ANS-encoded symbols from a stream.
 class ANSReader {
  public:
   // Decodes the specified number of distributions from the reader and creates
-  // the corresponding alias tables.
-  bool Init(size_t num_contexts, BitReader* ZKR_RESTRICT br);
+  // the corresponding alias tables. `num_states` must match the value used by
+  // the encoder.
+  bool Init(size_t num_contexts, BitReader* ZKR_RESTRICT br,
+            size_t num_states = 1);
 
   // Decodes a single symbol from the bitstream, using distribution of index
   // `ctx`.
   size_t Read(size_t ctx, BitReader* ZKR_RESTRICT br);
 
-  // Checks that the final state has its expected value. To be called after
+  // Goes back to the states read by Init(), to decode the same symbols again
+  // from the position of the bitstream at which Init() returned.
+  void Restart() {
+    for (size_t i = 0; i < num_states_; i++) state_[i] = initial_state_[i];
+    next_state_ = 0;
+  }
+
+  // Checks that the final states have their expected value. To be called after
   // decoding all the symbols.
-  bool CheckFinalState() const { return state_ == kANSSignature; }
+  bool CheckFinalState() const {
+    for (size_t i = 0; i < num_states_; i++) {
+      if (state_[i] != kANSSignature) return false;
+    }
+    return true;
+  }
 
  private:
   // Alias tables for decoding symbols from each context.
   AliasTable::Entry entries_[kMaxNumContexts][kNumSymbols];
-  uint32_t state_ = kANSSignature;
+  // Symbol i is decoded with state_[i % num_states_].
+  uint32_t state_[kMaxANSStates] = {kANSSignature};
+  uint32_t initial_state_[kMaxANSStates] = {kANSSignature};
+  size_t num_states_ = 1;
+  size_t next_state_ = 0;
 };
 
 };  // namespace zuckerli
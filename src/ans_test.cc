@@ -56,5 +56,39 @@ TEST(ANSTest, TestRoundtrip) {
   EXPECT_TRUE(symbol_reader.CheckFinalState());
 }
 
+TEST(ANSTest, TestInterleavedRoundtrip) {
+  constexpr size_t kNumIntegers = 1 << 20;
+  constexpr size_t kNumContexts = 16;
+
+  IntegerData data;
+
+  std::mt19937 rng;
+  std::geometric_distribution<uint32_t> dist(0.05);
+  std::uniform_int_distribution<uint32_t> ctx_dist(0, kNumContexts - 1);
+
+  for (size_t i = 0; i < kNumIntegers; i++) {
+    size_t ctx = ctx_dist(rng);
+    size_t integer = dist(rng);
+    data.Add(ctx, integer);
+  }
+
+  for (size_t num_states : {2, 4, 8}) {
+    BitWriter writer;
+    std::vector<double> unused_bits_per_ctx;
+    ANSEncode(data, kNumContexts, &writer, &unused_bits_per_ctx, num_states);
+
+    std::vector<uint8_t> encoded = std::move(writer).GetData();
+    BitReader reader(encoded.data(), encoded.size());
+    ANSReader symbol_reader;
+    ASSERT_TRUE(symbol_reader.Init(kNumContexts, &reader, num_states));
+
+    for (size_t i = 0; i < kNumIntegers; i++) {
+      ASSERT_EQ(IntegerCoder::Read(data.Context(i), &reader, &symbol_reader),
+                data.Value(i));
+    }
+    EXPECT_TRUE(symbol_reader.CheckFinalState());
+  }
+}
+
 }  // namespace
 }  // namespace zuckerli
@@ -33,6 +33,9 @@ class BitReader {
 
   BitReader(const uint8_t *ZKR_RESTRICT data, size_t size);
   BitReader(const uint8_t *ZKR_RESTRICT data, size_t bit_offset, size_t size);
+  // Reads `data` starting from its `bit_offset`-th bit.
+  BitReader(span<const uint8_t> data, size_t bit_offset)
+      : BitReader(data.data(), bit_offset, data.size()) {}
 
   BitReader(const BitReader &other) = delete;
   BitReader(BitReader &&other) = delete;
@@ -35,6 +35,7 @@ void BitWriter::AppendAligned(const uint8_t *ptr, size_t cnt) {
   ZKR_ASSERT(bits_written_ % 8 == 0);
   data_.resize(bits_written_ / 8);
   data_.insert(data_.end(), ptr, ptr + cnt);
+  bits_written_ += cnt * 8;
 }
 
 std::vector<uint8_t> BitWriter::GetData() && {
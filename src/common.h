@@ -16,6 +16,10 @@
 
 #include <stdint.h>
 
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
 #define ZKR_ASSERT(cond)                                                       \
   do {                                                                         \
     if (!(cond)) {                                                             \
@@ -67,6 +71,33 @@ ZKR_INLINE int FloorLog2Nonzero(uint64_t value) {
   return 63 - __builtin_clzll(value);
 }
 
+template <typename T>
+class span {
+ public:
+  using iterator = const T *;
+  span(const T *data, size_t size) : data_(data), size_(size) {}
+  span(const std::vector<typename std::remove_const<T>::type> &v)
+      : data_(v.data()), size_(v.size()) {}
+  iterator begin() const { return data_; }
+  iterator end() const { return data_ + size_; }
+  const T &operator[](size_t pos) const { return data_[pos]; }
+  ZKR_INLINE T &at(size_t pos) {
+    ZKR_DASSERT(pos < size_);
+    return data_[pos];
+  }
+  ZKR_INLINE const T &at(size_t pos) const {
+    ZKR_DASSERT(pos < size_);
+    return data_[pos];
+  }
+  ZKR_INLINE const T *data() const { return data_; }
+  ZKR_INLINE size_t size() const { return size_; }
+  ZKR_INLINE bool empty() const { return size_ == 0; }
+
+ private:
+  const T *data_;
+  size_t size_;
+};
+
 #define ZKR_HONOR_FLAGS 0
 
 }  // namespace zuckerli
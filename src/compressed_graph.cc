@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 
 #include "common.h"
@@ -12,88 +13,394 @@
 
 namespace zuckerli {
 
-CompressedGraph::CompressedGraph(const std::string& file) {
-  FILE* in = std::fopen(file.c_str(), "r");
-  ZKR_ASSERT(in);
+static_assert(kNumReferenceContexts <= (1 << kReferenceOffsetBits),
+              "Reference offsets do not fit in the reference offset section");
 
-  fseek(in, 0, SEEK_END);
-  size_t len = ftell(in);
-  fseek(in, 0, SEEK_SET);
+CompressedGraph::CompressedGraph(const std::string& file, bool huge_pages)
+    : file_(std::make_shared<MappedFile>(file, MappedFile::Access::kRandom,
+                                         huge_pages)),
+      compressed_(file_->data()),
+      size_(file_->size()) {
+  if (size_ == 0) ZKR_ABORT("Empty file");
 
-  compressed_.resize(len);
-  ZKR_ASSERT(fread(compressed_.data(), 1, len, in) == len);
-  if (compressed_.empty()) ZKR_ABORT("Empty file");
-
-  BitReader reader(compressed_.data(), compressed_.size());
-  num_nodes_ = reader.ReadBits(48);
-  bool allow_random_access = reader.ReadBits(1);
-  if (!allow_random_access) {
+  GraphHeader header;
+  if (!ReadGraphHeader(compressed_, size_, &header)) {
+    ZKR_ABORT("Invalid header");
+  }
+  num_nodes_ = header.num_nodes;
+  if (!header.allow_random_access) {
     ZKR_ABORT("No random access allowed");
   }
+  if (!header.tiles.empty()) {
+    ZKR_ABORT("Column-tiled graphs do not allow random access");
+  }
 
-  huff_reader_.Init(kNumContexts, &reader);
+  segments_ = header.segments;
+  huff_readers_.resize(segments_.size());
+  // Position of the first bit after the coding tables of each segment.
+  std::vector<size_t> stream_bit_offsets(segments_.size());
+  for (size_t s = 0; s < segments_.size(); s++) {
+    BitReader reader(compressed_, segments_[s].bit_offset, size_);
+    huff_readers_[s].Init(kNumContexts, &reader);
+    huff_readers_[s].InitMultiSymbol(kResidualBaseContext,
+                                     NumChainedResidualContexts());
+    stream_bit_offsets[s] =
+        segments_[s].bit_offset / 8 * 8 + reader.NumBitsRead();
+  }
 
-  node_start_indices_.clear();
-  node_start_indices_.reserve(num_nodes_);
-  if (!DecodeGraph(compressed_, nullptr, &node_start_indices_)) {
-    ZKR_ABORT("Invalid graph");
+  const GraphSection* degrees = FindSection(header, kDegreeIndexSection);
+  const GraphSection* references =
+      FindSection(header, kReferenceOffsetSection);
+  if (degrees != nullptr && references != nullptr) {
+    if (!degree_index_.Init(compressed_ + degrees->byte_offset, degrees->size,
+                            num_nodes_ + 1) ||
+        degree_index_[0] != 0 ||
+        !reference_offsets_.Init(compressed_ + references->byte_offset,
+                                 references->size, num_nodes_)) {
+      ZKR_ABORT("Invalid degree index");
+    }
   }
+
+  const GraphSection* index = FindSection(header, kNodeIndexSection);
+  if (index != nullptr) {
+    if (!node_start_indices_.Init(compressed_ + index->byte_offset,
+                                  index->size, num_nodes_)) {
+      ZKR_ABORT("Invalid node index");
+    }
+    return;
+  }
+
+  // No index in the file: decode the graph, with the tables read above, to
+  // find where nodes start.
+  std::vector<size_t> node_start_indices(num_nodes_);
+  for (size_t s = 0; s < segments_.size(); s++) {
+    BitReader reader(compressed_, stream_bit_offsets[s], size_);
+    DecodeVisitor visitor;
+    if (!detail::DecodeGraphImpl(num_nodes_, segments_[s],
+                                 /*allow_random_access=*/true,
+                                 &huff_readers_[s], &reader, &visitor,
+                                 stream_bit_offsets[s] / 8 * 8,
+                                 &node_start_indices)) {
+      ZKR_ABORT("Invalid graph");
+    }
+  }
+  auto built_index = std::make_shared<std::vector<uint8_t>>();
+  EncodeNodeIndex(node_start_indices, built_index.get());
+  if (!node_start_indices_.Init(built_index->data(), built_index->size(),
+                                num_nodes_)) {
+    ZKR_ABORT("Invalid node index");
+  }
+  built_index_ = std::move(built_index);
 }
 
-uint32_t CompressedGraph::ReadDegreeBits(uint32_t node_id, size_t context) {
-  BitReader bit_reader(compressed_.data() + node_start_indices_[node_id] / 8,
-                       compressed_.size());
-  bit_reader.ReadBits(node_start_indices_[node_id] % 8);
-  return zuckerli::IntegerCoder::Read(context, &bit_reader, &huff_reader_);
+uint32_t CompressedGraph::ReadDegreeBits(uint32_t node_id, size_t bit_pos,
+                                         size_t context) {
+  HuffmanReader* huff_reader = &huff_readers_[SegmentOf(segments_, node_id)];
+  BitReader bit_reader(compressed_, bit_pos, size_);
+  return zuckerli::IntegerCoder::Read(context, &bit_reader, huff_reader);
 }
 
 std::pair<uint32_t, size_t> CompressedGraph::ReadDegreeAndRefBits(
-    uint32_t node_id, size_t context, size_t last_reference_offset) {
-  BitReader bit_reader(compressed_.data() + node_start_indices_[node_id] / 8,
-                       compressed_.size());
-  bit_reader.ReadBits(node_start_indices_[node_id] % 8);
+    uint32_t node_id, size_t bit_pos, size_t context,
+    size_t last_reference_offset) {
+  size_t segment_id = SegmentOf(segments_, node_id);
+  const GraphSegment& segment = segments_[segment_id];
+  HuffmanReader* huff_reader = &huff_readers_[segment_id];
+  BitReader bit_reader(compressed_, bit_pos, size_);
   uint32_t degree =
-      zuckerli::IntegerCoder::Read(context, &bit_reader, &huff_reader_);
+      zuckerli::IntegerCoder::Read(context, &bit_reader, huff_reader);
   // If this is not the first node, read the offset of the list to be used as
   // a reference.
   size_t reference_offset = 0;
-  if (node_id != 0) {
+  if (node_id != segment.first_node) {
     reference_offset = IntegerCoder::Read(
-        ReferenceContext(last_reference_offset), &bit_reader, &huff_reader_);
+        ReferenceContext(last_reference_offset), &bit_reader, huff_reader);
   }
   return std::make_pair(degree, reference_offset);
 }
 
 uint32_t CompressedGraph::Degree(size_t node_id) {
+  if (degree_index_.size() != 0) {
+    size_t cumulative[2];
+    degree_index_.Read(node_id, 2, cumulative);
+    if (cumulative[1] - cumulative[0] > num_nodes_) {
+      ZKR_ABORT("Invalid degree");
+    }
+    return cumulative[1] - cumulative[0];
+  }
   uint32_t first_node_in_chunk = node_id - node_id % kDegreeReferenceChunkSize;
+  size_t bit_pos[kDegreeReferenceChunkSize];
+  node_start_indices_.Read(first_node_in_chunk,
+                           node_id - first_node_in_chunk + 1, bit_pos);
   uint32_t reconstructed_degree =
-      ReadDegreeBits(first_node_in_chunk, kFirstDegreeContext);
+      ReadDegreeBits(first_node_in_chunk, bit_pos[0], kFirstDegreeContext);
   size_t context;
   size_t last_degree_delta = reconstructed_degree;
   for (int node = first_node_in_chunk + 1; node <= node_id; ++node) {
     context = DegreeContext(last_degree_delta);
-    last_degree_delta = ReadDegreeBits(node, context);
+    last_degree_delta =
+        ReadDegreeBits(node, bit_pos[node - first_node_in_chunk], context);
     reconstructed_degree += UnpackSigned(last_degree_delta);
   }
   if (reconstructed_degree > num_nodes_) ZKR_ABORT("Invalid degree");
   return reconstructed_degree;
 }
 
+// Buffers of Neighbours() and NeighboursInto(). Block lengths are on a stack
+// too, so that the recursion does not allocate once the buffers are large
+// enough.
+namespace {
+CompressedGraph::Scratch& ThreadScratch() {
+  thread_local CompressedGraph::Scratch scratch;
+  return scratch;
+}
+}  // namespace
+
+void CompressedGraph::ListDecoder::Start(
+    size_t node, size_t num_nodes_in_graph, size_t list_degree,
+    const uint32_t* reference_list, size_t reference_size,
+    const size_t* blocks, size_t blocks_size, size_t num_to_copy,
+    HuffmanReader* huffman_reader) {
+  node_id = node;
+  num_nodes = num_nodes_in_graph;
+  degree = list_degree;
+  ref_list = reference_list;
+  ref_size = reference_size;
+  block_lengths = blocks;
+  num_blocks = blocks_size;
+  huff_reader = huffman_reader;
+  residual_reader = ChainedIntegerReader<HuffmanReader>(huffman_reader);
+  num_residuals = degree - num_to_copy;
+  num_to_copy_from_current_block = num_blocks == 0 ? 0 : block_lengths[0];
+  // If we don't need to copy anything from the first block, and we have at
+  // least another even-positioned block, advance the position in the
+  // reference_offset list accordingly.
+  if (num_to_copy_from_current_block == 0 && num_blocks > 2) {
+    ref_pos = block_lengths[1];
+    num_to_copy_from_current_block = block_lengths[2];
+    next_block = 3;
+  }
+}
+
+ZKR_INLINE void CompressedGraph::ListDecoder::ReadResidual(
+    BitReader* reader) {
+  if (residual == 0) {
+    last_residual_delta = IntegerCoder::Read(
+        FirstResidualContext(num_residuals), reader, huff_reader);
+    pending = node_id + UnpackSigned(last_residual_delta);
+  } else if (num_zeros_to_skip > 0) {
+    // If in a zero run, don't read anything.
+    last_residual_delta = 0;
+    pending = last_dest_plus_one;
+  } else {
+    last_residual_delta =
+        residual_reader.Read(ResidualContext(last_residual_delta), reader);
+    pending = last_dest_plus_one + last_residual_delta;
+  }
+  // Compute run of zeros if we read a zero and we are not already in one.
+  if (last_residual_delta == 0 && num_zeros_to_skip == 0) {
+    contiguous_zeroes_len++;
+  } else {
+    contiguous_zeroes_len = 0;
+  }
+  // If we are in a run of zeros, decrease its length.
+  if (num_zeros_to_skip > 0) {
+    num_zeros_to_skip--;
+  }
+  // If the current run of zeros is large enough, read how many further
+  // zeros to decode from the bitstream. Merging with the reference list, below
+  // and in the next calls, reads nothing.
+  if (contiguous_zeroes_len >= kRleMin) {
+    residual_reader.Reset();
+    num_zeros_to_skip = IntegerCoder::Read(kRleContext, reader, huff_reader);
+    contiguous_zeroes_len = 0;
+  }
+  has_pending = true;
+  residual++;
+}
+
+ZKR_INLINE uint32_t CompressedGraph::ListDecoder::Copy() {
+  const uint32_t neighbour = ref_list[ref_pos++];
+  num_to_copy_from_current_block--;
+  if (num_to_copy_from_current_block == 0 && next_block + 1 < num_blocks) {
+    ref_pos += block_lengths[next_block];
+    num_to_copy_from_current_block = block_lengths[next_block + 1];
+    next_block += 2;
+  }
+  return neighbour;
+}
+
+ZKR_INLINE bool CompressedGraph::ListDecoder::Next(BitReader* reader,
+                                                   uint32_t* neighbour) {
+  if (!has_pending) {
+    if (residual == num_residuals) {
+      // Process the rest of the block-copy list.
+      if (num_to_copy_from_current_block == 0) return false;
+      ZKR_ASSERT(ref_pos < ref_size);
+      *neighbour = Copy();
+      return true;
+    }
+    ReadResidual(reader);
+  }
+  // Merge the edges copied from the reference_offset list with the ones
+  // read from the bitstream.
+  if (num_to_copy_from_current_block > 0 && ref_list[ref_pos] <= pending) {
+    // If our delta coding would produce an edge to the pending node, but y
+    // with y<=pending is copied from the reference_offset list, we increase
+    // the pending node. In other words, it's delta coding with respect to
+    // both lists (ref_list and residuals).
+    if (residual != 1 && ref_list[ref_pos] >= last_dest_plus_one) pending++;
+    *neighbour = Copy();
+    return true;
+  }
+  if (pending >= num_nodes) ZKR_ABORT("Invalid residual");
+  *neighbour = pending;
+  last_dest_plus_one = pending + 1;
+  has_pending = false;
+  return true;
+}
+
+void CompressedGraph::EnableCache(size_t capacity_bytes, size_t num_shards) {
+  cache_ = std::make_shared<AdjacencyCache>(capacity_bytes, num_shards);
+}
+
+AdjacencyCacheStats CompressedGraph::CacheStats() const {
+  return cache_ ? cache_->Stats() : AdjacencyCacheStats();
+}
+
 std::vector<uint32_t> CompressedGraph::Neighbours(size_t node_id) {
-  BitReader bit_reader(compressed_.data() + node_start_indices_[node_id] / 8,
-                       compressed_.size());
-  bit_reader.ReadBits(node_start_indices_[node_id] % 8);
-  std::vector<uint32_t> neighbours;
+  Scratch& scratch = ThreadScratch();
+  scratch.edges.clear();
+  scratch.block_lengths.clear();
+  DecodeNeighbours(node_id, /*chunk_bit_pos=*/nullptr, &scratch);
+  return scratch.edges;
+}
+
+size_t CompressedGraph::NeighboursInto(size_t node_id,
+                                       std::vector<uint32_t>* out,
+                                       size_t* decoded_edges) {
+  Scratch& scratch = ThreadScratch();
+  scratch.block_lengths.clear();
+  scratch.decoded_edges = 0;
+  // Decode in the storage of `out`, which then keeps any growth.
+  out->clear();
+  out->swap(scratch.edges);
+  const size_t degree =
+      DecodeNeighbours(node_id, /*chunk_bit_pos=*/nullptr, &scratch);
+  out->swap(scratch.edges);
+  if (decoded_edges != nullptr) *decoded_edges = scratch.decoded_edges;
+  return degree;
+}
+
+size_t CompressedGraph::NodeStart(size_t node_id,
+                                  const size_t** chunk_bit_pos,
+                                  size_t* storage) {
+  uint32_t first_node_in_chunk = node_id - node_id % kDegreeReferenceChunkSize;
+  if (*chunk_bit_pos == nullptr) {
+    // With a degree index, only the position of this node is needed.
+    if (degree_index_.size() != 0) return node_start_indices_[node_id];
+    node_start_indices_.Read(first_node_in_chunk,
+                             node_id - first_node_in_chunk + 1, storage);
+    *chunk_bit_pos = storage;
+  }
+  return (*chunk_bit_pos)[node_id - first_node_in_chunk];
+}
+
+size_t CompressedGraph::DecodeNeighbours(size_t node_id,
+                                         const size_t* chunk_bit_pos,
+                                         Scratch* scratch) {
+  const size_t list_begin = scratch->edges.size();
+  if (cache_ && cache_->Lookup(node_id, &scratch->edges)) {
+    return scratch->edges.size() - list_begin;
+  }
+  const size_t blocks_begin = scratch->block_lengths.size();
+  size_t chunk_bit_pos_storage[kDegreeReferenceChunkSize];
+  BitReader bit_reader(
+      compressed_, NodeStart(node_id, &chunk_bit_pos, chunk_bit_pos_storage),
+      size_);
+  ListDecoder list;
+  StartNeighbours(node_id, chunk_bit_pos, &bit_reader, /*output_space=*/true,
+                  scratch, &list);
+  if (list.degree == 0) return 0;
 
+  // The reference list is at `list_begin`, and this list goes after it.
+  uint32_t* neighbours = scratch->edges.data() + list_begin + list.ref_size;
+  size_t num_neighbours = 0;
+  while (list.Next(&bit_reader, neighbours + num_neighbours)) {
+    num_neighbours++;
+  }
+  ZKR_ASSERT(num_neighbours == list.degree);
+  // Replace the reference list with this one.
+  memmove(scratch->edges.data() + list_begin, neighbours,
+          list.degree * sizeof(uint32_t));
+  scratch->edges.resize(list_begin + list.degree);
+  scratch->block_lengths.resize(blocks_begin);
+  scratch->decoded_edges += list.degree;
+  if (cache_) {
+    cache_->Insert(node_id, scratch->edges.data() + list_begin, list.degree);
+  }
+  return list.degree;
+}
+
+void CompressedGraph::StartNeighbours(size_t node_id,
+                                      const size_t* chunk_bit_pos,
+                                      BitReader* reader, bool output_space,
+                                      Scratch* scratch, ListDecoder* list) {
+  size_t segment_id = SegmentOf(segments_, node_id);
+  HuffmanReader* huff_reader = &huff_readers_[segment_id];
+  BitReader& bit_reader = *reader;
   uint32_t first_node_in_chunk = node_id - node_id % kDegreeReferenceChunkSize;
+  const size_t* bit_pos = chunk_bit_pos;
   uint32_t reconstructed_degree;
   size_t reference_offset = 0;
   size_t last_reference_offset = 0;
   size_t last_degree_delta = 0;
+
+  if (degree_index_.size() != 0) {
+    // The degrees of the chunk up to this node give the context of its degree,
+    // which is read only to skip it, and the last node of the chunk with edges
+    // gives the context of its reference offset.
+    size_t cumulative[kDegreeReferenceChunkSize + 1];
+    const size_t chunk_pos = node_id - first_node_in_chunk;
+    degree_index_.Read(first_node_in_chunk, chunk_pos + 2, cumulative);
+    const auto degree = [&](size_t i) {
+      return cumulative[i + 1] - cumulative[i];
+    };
+    reconstructed_degree = degree(chunk_pos);
+    if (chunk_pos == 0) {
+      last_degree_delta =
+          IntegerCoder::Read(kFirstDegreeContext, &bit_reader, huff_reader);
+      if (last_degree_delta != reconstructed_degree) {
+        ZKR_ABORT("Invalid degree index");
+      }
+    } else {
+      last_degree_delta =
+          chunk_pos == 1 ? degree(0)
+                         : PackSigned(int64_t(degree(chunk_pos - 1)) -
+                                      int64_t(degree(chunk_pos - 2)));
+      last_degree_delta = IntegerCoder::Read(DegreeContext(last_degree_delta),
+                                             &bit_reader, huff_reader);
+      if (degree(chunk_pos - 1) + UnpackSigned(last_degree_delta) !=
+          reconstructed_degree) {
+        ZKR_ABORT("Invalid degree index");
+      }
+      for (size_t i = chunk_pos; i-- > 0;) {
+        if (degree(i) != 0) {
+          last_reference_offset = reference_offsets_[first_node_in_chunk + i];
+          break;
+        }
+      }
+    }
+    StartList(node_id, segment_id, reconstructed_degree, last_reference_offset,
+              bit_pos, &bit_reader, output_space, scratch, list);
+    return;
+  }
+
   if (first_node_in_chunk != node_id) {
     size_t context;
-    std::tie(reconstructed_degree, reference_offset) = ReadDegreeAndRefBits(
-        first_node_in_chunk, kFirstDegreeContext, last_reference_offset);
+    std::tie(reconstructed_degree, reference_offset) =
+        ReadDegreeAndRefBits(first_node_in_chunk, bit_pos[0],
+                             kFirstDegreeContext, last_reference_offset);
     if (reconstructed_degree != 0) {
       last_reference_offset = reference_offset;
     }
@@ -101,167 +408,134 @@ std::vector<uint32_t> CompressedGraph::Neighbours(size_t node_id) {
     for (int node = first_node_in_chunk + 1; node < node_id; ++node) {
       context = DegreeContext(last_degree_delta);
       std::tie(last_degree_delta, reference_offset) =
-          ReadDegreeAndRefBits(node, context, last_reference_offset);
+          ReadDegreeAndRefBits(node, bit_pos[node - first_node_in_chunk],
+                               context, last_reference_offset);
       reconstructed_degree += UnpackSigned(last_degree_delta);
       if (reconstructed_degree != 0) {
         last_reference_offset = reference_offset;
       }
     }
     context = DegreeContext(last_degree_delta);
-    last_degree_delta = IntegerCoder::Read(context, &bit_reader, &huff_reader_);
+    last_degree_delta = IntegerCoder::Read(context, &bit_reader, huff_reader);
     reconstructed_degree += UnpackSigned(last_degree_delta);
   } else {
     reconstructed_degree =
-        IntegerCoder::Read(kFirstDegreeContext, &bit_reader, &huff_reader_);
+        IntegerCoder::Read(kFirstDegreeContext, &bit_reader, huff_reader);
   }
+  StartList(node_id, segment_id, reconstructed_degree, last_reference_offset,
+            bit_pos, &bit_reader, output_space, scratch, list);
+}
+
+void CompressedGraph::StartList(size_t node_id, size_t segment_id,
+                                uint32_t reconstructed_degree,
+                                size_t last_reference_offset,
+                                const size_t* chunk_bit_pos,
+                                BitReader* reader, bool output_space,
+                                Scratch* scratch, ListDecoder* list) {
+  const GraphSegment& segment = segments_[segment_id];
+  HuffmanReader* huff_reader = &huff_readers_[segment_id];
+  BitReader& bit_reader = *reader;
+  uint32_t first_node_in_chunk = node_id - node_id % kDegreeReferenceChunkSize;
+  size_t reference_offset = 0;
 
-  if (reconstructed_degree == 0) return {};
+  if (reconstructed_degree == 0) return;
 
-  if (node_id != 0) {
+  if (node_id != segment.first_node) {
     reference_offset = IntegerCoder::Read(
-        ReferenceContext(last_reference_offset), &bit_reader, &huff_reader_);
+        ReferenceContext(last_reference_offset), &bit_reader, huff_reader);
   }
 
   if (reconstructed_degree > num_nodes_) ZKR_ABORT("Invalid degree");
-  if (reference_offset > node_id) ZKR_ABORT("Invalid reference_offset");
+  if (reference_offset > node_id - segment.first_node) {
+    ZKR_ABORT("Invalid reference_offset");
+  }
 
-  std::vector<uint32_t> ref_list;
-  std::vector<uint32_t> block_lengths;
+  // The reference list, if any, goes at `list_begin`.
+  const size_t list_begin = scratch->edges.size();
+  const size_t blocks_begin = scratch->block_lengths.size();
+  size_t ref_size = 0;
   // If a reference_offset is used, read the list of blocks of (alternating)
   // copied and skipped edges.
   size_t num_to_copy = 0;
   if (reference_offset != 0) {
     size_t ref_id = node_id - reference_offset;
-    ref_list = Neighbours(ref_id);
+    // References to the same chunk reuse the positions read above.
+    ref_size = DecodeNeighbours(
+        ref_id, ref_id >= first_node_in_chunk ? chunk_bit_pos : nullptr,
+        scratch);
     size_t block_count =
-        IntegerCoder::Read(kBlockCountContext, &bit_reader, &huff_reader_);
+        IntegerCoder::Read(kBlockCountContext, &bit_reader, huff_reader);
     size_t block_end = 0;  // end of current block
     for (size_t j = 0; j < block_count; j++) {
       size_t ctx = j == 0 ? kBlockContext
                           : (j % 2 == 0 ? kBlockContextEven : kBlockContextOdd);
       size_t block_len;
       if (j == 0) {
-        block_len = IntegerCoder::Read(ctx, &bit_reader, &huff_reader_);
+        block_len = IntegerCoder::Read(ctx, &bit_reader, huff_reader);
       } else {
-        block_len = IntegerCoder::Read(ctx, &bit_reader, &huff_reader_) + 1;
+        block_len = IntegerCoder::Read(ctx, &bit_reader, huff_reader) + 1;
       }
       block_end += block_len;
-      block_lengths.push_back(block_len);
+      scratch->block_lengths.push_back(block_len);
     }
-    if (ref_list.size() < block_end) {
+    if (ref_size < block_end) {
       ZKR_ABORT("Invalid block copy pattern");
     }
     // Last block is implicit and goes to the end of the reference list.
-    block_lengths.push_back(ref_list.size() - block_end);
+    scratch->block_lengths.push_back(ref_size - block_end);
     // Blocks in even positions are to be copied.
-    for (size_t i = 0; i < block_lengths.size(); i += 2) {
-      num_to_copy += block_lengths[i];
+    for (size_t i = blocks_begin; i < scratch->block_lengths.size(); i += 2) {
+      num_to_copy += scratch->block_lengths[i];
+    }
+    if (num_to_copy > reconstructed_degree) {
+      ZKR_ABORT("Invalid block copy pattern");
     }
   }
-
-  // reference_offset node for delta-coding of neighbours.
-  size_t last_dest_plus_one = 0;  // will not be used
-  // Number of edges to read.
-  size_t num_residuals = reconstructed_degree - num_to_copy;
-  // Last delta for the residual edges, used for context modeling.
-  size_t last_residual_delta = 0;
-  // Current position in the reference list (because we are making a sorted
-  // merged list).
-  size_t ref_pos = 0;
-  // Number of nodes of the current block that should still be copied.
-  size_t num_to_copy_from_current_block =
-      block_lengths.empty() ? 0 : block_lengths[0];
-  // Index of the next block.
-  size_t next_block = 1;
-  // If we don't need to copy anything from the first block, and we have at
-  // least another even-positioned block, advance the position in the
-  // reference_offset list accordingly.
-  if (num_to_copy_from_current_block == 0 && block_lengths.size() > 2) {
-    ref_pos = block_lengths[1];
-    num_to_copy_from_current_block = block_lengths[2];
-    next_block = 3;
+  if (output_space) {
+    scratch->edges.resize(list_begin + ref_size + reconstructed_degree);
   }
+  list->Start(node_id, num_nodes_, reconstructed_degree,
+              scratch->edges.data() + list_begin, ref_size,
+              scratch->block_lengths.data() + blocks_begin,
+              scratch->block_lengths.size() - blocks_begin, num_to_copy,
+              huff_reader);
+}
 
-  // Number of consecutive zeros that have been decoded last.
-  // Delta encoding with -1.
-  size_t contiguous_zeroes_len = 0;
-  // Number of further zeros that should not be read from the bitstream.
-  size_t num_zeros_to_skip = 0;
-  const auto append = [&](size_t destination) {
-    if (destination >= num_nodes_) return ZKR_FAILURE("Invalid residual");
-    neighbours.push_back(destination);
-    return true;
-  };
-  for (size_t j = 0; j < num_residuals; j++) {
-    size_t destination_node;
-    if (j == 0) {
-      last_residual_delta = IntegerCoder::Read(
-          FirstResidualContext(num_residuals), &bit_reader, &huff_reader_);
-      destination_node = node_id + UnpackSigned(last_residual_delta);
-    } else if (num_zeros_to_skip >
-               0) {  // If in a zero run, don't read anything.
-      last_residual_delta = 0;
-      destination_node = last_dest_plus_one;
-    } else {
-      last_residual_delta = IntegerCoder::Read(
-          ResidualContext(last_residual_delta), &bit_reader, &huff_reader_);
-      destination_node = last_dest_plus_one + last_residual_delta;
-    }
-    // Compute run of zeros if we read a zero and we are not already in one.
-    if (last_residual_delta == 0 && num_zeros_to_skip == 0) {
-      contiguous_zeroes_len++;
-    } else {
-      contiguous_zeroes_len = 0;
-    }
-    // If we are in a run of zeros, decrease its length.
-    if (num_zeros_to_skip > 0) {
-      num_zeros_to_skip--;
-    }
-    // Merge the edges copied from the reference_offset list with the ones
-    // read from the bitstream.
-    while (num_to_copy_from_current_block > 0 &&
-           ref_list[ref_pos] <= destination_node) {
-      num_to_copy_from_current_block--;
-      if (!append(ref_list[ref_pos])) ZKR_ABORT("Invalid residual");
-      // If our delta coding would produce an edge to destination_node, but y
-      // with y<=destination_node is copied from the reference_offset list, we
-      // increase destination_node. In other words, it's delta coding with
-      // respect to both lists (ref_list and residuals).
-      if (j != 0 && ref_list[ref_pos] >= last_dest_plus_one) {
-        destination_node++;
-      }
-      ref_pos++;
-      if (num_to_copy_from_current_block == 0 &&
-          next_block + 1 < block_lengths.size()) {
-        ref_pos += block_lengths[next_block];
-        num_to_copy_from_current_block = block_lengths[next_block + 1];
-        next_block += 2;
-      }
-    }
-    // If the current run of zeros is large enough, read how many further
-    // zeros to decode from the bitstream.
-    if (contiguous_zeroes_len >= kRleMin) {
-      num_zeros_to_skip =
-          IntegerCoder::Read(kRleContext, &bit_reader, &huff_reader_);
-      contiguous_zeroes_len = 0;
-    }
-    if (!append(destination_node)) ZKR_ABORT("Invalid residual");
-    last_dest_plus_one = destination_node + 1;
-  }
-  ZKR_ASSERT(ref_pos + num_to_copy_from_current_block <= ref_list.size());
-  // Process the rest of the block-copy list.
-  while (num_to_copy_from_current_block > 0) {
-    num_to_copy_from_current_block--;
-    if (!append(ref_list[ref_pos])) ZKR_ABORT("Invalid residual");
-    ref_pos++;
-    if (num_to_copy_from_current_block == 0 &&
-        next_block + 1 < block_lengths.size()) {
-      ref_pos += block_lengths[next_block];
-      num_to_copy_from_current_block = block_lengths[next_block + 1];
-      next_block += 2;
-    }
+NeighbourCursor::NeighbourCursor(CompressedGraph* graph, size_t node_id,
+                                 CompressedGraph::Scratch* scratch)
+    : scratch_(scratch != nullptr ? scratch : &CursorScratch()),
+      cached_(LookupCache(graph, node_id)),
+      reader_(graph->compressed_,
+              cached_ ? 0
+                      : graph->NodeStart(node_id, &chunk_bit_pos_,
+                                         chunk_bit_pos_storage_),
+              graph->size_) {
+  if (cached_) {
+    // The cached list is copied as a single block.
+    const size_t degree = scratch_->edges.size();
+    scratch_->block_lengths.push_back(degree);
+    list_.Start(node_id, graph->num_nodes_, degree, scratch_->edges.data(),
+                degree, scratch_->block_lengths.data(), /*blocks_size=*/1,
+                /*num_to_copy=*/degree, /*huffman_reader=*/nullptr);
+    return;
   }
-  return neighbours;
-}  // namespace zuckerli
+  graph->StartNeighbours(node_id, chunk_bit_pos_, &reader_,
+                         /*output_space=*/false, scratch_, &list_);
+}
+
+CompressedGraph::Scratch& NeighbourCursor::CursorScratch() {
+  thread_local CompressedGraph::Scratch scratch;
+  return scratch;
+}
+
+bool NeighbourCursor::LookupCache(CompressedGraph* graph, size_t node_id) {
+  scratch_->edges.clear();
+  scratch_->block_lengths.clear();
+  return graph->cache_ && graph->cache_->Lookup(node_id, &scratch_->edges);
+}
+
+bool NeighbourCursor::Next(uint32_t* neighbour) {
+  return list_.Next(&reader_, neighbour);
+}
 
 }  // namespace zuckerli
@@ -2,36 +2,227 @@
 #define THIRD_PARTY_ZUCKERLI_SRC_COMPRESSED_GRAPH_H_
 
 #include <chrono>
+#include <cstddef>
 #include <iostream>
+#include <iterator>
 #include <limits>
+#include <memory>
 #include <vector>
 
+#include "adjacency_cache.h"
 #include "ans.h"
 #include "bit_reader.h"
 #include "checksum.h"
 #include "common.h"
+#include "container.h"
 #include "context_model.h"
 #include "huffman.h"
 #include "integer_coder.h"
+#include "mapped_file.h"
+#include "node_index.h"
 
 namespace zuckerli {
 
+// Random-access view of a compressed graph. The file is memory-mapped; if it
+// contains a node index, opening it only reads the headers and the entropy
+// coding tables, otherwise the graph is decoded once to build the index.
+// Copies share the mapping. If the file has a degree index (encoder
+// --degree_index), Degree() does no entropy decoding, and Neighbours() only
+// decodes the lists of the node and of its references, rather than also the
+// degrees of the nodes before it in its chunk.
 class CompressedGraph {
  public:
-  CompressedGraph(const std::string &file);
+  CompressedGraph(const std::string &file, bool huge_pages = false);
   ZKR_INLINE size_t size() { return num_nodes_; }
   uint32_t Degree(size_t node_id);
   std::vector<uint32_t> Neighbours(size_t node_id);
+  // Replaces the contents of `out` with the neighbours of `node_id` and
+  // returns their number. Does not allocate once `out` has room for the list
+  // and for the lists it copies edges from. If not null, `decoded_edges`
+  // receives the number of edges decoded from the file, which includes those
+  // of the reference lists and excludes the lists found in the cache.
+  size_t NeighboursInto(size_t node_id, std::vector<uint32_t> *out,
+                        size_t *decoded_edges = nullptr);
+
+  // Keeps up to about `capacity_bytes` of decoded lists in an AdjacencyCache
+  // split in `num_shards` shards, which serves Neighbours() as well as the
+  // reference lists it decodes. Copies made afterwards share the cache.
+  void EnableCache(size_t capacity_bytes, size_t num_shards = 16);
+  // Counters of the cache; all zero without one.
+  AdjacencyCacheStats CacheStats() const;
+
+  // Buffers used while decoding adjacency lists. Lists are decoded on a stack
+  // of edges: the reference list of a node is decoded where the node's own
+  // list will go, its list right after it, and then moved down.
+  struct Scratch {
+    std::vector<uint32_t> edges;
+    std::vector<size_t> block_lengths;
+    // Edges decoded from the file, reference lists included.
+    size_t decoded_edges = 0;
+  };
 
  private:
+  friend class NeighbourCursor;
+
+  // Merge of the residuals of a list, read from the bitstream, with the edges
+  // it copies from its reference list, one neighbour at a time.
+  struct ListDecoder {
+    void Start(size_t node, size_t num_nodes_in_graph, size_t list_degree,
+               const uint32_t *reference_list, size_t reference_size,
+               const size_t *blocks, size_t blocks_size, size_t num_to_copy,
+               HuffmanReader *huffman_reader);
+    // Sets `*neighbour` to the next neighbour, reading its residual from
+    // `reader` if needed, or returns false at the end of the list.
+    bool Next(BitReader *reader, uint32_t *neighbour);
+    void ReadResidual(BitReader *reader);
+    uint32_t Copy();
+
+    size_t node_id = 0;
+    size_t num_nodes = 0;
+    size_t degree = 0;
+    HuffmanReader *huff_reader = nullptr;
+    ChainedIntegerReader<HuffmanReader> residual_reader{nullptr};
+    const uint32_t *ref_list = nullptr;
+    size_t ref_size = 0;
+    // Lengths of the blocks of copied and skipped edges of ref_list.
+    const size_t *block_lengths = nullptr;
+    size_t num_blocks = 0;
+    // Index of the next block.
+    size_t next_block = 1;
+    // Current position in the reference list (because we are making a sorted
+    // merged list).
+    size_t ref_pos = 0;
+    // Number of nodes of the current block that should still be copied.
+    size_t num_to_copy_from_current_block = 0;
+    // Number of edges to read, and index of the next one.
+    size_t num_residuals = 0;
+    size_t residual = 0;
+    // Last delta for the residual edges, used for context modeling.
+    size_t last_residual_delta = 0;
+    size_t last_dest_plus_one = 0;
+    // Number of consecutive zeros that have been decoded last.
+    // Delta encoding with -1.
+    size_t contiguous_zeroes_len = 0;
+    // Number of further zeros that should not be read from the bitstream.
+    size_t num_zeros_to_skip = 0;
+    // Last residual read, not returned yet because edges of the reference
+    // list that come before it are returned first.
+    bool has_pending = false;
+    size_t pending = 0;
+  };
+
   size_t num_nodes_;
-  std::vector<uint8_t> compressed_;
-  std::vector<size_t> node_start_indices_;
-  HuffmanReader huff_reader_;
+  std::shared_ptr<const MappedFile> file_;
+  const uint8_t *compressed_;
+  size_t size_;
+  // Bit position of the start of each node.
+  NodeIndex node_start_indices_;
+  // Storage of node_start_indices_ for files without a node index.
+  std::shared_ptr<const std::vector<uint8_t>> built_index_;
+  // Cumulative degrees and reference offsets of the nodes, if the file has
+  // them.
+  NodeIndex degree_index_;
+  ReferenceOffsets reference_offsets_;
+  std::vector<GraphSegment> segments_;
+  // Entropy decoder of each segment.
+  std::vector<HuffmanReader> huff_readers_;
+  std::shared_ptr<AdjacencyCache> cache_;
 
-  uint32_t ReadDegreeBits(uint32_t node_id, size_t context);
+  // Returns the bit position of `node_id`. `*chunk_bit_pos`, if not null,
+  // holds the bit positions of the nodes of the chunk of `node_id`, up to
+  // `node_id`; if it is null and the file has no degree index, they are read
+  // into `storage` and `*chunk_bit_pos` points to them.
+  size_t NodeStart(size_t node_id, const size_t **chunk_bit_pos,
+                   size_t *storage);
+  // Appends the neighbours of `node_id` to the edges of `scratch`, using the
+  // space after them to decode its reference list, and returns the degree.
+  // `chunk_bit_pos` is as in NodeStart().
+  size_t DecodeNeighbours(size_t node_id, const size_t *chunk_bit_pos,
+                          Scratch *scratch);
+  // Reads the degree of `node_id` from `reader`, at the start of the node,
+  // appends its reference list to the edges of `scratch`, followed by room
+  // for the list if `output_space`, and starts `list`. `chunk_bit_pos` must
+  // be as set by NodeStart().
+  void StartNeighbours(size_t node_id, const size_t *chunk_bit_pos,
+                       BitReader *reader, bool output_space, Scratch *scratch,
+                       ListDecoder *list);
+  // Rest of StartNeighbours(), once the degree of `node_id` has been read
+  // by `reader`, given the reference offset of the last node with edges before
+  // it in its chunk.
+  void StartList(size_t node_id, size_t segment_id,
+                 uint32_t reconstructed_degree, size_t last_reference_offset,
+                 const size_t *chunk_bit_pos, BitReader *reader,
+                 bool output_space, Scratch *scratch, ListDecoder *list);
+  uint32_t ReadDegreeBits(uint32_t node_id, size_t bit_pos, size_t context);
   std::pair<uint32_t, size_t> ReadDegreeAndRefBits(
-      uint32_t node_id, size_t context, size_t last_reference_offset);
+      uint32_t node_id, size_t bit_pos, size_t context,
+      size_t last_reference_offset);
+};
+
+// Forward iteration over the neighbours of a node that decodes them as they
+// are requested, so that consumers that stop early (existence checks, samples
+// of the first edges) skip the rest of the list; the lists it copies edges
+// from are still decoded in full. Decodes into `scratch`, or if it is null
+// into a buffer of the thread that other cursors of the thread must not use
+// while this one is alive. Does not allocate once the buffer is large enough.
+//
+//   NeighbourCursor cursor(&graph, node);
+//   for (uint32_t neighbour : cursor) {
+//     if (neighbour == target) break;
+//   }
+class NeighbourCursor {
+ public:
+  NeighbourCursor(CompressedGraph *graph, size_t node_id,
+                  CompressedGraph::Scratch *scratch = nullptr);
+  NeighbourCursor(const NeighbourCursor &) = delete;
+  NeighbourCursor &operator=(const NeighbourCursor &) = delete;
+
+  size_t degree() const { return list_.degree; }
+
+  // Sets `*neighbour` to the next neighbour and returns true, or returns false
+  // at the end of the list.
+  bool Next(uint32_t *neighbour);
+
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = uint32_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const uint32_t *;
+    using reference = const uint32_t &;
+
+    Iterator() = default;
+    explicit Iterator(NeighbourCursor *cursor) : cursor_(cursor) { ++*this; }
+    reference operator*() const { return neighbour_; }
+    Iterator &operator++() {
+      if (!cursor_->Next(&neighbour_)) cursor_ = nullptr;
+      return *this;
+    }
+    bool operator==(const Iterator &other) const {
+      return cursor_ == other.cursor_;
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+   private:
+    NeighbourCursor *cursor_ = nullptr;
+    uint32_t neighbour_ = 0;
+  };
+  // The cursor can be iterated over once.
+  Iterator begin() { return Iterator(this); }
+  Iterator end() { return Iterator(); }
+
+ private:
+  static CompressedGraph::Scratch &CursorScratch();
+  // Clears the scratch and appends the list of `node_id` to it if it is
+  // cached.
+  bool LookupCache(CompressedGraph *graph, size_t node_id);
+
+  CompressedGraph::Scratch *scratch_;
+  bool cached_;
+  size_t chunk_bit_pos_storage_[kDegreeReferenceChunkSize];
+  const size_t *chunk_bit_pos_ = nullptr;
+  BitReader reader_;
+  CompressedGraph::ListDecoder list_;
 };
 
 }  // namespace zuckerli
@@ -0,0 +1,268 @@
+#ifndef ZUCKERLI_CONTAINER_H
+#define ZUCKERLI_CONTAINER_H
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bit_reader.h"
+#include "checksum.h"
+#include "common.h"
+#include "context_model.h"
+
+namespace zuckerli {
+
+// Layout of a compressed graph.
+//
+// A legacy file is a single stream: the number of nodes N (48 bits), whether
+// random access is allowed (1 bit), then the entropy coding tables and the
+// tokens of all the nodes.
+//
+// A segmented file sets kSegmentedContainerBit in the 48-bit node count and
+// splits the graph into segments, i.e. ranges of consecutive nodes that are
+// coded independently of each other, each with its own entropy coding tables.
+// Its header is byte-aligned:
+// - 48 bits: N | kSegmentedContainerBit
+// - 1 bit: whether random access is allowed
+// - 15 bits: format flags:
+//   - bits 0-1: log2 of the number of interleaved ANS states of sequential
+//     files (see ANSEncode); zero for random-access files.
+//   - bit 2 (kSectionsFlag): whether the segment table is followed by a
+//     section table.
+//   - bit 3 (kColumnTilesFlag): whether the graph is split in column tiles.
+//   - other bits: reserved (zero)
+// - 32 bits: number of segments S
+// - if kColumnTilesFlag is set, 32 bits for the number of column tiles T, then
+//   T times 64 bits for the first column of the tile; otherwise T = 1.
+// - T * S times: 64 bits for the first node of the segment and 64 bits for the
+//   byte offset of its stream in the file.
+// - if kSectionsFlag is set, 32 bits for the number of sections, then for each
+//   section 64 bits for its type, 64 bits for its byte offset and 64 bits for
+//   its size in bytes. Sections hold auxiliary data that is not needed to
+//   decode the graph (see GraphSection); readers ignore unknown types.
+// Segments start at multiples of kDegreeReferenceChunkSize, in increasing
+// order; the first one starts at node 0. Each stream has the same structure as
+// the part of a legacy file after the first 49 bits; the first node of a
+// segment is coded like node 0 of a legacy file. Neighbours are global node
+// ids, and references never cross the start of a segment.
+//
+//
+// A column-tiled file splits the node ids into T ranges of consecutive
+// columns, and codes for each of them the sub-graph of the edges whose
+// neighbour is in the range, as S segments; the segments of tile t are
+// entries [t * S, (t + 1) * S) of the segment table, and all the tiles have
+// the same segment boundaries. Every row is thus split across the T tiles,
+// and a matrix-vector product that handles one tile at a time only reads the
+// slice of the input vector of that tile (see SpMVEngine).
+//
+// Since segments can be decoded in any order, the checksum of a segmented
+// graph is obtained by combining the checksums of the edges of each segment
+// with SegmentedChecksum, in the order of the segment table.
+static constexpr size_t kSegmentedContainerBit = 1ull << 47;
+static constexpr size_t kFormatFlagsBits = 15;
+static constexpr uint32_t kLog2ANSStatesMask = 0x3;
+static constexpr uint32_t kSectionsFlag = 0x4;
+static constexpr uint32_t kColumnTilesFlag = 0x8;
+
+// Types of sections.
+// Index of the bit positions of the nodes of a random-access file (see
+// node_index.h), in node order.
+static constexpr uint64_t kNodeIndexSection = 1;
+// Number of rows in which each node appears as a neighbour, i.e. the column
+// counts of the matrix (see outdeg.h), as N LEB128 varints in node order.
+static constexpr uint64_t kColumnCountSection = 2;
+// Cumulative degrees of the nodes, i.e. the N + 1 sums of the degrees of the
+// nodes before each node and of all of them, in the format of the node index
+// (see node_index.h), so that degrees are read without entropy decoding.
+static constexpr uint64_t kDegreeIndexSection = 3;
+// Reference offset of each node (see ReferenceOffsets in node_index.h), which
+// with the degrees gives the contexts of the first symbols of any node.
+static constexpr uint64_t kReferenceOffsetSection = 4;
+
+// A range of nodes whose adjacency lists are coded as one stream.
+struct GraphSegment {
+  size_t first_node;
+  size_t num_nodes;
+  // Position of the first bit of the stream in the file.
+  size_t bit_offset;
+};
+
+// A range of columns of a column-tiled graph, and its segments in the segment
+// table of the header.
+struct ColumnTile {
+  size_t first_column;
+  size_t num_columns;
+  size_t first_segment;
+};
+
+// A byte range of the file holding auxiliary data.
+struct GraphSection {
+  uint64_t type;
+  size_t byte_offset;
+  size_t size;
+};
+
+struct GraphHeader {
+  size_t num_nodes;
+  bool allow_random_access;
+  bool segmented;
+  uint32_t flags;
+  // Number of interleaved ANS states of each segment of a sequential file.
+  size_t num_ans_states;
+  // The segments of all the tiles, in file order.
+  std::vector<GraphSegment> segments;
+  // Empty unless the graph is column-tiled.
+  std::vector<ColumnTile> tiles;
+  std::vector<GraphSection> sections;
+};
+
+// Returns the first section of the given type, or nullptr if there is none.
+inline const GraphSection *FindSection(const GraphHeader &header,
+                                       uint64_t type) {
+  for (const GraphSection &section : header.sections) {
+    if (section.type == type) return &section;
+  }
+  return nullptr;
+}
+
+ZKR_INLINE size_t SegmentedChecksum(size_t chk, size_t first_node,
+                                    size_t segment_chk) {
+  return Checksum(chk, segment_chk, first_node);
+}
+
+namespace detail {
+ZKR_INLINE uint64_t LoadLE64(const uint8_t *ZKR_RESTRICT data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+}  // namespace detail
+
+// Parses the header of a legacy or segmented compressed graph.
+inline bool ReadGraphHeader(const uint8_t *ZKR_RESTRICT data, size_t size,
+                            GraphHeader *header) {
+  if (size < 8) return ZKR_FAILURE("Truncated header");
+  BitReader reader(data, size);
+  header->num_nodes = reader.ReadBits(48);
+  header->allow_random_access = reader.ReadBits(1);
+  header->segmented = header->num_nodes & kSegmentedContainerBit;
+  header->segments.clear();
+  header->tiles.clear();
+  header->sections.clear();
+  if (!header->segmented) {
+    header->flags = 0;
+    header->num_ans_states = 1;
+    header->segments.push_back({0, header->num_nodes, 49});
+    return true;
+  }
+  header->num_nodes &= ~kSegmentedContainerBit;
+  header->flags = reader.ReadBits(kFormatFlagsBits);
+  if ((header->flags & ~(kLog2ANSStatesMask | kSectionsFlag |
+                         kColumnTilesFlag)) != 0) {
+    return ZKR_FAILURE("Unknown format flags");
+  }
+  header->num_ans_states = 1 << (header->flags & kLog2ANSStatesMask);
+  if (header->allow_random_access && header->num_ans_states != 1) {
+    return ZKR_FAILURE("Invalid format flags");
+  }
+  size_t num_segments = reader.ReadBits(32);
+  size_t num_tiles = 1;
+  size_t segments_begin = 12;
+  if (header->flags & kColumnTilesFlag) {
+    if (size < 16) return ZKR_FAILURE("Invalid tile table");
+    uint32_t count;
+    memcpy(&count, data + 12, sizeof(count));
+    num_tiles = count;
+    segments_begin = 16 + 8 * num_tiles;
+    if (num_tiles == 0 || segments_begin > size) {
+      return ZKR_FAILURE("Invalid tile table");
+    }
+    for (size_t t = 0; t < num_tiles; t++) {
+      size_t first_column = detail::LoadLE64(data + 16 + 8 * t);
+      if (t == 0 ? first_column != 0
+                 : first_column <= header->tiles.back().first_column ||
+                       first_column >= header->num_nodes) {
+        return ZKR_FAILURE("Invalid tile table");
+      }
+      if (t != 0) {
+        header->tiles.back().num_columns =
+            first_column - header->tiles.back().first_column;
+      }
+      header->tiles.push_back({first_column, 0, t * num_segments});
+    }
+    header->tiles.back().num_columns =
+        header->num_nodes - header->tiles.back().first_column;
+  }
+  size_t num_entries = num_segments * num_tiles;
+  if (num_segments == 0 || segments_begin > size ||
+      num_entries > (size - segments_begin) / 16) {
+    return ZKR_FAILURE("Invalid segment table");
+  }
+  size_t table_end = segments_begin + 16 * num_entries;
+  size_t sections_begin = table_end;
+  size_t num_sections = 0;
+  if (header->flags & kSectionsFlag) {
+    if (table_end + 4 > size) return ZKR_FAILURE("Invalid section table");
+    uint32_t count;
+    memcpy(&count, data + table_end, sizeof(count));
+    num_sections = count;
+    sections_begin = table_end + 4;
+    table_end = sections_begin + 24 * num_sections;
+    if (table_end > size) return ZKR_FAILURE("Invalid section table");
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    // Segments restart from node 0 at each tile, at the same nodes.
+    size_t s = i % num_segments;
+    size_t first_node = detail::LoadLE64(data + segments_begin + 16 * i);
+    size_t byte_offset = detail::LoadLE64(data + segments_begin + 8 + 16 * i);
+    if (first_node % kDegreeReferenceChunkSize != 0 ||
+        first_node >= header->num_nodes + (s == 0) ||
+        (s == 0 ? first_node != 0
+                : first_node <= header->segments.back().first_node) ||
+        (i >= num_segments &&
+         first_node != header->segments[s].first_node) ||
+        byte_offset < table_end || byte_offset > size) {
+      return ZKR_FAILURE("Invalid segment table");
+    }
+    if (s != 0) {
+      header->segments.back().num_nodes =
+          first_node - header->segments.back().first_node;
+    } else if (i != 0) {
+      header->segments.back().num_nodes =
+          header->num_nodes - header->segments.back().first_node;
+    }
+    header->segments.push_back({first_node, 0, byte_offset * 8});
+  }
+  header->segments.back().num_nodes =
+      header->num_nodes - header->segments.back().first_node;
+  for (size_t i = 0; i < num_sections; i++) {
+    const uint8_t *entry = data + sections_begin + 24 * i;
+    GraphSection section = {detail::LoadLE64(entry),
+                            detail::LoadLE64(entry + 8),
+                            detail::LoadLE64(entry + 16)};
+    if (section.byte_offset < table_end || section.byte_offset > size ||
+        section.size > size - section.byte_offset) {
+      return ZKR_FAILURE("Invalid section table");
+    }
+    header->sections.push_back(section);
+  }
+  return true;
+}
+
+// Index of the segment that contains `node`.
+ZKR_INLINE size_t SegmentOf(const std::vector<GraphSegment> &segments,
+                            size_t node) {
+  size_t lo = 0, hi = segments.size();
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (segments[mid].first_node <= node) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_CONTAINER_H
@@ -66,6 +66,14 @@ ZKR_INLINE size_t ResidualContext(size_t last_residual) {
 
 static constexpr size_t kNumContexts = kRleContext + 1;
 
+// Residuals smaller than this have no raw bits, and are followed by a residual
+// in context kResidualBaseContext + residual: chains of them can be decoded
+// with multi-symbol tables.
+ZKR_INLINE size_t NumChainedResidualContexts() {
+  return std::min<size_t>(1 << IntegerCoder::Log2NumExplicit(),
+                          kNumResidualContexts);
+}
+
 // Random access only parameters: minimum length for RLE and size of chunk of
 // nodes for which residuals and references are delta-coded.
 static constexpr size_t kDegreeReferenceChunkSize = 32;
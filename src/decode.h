@@ -1,34 +1,94 @@
 #ifndef ZUCKERLI_DECODE_H
 #define ZUCKERLI_DECODE_H
+#include <algorithm>
 #include <chrono>
 #include <limits>
+#include <memory>
 #include <vector>
 
 #include "ans.h"
 #include "bit_reader.h"
 #include "checksum.h"
 #include "common.h"
+#include "container.h"
 #include "context_model.h"
 #include "huffman.h"
 #include "integer_coder.h"
+#include "reference_window.h"
+#include "thread_pool.h"
 
 namespace zuckerli {
+
+// Compile-time policy that receives the adjacency lists as they are decoded by
+// DecodeGraphImpl. For each node, in order, the decoder calls:
+// - RowBegin(node, degree);
+// - if the list has a reference, RowReference(node, reference_offset);
+// - for each neighbour, in increasing order, ResidualEdge(node, neighbour) if
+//   it was coded explicitly, or CopiedEdge(node, neighbour) if it was copied
+//   from the reference list;
+// - if the list has a reference, SkippedBlock(node, neighbours, count) for each
+//   block of the reference list that was not copied;
+// - RowEnd(node, reference_offset), with reference_offset 0 if there is no
+//   reference.
+// Visitors derive from DecodeVisitor and hide the hooks they need; the other
+// ones compile to nothing.
+struct DecodeVisitor {
+  ZKR_INLINE void RowBegin(size_t node, size_t degree) {}
+  ZKR_INLINE void RowReference(size_t node, size_t reference_offset) {}
+  ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {}
+  ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {}
+  ZKR_INLINE void SkippedBlock(size_t node, const uint32_t* neighbours,
+                               size_t count) {}
+  ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {}
+};
+
+// Counts the edges and computes their checksum.
+struct ChecksumVisitor : public DecodeVisitor {
+  size_t edges = 0;
+  size_t checksum = 0;
+  ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+    edges++;
+    checksum = Checksum(checksum, node, neighbour);
+  }
+  ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {
+    ResidualEdge(node, neighbour);
+  }
+};
+
+// Appends the adjacency lists to `neighbours` and their degrees to `degrees`.
+struct CSRVisitor : public DecodeVisitor {
+  std::vector<uint32_t> degrees;
+  std::vector<uint32_t> neighbours;
+  ZKR_INLINE void RowBegin(size_t node, size_t degree) {
+    degrees.push_back(degree);
+  }
+  ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+    neighbours.push_back(neighbour);
+  }
+  ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {
+    neighbours.push_back(neighbour);
+  }
+};
+
 namespace detail {
 
-template <typename Reader, typename CB>
-bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
-                     BitReader* br, const CB& cb,
+// Decodes the nodes of `segment` from `br`, which is positioned at the start
+// of the stream of the segment, and passes them to `visitor`. If not null,
+// `node_start_indices` receives the position of the first bit of each node in
+// the file; positions of `br` are relative to bit `bit_base` of the file.
+template <typename Reader, typename Visitor>
+bool DecodeGraphImpl(size_t N, const GraphSegment& segment,
+                     bool allow_random_access, Reader* reader, BitReader* br,
+                     Visitor* visitor, size_t bit_base,
                      std::vector<size_t>* node_start_indices) {
   using IntegerCoder = zuckerli::IntegerCoder;
   // Storage for the previous up-to-MaxNodesBackwards() lists to be used as a
   // reference.
-  std::vector<std::vector<uint32_t>> prev_lists(
-      std::min(MaxNodesBackwards(), N));
-  std::vector<uint32_t> residuals;
+  ReferenceWindow prev_lists(MaxNodesBackwards());
   std::vector<uint32_t> block_lengths;
-  for (size_t i = 0; i < prev_lists.size(); i++) prev_lists[i].clear();
   size_t rle_min =
       allow_random_access ? kRleMin : std::numeric_limits<size_t>::max();
+  ChainedIntegerReader<Reader> residual_reader(reader);
   // The three quantities below get reset to after kDegreeReferenceChunkSize
   // adjacency lists if in random-access mode.
   //
@@ -38,15 +98,17 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
   size_t last_degree_delta = 0;
   // Last reference offset for context modeling.
   size_t last_reference_offset = 0;
-  for (size_t current_node = 0; current_node < N; current_node++) {
-    size_t i_mod = current_node % MaxNodesBackwards();
-    prev_lists[i_mod].clear();
+  const size_t first_node = segment.first_node;
+  for (size_t current_node = first_node;
+       current_node < first_node + segment.num_nodes; current_node++) {
     block_lengths.clear();
     size_t degree;
-    if (node_start_indices) node_start_indices->push_back(br->NumBitsRead());
+    if (node_start_indices) {
+      (*node_start_indices)[current_node] = bit_base + br->NumBitsRead();
+    }
     if ((allow_random_access &&
          current_node % kDegreeReferenceChunkSize == 0) ||
-        current_node == 0) {
+        current_node == first_node) {
       degree = IntegerCoder::Read(kFirstDegreeContext, br, reader);
       last_degree_delta =
           degree;  // special case: we assume a node -1 with degree 0
@@ -61,18 +123,31 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
     }
     last_degree = degree;
     if (degree > N) return ZKR_FAILURE("Invalid degree");
-    if (degree == 0) continue;
+    uint32_t* list = prev_lists.AddList(current_node, degree);
+    size_t list_size = 0;
+    visitor->RowBegin(current_node, degree);
+    if (degree == 0) {
+      visitor->RowEnd(current_node, 0);
+      continue;
+    }
 
     // If this is not the first node, read the offset of the list to be used as
     // a reference.
     size_t reference_offset = 0;
-    if (current_node != 0) {
+    if (current_node != first_node) {
       reference_offset = IntegerCoder::Read(
           ReferenceContext(last_reference_offset), br, reader);
       last_reference_offset = reference_offset;
     }
-    if (reference_offset > current_node)
+    if (reference_offset > current_node - first_node ||
+        reference_offset >= MaxNodesBackwards())
       return ZKR_FAILURE("Invalid reference_offset");
+    if (reference_offset != 0) {
+      visitor->RowReference(current_node, reference_offset);
+    }
+    // Neighbours of the reference.
+    const uint32_t* ref_list = prev_lists.List(current_node - reference_offset);
+    size_t ref_size = prev_lists.Size(current_node - reference_offset);
 
     // If a reference_offset is used, read the list of blocks of (alternating)
     // copied and skipped edges.
@@ -93,19 +168,18 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
         block_end += block_len;
         block_lengths.push_back(block_len);
       }
-      if (prev_lists[(current_node - reference_offset) % MaxNodesBackwards()]
-              .size() < block_end) {
+      if (ref_size < block_end) {
         return ZKR_FAILURE("Invalid block copy pattern");
       }
       // Last block is implicit and goes to the end of the reference list.
-      block_lengths.push_back(
-          prev_lists[(current_node - reference_offset) % MaxNodesBackwards()]
-              .size() -
-          block_end);
+      block_lengths.push_back(ref_size - block_end);
       // Blocks in even positions are to be copied.
       for (size_t i = 0; i < block_lengths.size(); i += 2) {
         num_to_copy += block_lengths[i];
       }
+      if (num_to_copy > degree) {
+        return ZKR_FAILURE("Invalid block copy pattern");
+      }
     }
 
     // Read all the edges that are not copied.
@@ -132,19 +206,22 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
       num_to_copy_from_current_block = block_lengths[2];
       next_block = 3;
     }
-    // ID of reference list.
-    size_t ref_id = (current_node - reference_offset) % MaxNodesBackwards();
     // Number of consecutive zeros that have been decoded last.
     // Delta encoding with -1.
     size_t contiguous_zeroes_len = 0;
     // Number of further zeros that should not be read from the bitstream.
     size_t num_zeros_to_skip = 0;
-    const auto append = [&](size_t x) {
+    const auto append_residual = [&](size_t x) {
       if (x >= N) return ZKR_FAILURE("Invalid residual");
-      prev_lists[i_mod].push_back(x);
-      cb(current_node, x);
+      list[list_size++] = x;
+      visitor->ResidualEdge(current_node, x);
       return true;
     };
+    const auto append_copied = [&](size_t x) {
+      list[list_size++] = x;
+      visitor->CopiedEdge(current_node, x);
+    };
+    residual_reader.Reset();
     for (size_t j = 0; j < num_residuals; j++) {
       size_t destination_node;
       if (j == 0) {
@@ -156,8 +233,8 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
         last_residual_delta = 0;
         destination_node = last_dest_plus_one;
       } else {
-        last_residual_delta = IntegerCoder::Read(
-            ResidualContext(last_residual_delta), br, reader);
+        last_residual_delta =
+            residual_reader.Read(ResidualContext(last_residual_delta), br);
         destination_node = last_dest_plus_one + last_residual_delta;
       }
       // Compute run of zeros if we read a zero and we are not already in one.
@@ -173,14 +250,14 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
       // Merge the edges copied from the reference_offset list with the ones
       // read from the bitstream.
       while (num_to_copy_from_current_block > 0 &&
-             prev_lists[ref_id][ref_pos] <= destination_node) {
+             ref_list[ref_pos] <= destination_node) {
         num_to_copy_from_current_block--;
-        ZKR_RETURN_IF_ERROR(append(prev_lists[ref_id][ref_pos]));
+        append_copied(ref_list[ref_pos]);
         // If our delta coding would produce an edge to destination_node, but y
         // with y<=destination_node is copied from the reference_offset list, we
         // increase destination_node. In other words, it's delta coding with
-        // respect to both lists (prev_lists and residuals).
-        if (j != 0 && prev_lists[ref_id][ref_pos] >= last_dest_plus_one) {
+        // respect to both lists (ref_list and residuals).
+        if (j != 0 && ref_list[ref_pos] >= last_dest_plus_one) {
           destination_node++;
         }
         ref_pos++;
@@ -194,19 +271,19 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
       // If the current run of zeros is large enough, read how many further
       // zeros to decode from the bitstream.
       if (contiguous_zeroes_len >= rle_min) {
+        residual_reader.Reset();
         num_zeros_to_skip = IntegerCoder::Read(kRleContext, br, reader);
         contiguous_zeroes_len = 0;
       }
 
-      ZKR_RETURN_IF_ERROR(append(destination_node));
+      ZKR_RETURN_IF_ERROR(append_residual(destination_node));
       last_dest_plus_one = destination_node + 1;
     }
-    ZKR_ASSERT(ref_pos + num_to_copy_from_current_block <=
-               prev_lists[ref_id].size());
+    ZKR_ASSERT(ref_pos + num_to_copy_from_current_block <= ref_size);
     // Process the rest of the block-copy list.
     while (num_to_copy_from_current_block > 0) {
       num_to_copy_from_current_block--;
-      ZKR_RETURN_IF_ERROR(append(prev_lists[ref_id][ref_pos]));
+      append_copied(ref_list[ref_pos]);
       ref_pos++;
       if (num_to_copy_from_current_block == 0 &&
           next_block + 1 < block_lengths.size()) {
@@ -215,6 +292,19 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
         next_block += 2;
       }
     }
+    // Blocks in odd positions are skipped.
+    if (reference_offset != 0) {
+      size_t block_begin = 0;
+      for (size_t b = 0; b + 1 < block_lengths.size(); b += 2) {
+        block_begin += block_lengths[b];
+        if (block_lengths[b + 1] != 0) {
+          visitor->SkippedBlock(current_node, ref_list + block_begin,
+                                block_lengths[b + 1]);
+        }
+        block_begin += block_lengths[b + 1];
+      }
+    }
+    visitor->RowEnd(current_node, reference_offset);
   }
   if (!reader->CheckFinalState()) {
     return ZKR_FAILURE("Invalid stream");
@@ -224,31 +314,140 @@ bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
 
 }  // namespace detail
 
-bool DecodeGraph(const std::vector<uint8_t>& compressed,
-                 size_t* checksum = nullptr,
-                 std::vector<size_t>* node_start_indices = nullptr) {
-  if (compressed.empty()) return ZKR_FAILURE("Empty file");
+namespace detail {
+// Entropy decoder of one segment that reads the coding tables once, so that
+// the segment can then be decoded any number of times (e.g. by iterative
+// algorithms). Decoders of different segments can be used concurrently.
+class SegmentDecoder {
+ public:
+  bool Init(span<const uint8_t> compressed, const GraphHeader& header,
+            size_t segment_index) {
+    compressed_ = compressed;
+    num_nodes_ = header.num_nodes;
+    allow_random_access_ = header.allow_random_access;
+    segment_ = header.segments[segment_index];
+    BitReader reader(compressed, segment_.bit_offset);
+    if (allow_random_access_) {
+      huff_reader_.reset(new HuffmanReader());
+      ZKR_RETURN_IF_ERROR(huff_reader_->Init(kNumContexts, &reader));
+      huff_reader_->InitMultiSymbol(kResidualBaseContext,
+                                    NumChainedResidualContexts());
+    } else {
+      ans_reader_.reset(new ANSReader());
+      ZKR_RETURN_IF_ERROR(
+          ans_reader_->Init(kNumContexts, &reader, header.num_ans_states));
+    }
+    stream_bit_offset_ = segment_.bit_offset / 8 * 8 + reader.NumBitsRead();
+    return true;
+  }
+
+  const GraphSegment& segment() const { return segment_; }
+
+  // If not null, `node_start_indices` has an entry for each node of the
+  // graph, and receives the position of the first bit of each node of the
+  // segment in the file.
+  template <typename Visitor>
+  bool Decode(Visitor* visitor,
+              std::vector<size_t>* node_start_indices = nullptr) {
+    BitReader reader(compressed_, stream_bit_offset_);
+    // BitReader positions are relative to the byte of the first bit.
+    const size_t bit_base = stream_bit_offset_ / 8 * 8;
+    if (huff_reader_) {
+      return DecodeGraphImpl(num_nodes_, segment_, allow_random_access_,
+                             huff_reader_.get(), &reader, visitor, bit_base,
+                             node_start_indices);
+    }
+    ans_reader_->Restart();
+    return DecodeGraphImpl(num_nodes_, segment_, allow_random_access_,
+                           ans_reader_.get(), &reader, visitor, bit_base,
+                           node_start_indices);
+  }
+
+ private:
+  span<const uint8_t> compressed_{nullptr, 0};
+  size_t num_nodes_ = 0;
+  bool allow_random_access_ = false;
+  GraphSegment segment_ = {};
+  // Position of the first bit after the coding tables.
+  size_t stream_bit_offset_ = 0;
+  std::unique_ptr<HuffmanReader> huff_reader_;
+  std::unique_ptr<ANSReader> ans_reader_;
+};
+
+// Calls f(s) for each s in [0, num_segments), on the threads of `pool`, or on
+// the calling thread if it is null.
+template <typename F>
+void ForEachSegment(size_t num_segments, ThreadPool* pool, const F& f) {
+  if (pool == nullptr || pool->NumThreads() == 1 || num_segments == 1) {
+    for (size_t s = 0; s < num_segments; s++) f(s);
+    return;
+  }
+  pool->Run(num_segments, [&](size_t s, size_t thread) { f(s); });
+}
+}  // namespace detail
+
+// Entropy decoders of all the segments of a graph. The coding tables (and
+// the multi-symbol tables of random-access files) are built once, by Init(),
+// and are then used by every decode of the graph. Different segments can be
+// decoded concurrently, but each by one thread at a time.
+class GraphDecoder {
+ public:
+  // `compressed` must outlive the decoder. The segments are initialized on
+  // the threads of `pool`, if any.
+  bool Init(span<const uint8_t> compressed, ThreadPool* pool = nullptr) {
+    if (compressed.empty()) return ZKR_FAILURE("Empty file");
+    compressed_ = compressed;
+    ZKR_RETURN_IF_ERROR(
+        ReadGraphHeader(compressed.data(), compressed.size(), &header_));
+    size_t num_segments = header_.segments.size();
+    segments_.clear();
+    segments_.resize(num_segments);
+    std::vector<char> segment_ok(num_segments);
+    detail::ForEachSegment(num_segments, pool, [&](size_t s) {
+      segment_ok[s] = segments_[s].Init(compressed, header_, s);
+    });
+    for (char ok : segment_ok) {
+      if (!ok) return ZKR_FAILURE("Invalid segment");
+    }
+    return true;
+  }
+
+  span<const uint8_t> compressed() const { return compressed_; }
+  const GraphHeader& header() const { return header_; }
+  size_t num_nodes() const { return header_.num_nodes; }
+  size_t num_segments() const { return segments_.size(); }
+  detail::SegmentDecoder& segment(size_t s) { return segments_[s]; }
+
+ private:
+  span<const uint8_t> compressed_{nullptr, 0};
+  GraphHeader header_ = {};
+  std::vector<detail::SegmentDecoder> segments_;
+};
+
+// Segments of segmented files are decoded concurrently on the threads of
+// `pool`, if any.
+inline bool DecodeGraph(GraphDecoder* decoder, size_t* checksum = nullptr,
+                        std::vector<size_t>* node_start_indices = nullptr,
+                        ThreadPool* pool = nullptr) {
   auto start = std::chrono::high_resolution_clock::now();
-  BitReader reader(compressed.data(), compressed.size());
-  size_t N = reader.ReadBits(48);
-  bool allow_random_access = reader.ReadBits(1);
+  const GraphHeader& header = decoder->header();
+  span<const uint8_t> compressed = decoder->compressed();
+  if (node_start_indices) node_start_indices->resize(header.num_nodes);
+  size_t num_segments = header.segments.size();
+  std::vector<ChecksumVisitor> visitors(num_segments);
+  std::vector<char> segment_ok(num_segments);
+  detail::ForEachSegment(num_segments, pool, [&](size_t s) {
+    segment_ok[s] =
+        decoder->segment(s).Decode(&visitors[s], node_start_indices);
+  });
   size_t edges = 0, chksum = 0;
-  auto edge_callback = [&](size_t a, size_t b) {
-    edges++;
-    chksum = Checksum(chksum, a, b);
-  };
-  if (allow_random_access) {
-    HuffmanReader huff_reader;
-    huff_reader.Init(kNumContexts, &reader);
-    ZKR_RETURN_IF_ERROR(
-        detail::DecodeGraphImpl(N, allow_random_access, &huff_reader, &reader,
-                                edge_callback, node_start_indices));
-  } else {
-    ANSReader ans_reader;
-    ans_reader.Init(kNumContexts, &reader);
-    ZKR_RETURN_IF_ERROR(
-        detail::DecodeGraphImpl(N, allow_random_access, &ans_reader, &reader,
-                                edge_callback, node_start_indices));
+  for (size_t s = 0; s < num_segments; s++) {
+    if (!segment_ok[s]) return ZKR_FAILURE("Invalid segment");
+    edges += visitors[s].edges;
+    chksum = header.segmented
+                 ? SegmentedChecksum(chksum, header.segments[s].first_node,
+                                     visitors[s].checksum)
+                 : visitors[s].checksum;
   }
   auto stop = std::chrono::high_resolution_clock::now();
 
@@ -258,9 +457,63 @@ bool DecodeGraph(const std::vector<uint8_t>& compressed,
 
   fprintf(stderr, "Decompressed %.2f ME/s (%zu) from %.2f BPE. Checksum: %lx\n",
           edges / elapsed, edges, 8.0 * compressed.size() / edges, chksum);
+  // Throughput of interleaved ANS streams is meant to be compared with the
+  // single-state one of the same graph.
+  if (!header.allow_random_access) {
+    fprintf(stderr, "Entropy coding: ANS, %zu interleaved state(s)\n",
+            header.num_ans_states);
+  }
   if (checksum) *checksum = chksum;
   return true;
 }
+
+inline bool DecodeGraph(span<const uint8_t> compressed,
+                        size_t* checksum = nullptr,
+                        std::vector<size_t>* node_start_indices = nullptr,
+                        ThreadPool* pool = nullptr) {
+  GraphDecoder decoder;
+  ZKR_RETURN_IF_ERROR(decoder.Init(compressed, pool));
+  return DecodeGraph(&decoder, checksum, node_start_indices, pool);
+}
+
+// Decodes the graph into compressed sparse row form: the neighbours of node i
+// are (*neighbours)[(*offsets)[i], (*offsets)[i + 1]). Column-tiled files
+// are not supported.
+inline bool DecodeGraphToCSR(GraphDecoder* decoder,
+                             std::vector<uint64_t>* offsets,
+                             std::vector<uint32_t>* neighbours,
+                             ThreadPool* pool = nullptr) {
+  const GraphHeader& header = decoder->header();
+  if (!header.tiles.empty()) return ZKR_FAILURE("Column-tiled graph");
+  size_t num_segments = header.segments.size();
+  std::vector<CSRVisitor> visitors(num_segments);
+  std::vector<char> segment_ok(num_segments);
+  detail::ForEachSegment(num_segments, pool, [&](size_t s) {
+    segment_ok[s] = decoder->segment(s).Decode(&visitors[s]);
+  });
+  offsets->assign(1, 0);
+  offsets->reserve(header.num_nodes + 1);
+  neighbours->clear();
+  for (size_t s = 0; s < num_segments; s++) {
+    if (!segment_ok[s]) return ZKR_FAILURE("Invalid segment");
+    for (uint32_t degree : visitors[s].degrees) {
+      offsets->push_back(offsets->back() + degree);
+    }
+    neighbours->insert(neighbours->end(), visitors[s].neighbours.begin(),
+                       visitors[s].neighbours.end());
+    visitors[s] = CSRVisitor();
+  }
+  return true;
+}
+
+inline bool DecodeGraphToCSR(span<const uint8_t> compressed,
+                             std::vector<uint64_t>* offsets,
+                             std::vector<uint32_t>* neighbours,
+                             ThreadPool* pool = nullptr) {
+  GraphDecoder decoder;
+  ZKR_RETURN_IF_ERROR(decoder.Init(compressed, pool));
+  return DecodeGraphToCSR(&decoder, offsets, neighbours, pool);
+}
 }  // namespace zuckerli
 
 #endif  // ZUCKERLI_DECODE_H
@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cstdio>
 
 #include "common.h"
 #include "decode.h"
 #include "encode.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 
@@ -13,17 +16,14 @@ int main(int argc, char** argv) {
   // Ensure that encoder-only flags are recognized by the decoder too.
   (void)absl::GetFlag(FLAGS_allow_random_access);
   (void)absl::GetFlag(FLAGS_greedy_random_access);
-  FILE* in = fopen(absl::GetFlag(FLAGS_input_path).c_str(), "r");
-  ZKR_ASSERT(in);
+  zuckerli::MappedFile data(absl::GetFlag(FLAGS_input_path),
+                            zuckerli::MappedFile::Access::kSequential,
+                            absl::GetFlag(FLAGS_huge_pages));
 
-  fseek(in, 0, SEEK_END);
-  size_t len = ftell(in);
-  fseek(in, 0, SEEK_SET);
-
-  std::vector<uint8_t> data(len);
-  ZKR_ASSERT(fread(data.data(), 1, len, in) == len);
-
-  if (!zuckerli::DecodeGraph(data)) {
+  zuckerli::ThreadPool pool(
+      std::max<int32_t>(absl::GetFlag(FLAGS_num_threads), 1));
+  if (!zuckerli::DecodeGraph(data.bytes(), /*checksum=*/nullptr,
+                             /*node_start_indices=*/nullptr, &pool)) {
     fprintf(stderr, "Invalid graph\n");
     return EXIT_FAILURE;
   }
@@ -9,9 +9,13 @@
 #include "ans.h"
 #include "checksum.h"
 #include "common.h"
+#include "container.h"
 #include "context_model.h"
 #include "huffman.h"
 #include "integer_coder.h"
+#include "node_index.h"
+#include "outdeg.h"
+#include "thread_pool.h"
 #include "absl/flags/flag.h"
 #include "uncompressed_graph.h"
 
@@ -21,8 +25,58 @@ ABSL_FLAG(bool, print_bits_breakdown, false,
 namespace zuckerli {
 
 namespace {
+// Adjacency lists of the nodes in [first_node, first_node + size) of a graph,
+// indexed from 0. Each segment of the graph is encoded as if it was a graph
+// on its own, except for neighbours, which keep their global ids. The lists
+// of a column tile only keep the neighbours in [first_column, end_column).
+class NodeRange {
+ public:
+  NodeRange(const UncompressedGraph &g, size_t first_node, size_t size)
+      : g_(g), first_node_(first_node), size_(size) {}
+  NodeRange(const UncompressedGraph &g, size_t first_node, size_t size,
+            size_t first_column, size_t end_column)
+      : NodeRange(g, first_node, size) {
+    if (first_column == 0 && end_column >= g.size()) return;
+    tile_begin_.resize(size);
+    tile_degree_.resize(size);
+    for (size_t i = 0; i < size; i++) {
+      span<const uint32_t> neighbours = g_.Neighbours(first_node_ + i);
+      const uint32_t *begin = std::lower_bound(
+          neighbours.begin(), neighbours.end(), first_column);
+      const uint32_t *end =
+          std::lower_bound(begin, neighbours.end(), end_column);
+      tile_begin_[i] = begin - neighbours.begin();
+      tile_degree_[i] = end - begin;
+    }
+  }
+  ZKR_INLINE size_t size() const { return size_; }
+  ZKR_INLINE size_t FirstNode() const { return first_node_; }
+  ZKR_INLINE uint32_t Degree(size_t i) const {
+    ZKR_DASSERT(i < size());
+    if (!tile_degree_.empty()) return tile_degree_[i];
+    return g_.Degree(first_node_ + i);
+  }
+  ZKR_INLINE span<const uint32_t> Neighbours(size_t i) const {
+    if (!tile_degree_.empty()) {
+      return span<const uint32_t>(
+          g_.Neighbours(first_node_ + i).data() + tile_begin_[i],
+          tile_degree_[i]);
+    }
+    return g_.Neighbours(first_node_ + i);
+  }
+
+ private:
+  const UncompressedGraph &g_;
+  size_t first_node_;
+  size_t size_;
+  // Position of the first neighbour in the column tile and number of
+  // neighbours in it, for each node; empty if the range has all the columns.
+  std::vector<uint32_t> tile_begin_;
+  std::vector<uint32_t> tile_degree_;
+};
+
 // TODO: consider discarding short "copy" runs.
-void ComputeBlocksAndResiduals(const UncompressedGraph &g, size_t i, size_t ref,
+void ComputeBlocksAndResiduals(const NodeRange &g, size_t i, size_t ref,
                                std::vector<uint32_t> *blocks,
                                std::vector<uint32_t> *residuals) {
   blocks->clear();
@@ -87,7 +141,7 @@ void ComputeBlocksAndResiduals(const UncompressedGraph &g, size_t i, size_t ref,
 
 template <typename CB1, typename CB2>
 void ProcessBlocks(const std::vector<uint32_t> &blocks,
-                   const UncompressedGraph &g, size_t i, size_t reference,
+                   const NodeRange &g, size_t i, size_t reference,
                    CB1 copy_cb, CB2 cb) {
   // TODO: more ctx modeling.
   cb(kBlockCountContext, blocks.size());
@@ -166,6 +220,189 @@ void ProcessResiduals(const std::vector<uint32_t> &residuals, size_t i,
   }
 }
 
+// Number of nodes whose candidate references are scored together, in parallel,
+// before references are selected for them. Bounds the size of the cost table.
+static constexpr size_t kReferenceSearchBlockSize = 1 << 16;
+
+// A candidate reference scored by the reference search; `ref == 0` stands for
+// no candidate. The search estimates the cost of coding a node without a
+// reference against the edges copied by the last scored candidate, so this is
+// tracked explicitly to get the same estimates regardless of how scoring is
+// split across threads.
+struct ScoredCandidate {
+  size_t node = 0;
+  size_t ref = 0;
+  bool operator==(const ScoredCandidate &other) const {
+    return node == other.node && ref == other.ref;
+  }
+};
+
+// Scratch buffers for scoring references; one per thread.
+struct ReferenceSearchScratch {
+  std::vector<uint32_t> residuals;
+  std::vector<uint32_t> blocks;
+  std::vector<uint32_t> adj_block;
+};
+
+// Scores the candidate references of blocks of nodes for a fixed symbol cost
+// table. Since the score of each candidate only depends on the graph, nodes
+// are split across the threads of `pool`, if any; selecting references among
+// the scored candidates is left to the caller.
+class ReferenceSearch {
+ public:
+  ReferenceSearch(const NodeRange &g, bool allow_random_access,
+                  const float *symbol_cost, ThreadPool *pool)
+      : g_(g),
+        allow_random_access_(allow_random_access),
+        symbol_cost_(symbol_cost),
+        scratch_(pool ? pool->NumThreads() : 1),
+        pool_(pool),
+        costs_(kReferenceSearchBlockSize * (SearchNum() + 1)),
+        expected_last_(kReferenceSearchBlockSize) {}
+
+  // Scores all the candidates of the nodes `i` in [begin, end) for which
+  // `selected` is null or `(*selected)[i]` is true.
+  void ScoreBlock(size_t begin, size_t end, const std::vector<bool> *selected) {
+    ZKR_ASSERT(end - begin <= kReferenceSearchBlockSize);
+    begin_ = begin;
+    size_t num_threads = scratch_.size();
+    size_t per_thread = DivCeil(end - begin, num_threads);
+    const auto score = [&](size_t t) {
+      size_t thread_begin = std::min(end, begin + t * per_thread);
+      size_t thread_end = std::min(end, thread_begin + per_thread);
+      ReferenceSearchScratch *scratch = &scratch_[t];
+      // Last node selected before the current one, if any.
+      size_t prev = thread_begin;
+      bool has_prev = false;
+      while (prev > 0) {
+        prev--;
+        if (!selected || (*selected)[prev]) {
+          has_prev = true;
+          break;
+        }
+      }
+      // Whether scratch->adj_block holds the edges copied by the farthest
+      // reference of `prev`.
+      bool has_prev_adj_block = false;
+      for (size_t i = thread_begin; i < thread_end; i++) {
+        if (selected && !(*selected)[i]) continue;
+        float *costs = &costs_[(i - begin) * (SearchNum() + 1)];
+        // Unless references are skipped, the last candidate scored before
+        // node `i` is the farthest reference of the previous selected node.
+        ScoredCandidate &expected_last = expected_last_[i - begin];
+        expected_last = ScoredCandidate();
+        if (has_prev && prev != 0) {
+          expected_last.node = prev;
+          expected_last.ref = std::min(SearchNum(), prev);
+          if (!has_prev_adj_block) {
+            CopiedEdges(expected_last, scratch, &scratch->adj_block);
+          }
+          costs[0] = NoReferenceCost(i, scratch->adj_block, scratch);
+        }
+        // Candidates are scored in increasing order, so this leaves the edges
+        // copied by the farthest reference in scratch->adj_block.
+        for (size_t ref = 1; ref < std::min(SearchNum(), i) + 1; ref++) {
+          costs[ref] = ReferenceCost(i, ref, scratch);
+        }
+        prev = i;
+        has_prev = true;
+        has_prev_adj_block = i != 0;
+      }
+    };
+    if (pool_) {
+      pool_->Run(num_threads, [&](size_t t, size_t thread) { score(t); });
+    } else {
+      score(0);
+    }
+  }
+
+  // Cost of coding node `i` without a reference, when `last` is the last
+  // candidate that was scored before it.
+  float NoReferenceCost(size_t i, const ScoredCandidate &last) {
+    if (expected_last_[i - begin_].ref != 0 &&
+        expected_last_[i - begin_] == last) {
+      return costs_[(i - begin_) * (SearchNum() + 1)];
+    }
+    CopiedEdges(last, &scratch_[0], &last_adj_block_);
+    return NoReferenceCost(i, last_adj_block_, &scratch_[0]);
+  }
+
+  // Cost of coding node `i` using reference `ref`.
+  float ReferenceCost(size_t i, size_t ref) const {
+    return costs_[(i - begin_) * (SearchNum() + 1) + ref];
+  }
+
+ private:
+  float NoReferenceCost(size_t i, const std::vector<uint32_t> &adj_block,
+                        ReferenceSearchScratch *scratch) const {
+    float c = 0;
+    scratch->residuals.assign(g_.Neighbours(i).begin(), g_.Neighbours(i).end());
+    ProcessResiduals(scratch->residuals, g_.FirstNode() + i, adj_block,
+                     allow_random_access_, RleUndo{symbol_cost_, &c},
+                     TokenCost{symbol_cost_, &c});
+    return c;
+  }
+
+  float ReferenceCost(size_t i, size_t ref,
+                      ReferenceSearchScratch *scratch) const {
+    float c = 0;
+    scratch->adj_block.clear();
+    ComputeBlocksAndResiduals(g_, i, ref, &scratch->blocks,
+                              &scratch->residuals);
+    ProcessBlocks(
+        scratch->blocks, g_, i, ref,
+        [&](size_t x) { scratch->adj_block.push_back(x); },
+        TokenCost{symbol_cost_, &c});
+    ProcessResiduals(scratch->residuals, g_.FirstNode() + i,
+                     scratch->adj_block, allow_random_access_,
+                     RleUndo{symbol_cost_, &c}, TokenCost{symbol_cost_, &c});
+    return c;
+  }
+
+  // Edges copied by `candidate`.
+  void CopiedEdges(const ScoredCandidate &candidate,
+                   ReferenceSearchScratch *scratch,
+                   std::vector<uint32_t> *adj_block) const {
+    adj_block->clear();
+    if (candidate.ref == 0) return;
+    ComputeBlocksAndResiduals(g_, candidate.node, candidate.ref,
+                              &scratch->blocks, &scratch->residuals);
+    ProcessBlocks(
+        scratch->blocks, g_, candidate.node, candidate.ref,
+        [&](size_t x) { adj_block->push_back(x); }, [](size_t, size_t) {});
+  }
+
+  struct TokenCost {
+    const float *symbol_cost;
+    float *c;
+    void operator()(size_t ctx, size_t v) const {
+      *c += IntegerCoder::Cost(ctx, v, symbol_cost);
+    }
+  };
+
+  // Very rough estimate.
+  struct RleUndo {
+    const float *symbol_cost;
+    float *c;
+    void operator()() const {
+      *c -= symbol_cost[kResidualBaseContext * kNumSymbols];
+    }
+  };
+
+  const NodeRange &g_;
+  bool allow_random_access_;
+  const float *symbol_cost_;
+  std::vector<ReferenceSearchScratch> scratch_;
+  // Runs the scoring of each block, with one task per scratch buffer.
+  ThreadPool *pool_;
+  size_t begin_ = 0;
+  // Row-major table of (SearchNum() + 1) costs per node; entry 0 is the cost
+  // without a reference against the edges copied by `expected_last_`.
+  std::vector<float> costs_;
+  std::vector<ScoredCandidate> expected_last_;
+  std::vector<uint32_t> last_adj_block_;
+};
+
 void UpdateReferencesForMaxLength(const std::vector<float> &saved_costs,
                                   std::vector<size_t> &references,
                                   size_t max_length) {
@@ -238,18 +475,18 @@ void UpdateReferencesForMaxLength(const std::vector<float> &saved_costs,
   }
   fprintf(stderr, "has ref post: %lu\n", has_ref);
 }
-}  // namespace
 
-std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
-                                 bool allow_random_access, size_t *checksum) {
-  auto start = std::chrono::high_resolution_clock::now();
+// Selects references for the nodes of `g` and writes the entropy coding
+// tables and tokens of their adjacency lists to `writer`, using
+// `num_ans_states` interleaved ANS states in sequential mode. The reference
+// search runs on `pool`, if any.
+void EncodeNodeRange(const NodeRange &g, bool allow_random_access,
+                     size_t num_ans_states, ThreadPool *pool,
+                     bool print_progress, BitWriter *writer,
+                     std::vector<double> *bits_per_ctx,
+                     std::vector<size_t> *node_bit_pos = nullptr,
+                     std::vector<uint8_t> *node_references = nullptr) {
   size_t N = g.size();
-  size_t chksum = 0;
-  size_t edges = 0;
-  BitWriter writer;
-  writer.Reserve(64);
-  writer.Write(48, N);
-  writer.Write(1, allow_random_access);
   size_t with_blocks = 0;
   IntegerData tokens;
   size_t ref = 0;
@@ -265,12 +502,15 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
   for (size_t i = 0; i < kNumContexts; i++) {
     symbol_count[i].resize(kNumSymbols, 0);
   }
+  ScoredCandidate last_scored;
 
   // More rounds improve compression a bit, but are also much slower.
   // TODO: sometimes, it actually makes things worse (???). Might be max
   // chain length.
   for (size_t round = 0; round < absl::GetFlag(FLAGS_num_rounds); round++) {
-    fprintf(stderr, "Selecting references, round %lu%20s\n", round + 1, "");
+    if (print_progress) {
+      fprintf(stderr, "Selecting references, round %lu%20s\n", round + 1, "");
+    }
     std::fill(references.begin(), references.end(), 0);
     float c = 0;
     auto token_cost = [&](size_t ctx, size_t v) {
@@ -286,36 +526,31 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
     static constexpr size_t kMaxChainLength = 3;
     bool greedy =
         allow_random_access && absl::GetFlag(FLAGS_greedy_random_access);
+    ReferenceSearch search(g, allow_random_access, symbol_cost.data(), pool);
     std::vector<uint32_t> chain_length(N, 0);
-    for (size_t i = 0; i < N; i++) {
-      if (i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
-      c = 0;
-      // No block copying.
-      residuals.assign(g.Neighbours(i).begin(), g.Neighbours(i).end());
-      ProcessResiduals(residuals, i, adj_block, allow_random_access, rle_undo,
-                       token_cost);
-      float cost = c;
-      float base_cost = c;
-      saved_costs[i] = 0;
-
-      for (size_t ref = 1; ref < std::min(SearchNum(), i) + 1; ref++) {
-        if (greedy && chain_length[i - ref] >= kMaxChainLength) continue;
-        adj_block.clear();
-        c = 0;
-        ComputeBlocksAndResiduals(g, i, ref, &blocks, &residuals);
-        ProcessBlocks(
-            blocks, g, i, ref, [&](size_t x) { adj_block.push_back(x); },
-            token_cost);
-        ProcessResiduals(residuals, i, adj_block, allow_random_access, rle_undo,
-                         token_cost);
-        if (c + 1e-6f < cost) {
-          references[i] = ref;
-          cost = c;
-          saved_costs[i] = base_cost - c;
+    for (size_t block = 0; block < N; block += kReferenceSearchBlockSize) {
+      size_t block_end = std::min(N, block + kReferenceSearchBlockSize);
+      search.ScoreBlock(block, block_end, /*selected=*/nullptr);
+      for (size_t i = block; i < block_end; i++) {
+        if (print_progress && i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
+        // No block copying.
+        float cost = search.NoReferenceCost(i, last_scored);
+        float base_cost = cost;
+        saved_costs[i] = 0;
+
+        for (size_t ref = 1; ref < std::min(SearchNum(), i) + 1; ref++) {
+          if (greedy && chain_length[i - ref] >= kMaxChainLength) continue;
+          float c = search.ReferenceCost(i, ref);
+          last_scored = {i, ref};
+          if (c + 1e-6f < cost) {
+            references[i] = ref;
+            cost = c;
+            saved_costs[i] = base_cost - c;
+          }
+        }
+        if (references[i] != 0) {
+          chain_length[i] = chain_length[i - references[i]] + 1;
         }
-      }
-      if (references[i] != 0) {
-        chain_length[i] = chain_length[i - references[i]] + 1;
       }
     }
 
@@ -336,41 +571,43 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
               fwd_chain_length[i] + 1, fwd_chain_length[i - references[i]]);
         }
       }
-      fprintf(stderr, "Adding removed references, round %lu%20s\n", round + 1,
-              "");
+      if (print_progress) {
+        fprintf(stderr, "Adding removed references, round %lu%20s\n",
+                round + 1, "");
+      }
+      std::vector<bool> removed(N);
       for (size_t i = 0; i < N; i++) {
-        if (i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
-        if (references[i] != 0) {
-          chain_length[i] = chain_length[i - references[i]] + 1;
-          continue;
-        }
-        c = 0;
-        // No block copying
-        residuals.assign(g.Neighbours(i).begin(), g.Neighbours(i).end());
-        ProcessResiduals(residuals, i, adj_block, allow_random_access, rle_undo,
-                         token_cost);
-        float cost = c;
-
-        for (size_t ref = 1; ref < std::min(SearchNum(), i) + 1; ref++) {
-          if (chain_length[i - ref] + fwd_chain_length[i] + 1 >
-              kMaxChainLength) {
+        removed[i] = references[i] == 0;
+      }
+      for (size_t block = 0; block < N; block += kReferenceSearchBlockSize) {
+        size_t block_end = std::min(N, block + kReferenceSearchBlockSize);
+        search.ScoreBlock(block, block_end, &removed);
+        for (size_t i = block; i < block_end; i++) {
+          if (print_progress && i % 32 == 0) {
+            fprintf(stderr, "%lu/%lu\r", i, N);
+          }
+          if (references[i] != 0) {
+            chain_length[i] = chain_length[i - references[i]] + 1;
             continue;
           }
-          adj_block.clear();
-          c = 0;
-          ComputeBlocksAndResiduals(g, i, ref, &blocks, &residuals);
-          ProcessBlocks(
-              blocks, g, i, ref, [&](size_t x) { adj_block.push_back(x); },
-              token_cost);
-          ProcessResiduals(residuals, i, adj_block, allow_random_access,
-                           rle_undo, token_cost);
-          if (c + 1e-6f < cost) {
-            references[i] = ref;
-            cost = c;
+          // No block copying
+          float cost = search.NoReferenceCost(i, last_scored);
+
+          for (size_t ref = 1; ref < std::min(SearchNum(), i) + 1; ref++) {
+            if (chain_length[i - ref] + fwd_chain_length[i] + 1 >
+                kMaxChainLength) {
+              continue;
+            }
+            float c = search.ReferenceCost(i, ref);
+            last_scored = {i, ref};
+            if (c + 1e-6f < cost) {
+              references[i] = ref;
+              cost = c;
+            }
+          }
+          if (references[i] != 0) {
+            chain_length[i] = chain_length[i - references[i]] + 1;
           }
-        }
-        if (references[i] != 0) {
-          chain_length[i] = chain_length[i - references[i]] + 1;
         }
       }
       size_t has_ref = 0;
@@ -389,9 +626,11 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
     }
 
     if (round + 1 != absl::GetFlag(FLAGS_num_rounds)) {
-      fprintf(stderr, "Computing freqs, round %lu%20s\n", round + 1, "");
+      if (print_progress) {
+        fprintf(stderr, "Computing freqs, round %lu%20s\n", round + 1, "");
+      }
       for (size_t i = 0; i < N; i++) {
-        if (i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
+        if (print_progress && i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
         adj_block.clear();
         if (references[i] == 0) {
           residuals.assign(g.Neighbours(i).begin(), g.Neighbours(i).end());
@@ -401,8 +640,11 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
               blocks, g, i, references[i],
               [&](size_t x) { adj_block.push_back(x); }, token_cost);
         }
-        ProcessResiduals(residuals, i, adj_block, allow_random_access, rle_undo,
-                         token_cost);
+        ProcessResiduals(residuals, g.FirstNode() + i, adj_block,
+                         allow_random_access, rle_undo, token_cost);
+      }
+      if (N != 0) {
+        last_scored = {N - 1, references[N - 1]};
       }
 
       for (size_t i = 0; i < kNumContexts; i++) {
@@ -422,12 +664,16 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
 
   // Holds the index of every node degree delta in `tokens` .
   std::vector<size_t> node_degree_indices;
+  // Reference offset of each node, as coded.
+  if (node_references) node_references->assign(N, 0);
 
   size_t last_reference = 0;
-  fprintf(stderr, "Compressing%20s\n", "");
+  if (print_progress) fprintf(stderr, "Compressing%20s\n", "");
   for (size_t i = 0; i < N; i++) {
-    if (i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
-    fflush(stderr);
+    if (print_progress) {
+      if (i % 32 == 0) fprintf(stderr, "%lu/%lu\r", i, N);
+      fflush(stderr);
+    }
     if ((allow_random_access && i % kDegreeReferenceChunkSize == 0) || i == 0) {
       last_reference = 0;
       last_degree_delta = g.Degree(i);
@@ -455,6 +701,7 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
     if (i != 0) {
       tokens.Add(ReferenceContext(last_reference), reference);
       last_reference = reference;
+      if (node_references) (*node_references)[i] = reference;
       if (reference != 0) {
         with_blocks++;
         ProcessBlocks(
@@ -464,25 +711,253 @@ std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
     }
     // Residuals.
     ProcessResiduals(
-        residuals, i, adj_block, allow_random_access,
+        residuals, g.FirstNode() + i, adj_block, allow_random_access,
         [&]() { tokens.RemoveLast(); },
         [&](size_t ctx, size_t v) { tokens.Add(ctx, v); });
   }
-  for (size_t i = 0; i < N; i++) {
-    edges += g.Degree(i);
-    for (size_t j = 0; j < g.Degree(i); j++) {
-      chksum = Checksum(chksum, i, g.Neighbours(i)[j]);
-    }
-  }
 
-  std::vector<double> bits_per_ctx;
   if (allow_random_access) {
-    HuffmanEncode(tokens, kNumContexts, &writer, node_degree_indices,
-                  &bits_per_ctx);
+    std::vector<size_t> bit_pos = HuffmanEncode(
+        tokens, kNumContexts, writer, node_degree_indices, bits_per_ctx);
+    if (node_bit_pos) *node_bit_pos = std::move(bit_pos);
+  } else {
+    ANSEncode(tokens, kNumContexts, writer, bits_per_ctx, num_ans_states);
+  }
+}
+
+// Splits the nodes in ranges of at most DivCeil(N, num_segments) nodes, rounded
+// up to a multiple of kDegreeReferenceChunkSize.
+std::vector<GraphSegment> SplitInSegments(size_t N, size_t num_segments) {
+  size_t segment_size = DivCeil(DivCeil(N, num_segments),
+                                kDegreeReferenceChunkSize) *
+                        kDegreeReferenceChunkSize;
+  std::vector<GraphSegment> segments;
+  for (size_t first_node = 0; first_node < N; first_node += segment_size) {
+    segments.push_back(
+        {first_node, std::min(segment_size, N - first_node), /*bit_offset=*/0});
+  }
+  if (segments.empty()) segments.push_back({0, 0, 0});
+  return segments;
+}
+
+// Returns the first column of each column tile of at most `tile_size` columns,
+// or a single tile if tile_size is 0.
+std::vector<size_t> SplitInColumnTiles(size_t N, size_t tile_size) {
+  std::vector<size_t> first_columns = {0};
+  if (tile_size == 0) return first_columns;
+  for (size_t column = tile_size; column < N; column += tile_size) {
+    first_columns.push_back(column);
+  }
+  return first_columns;
+}
+}  // namespace
+
+std::vector<uint8_t> EncodeGraph(const UncompressedGraph &g,
+                                 bool allow_random_access, size_t *checksum) {
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t N = g.size();
+  size_t chksum = 0;
+  size_t edges = 0;
+  size_t num_threads = std::max<int32_t>(absl::GetFlag(FLAGS_num_threads), 1);
+  size_t num_ans_states =
+      allow_random_access ? 1 : absl::GetFlag(FLAGS_ans_states);
+  if (num_ans_states == 0 || num_ans_states > kMaxANSStates ||
+      (num_ans_states & (num_ans_states - 1)) != 0) {
+    ZKR_ABORT("Invalid number of ANS states: %zu", num_ans_states);
+  }
+  if (absl::GetFlag(FLAGS_column_tile_size) < 0) {
+    ZKR_ABORT("Invalid column tile size");
+  }
+  std::vector<size_t> tile_columns =
+      SplitInColumnTiles(N, absl::GetFlag(FLAGS_column_tile_size));
+  size_t num_tiles = tile_columns.size();
+  tile_columns.push_back(N);
+  // Rows are split across the tiles, so column-tiled files have no node
+  // index.
+  bool node_index = allow_random_access && num_tiles == 1 &&
+                    absl::GetFlag(FLAGS_node_index);
+  bool degree_index = allow_random_access && num_tiles == 1 &&
+                      absl::GetFlag(FLAGS_degree_index);
+  bool column_counts = absl::GetFlag(FLAGS_column_counts);
+  // Interleaved ANS states, column tiles and sections are only supported by
+  // the segmented container.
+  bool segmented = absl::GetFlag(FLAGS_num_segments) > 1 ||
+                   num_ans_states != 1 || num_tiles > 1 || node_index ||
+                   degree_index || column_counts;
+  std::vector<GraphSegment> segments =
+      SplitInSegments(N, std::max<int32_t>(absl::GetFlag(FLAGS_num_segments), 1));
+  // Segment s of tile t is coded as stream t * segments.size() + s.
+  const auto stream_range = [&](size_t stream) {
+    const GraphSegment &segment = segments[stream % segments.size()];
+    size_t tile = stream / segments.size();
+    return NodeRange(g, segment.first_node, segment.num_nodes,
+                     tile_columns[tile], tile_columns[tile + 1]);
+  };
+  std::vector<double> bits_per_ctx(kNumContexts);
+  std::vector<uint8_t> data;
+  ThreadPool pool(num_threads);
+
+  if (!segmented) {
+    BitWriter writer;
+    writer.Reserve(64);
+    writer.Write(48, N);
+    writer.Write(1, allow_random_access);
+    EncodeNodeRange(NodeRange(g, 0, N), allow_random_access, num_ans_states,
+                    &pool, /*print_progress=*/true, &writer, &bits_per_ctx);
+    data = std::move(writer).GetData();
   } else {
-    ANSEncode(tokens, kNumContexts, &writer, &bits_per_ctx);
+    // Segments are independent: if there are enough of them to keep the
+    // threads busy, encode them concurrently, each with a serial reference
+    // search; otherwise, encode them one after the other, each with the
+    // reference search spread across the threads.
+    size_t num_segments = segments.size();
+    size_t num_streams = num_tiles * num_segments;
+    bool parallel_streams = num_streams >= num_threads;
+    std::vector<std::vector<uint8_t>> segment_data(num_streams);
+    std::vector<std::vector<double>> segment_bits_per_ctx(num_streams);
+    std::vector<std::vector<size_t>> segment_node_bit_pos(num_streams);
+    std::vector<std::vector<uint8_t>> segment_references(num_streams);
+    const auto encode_segment = [&](size_t s, size_t thread) {
+      BitWriter writer;
+      EncodeNodeRange(stream_range(s), allow_random_access, num_ans_states,
+                      parallel_streams ? nullptr : &pool,
+                      /*print_progress=*/false, &writer,
+                      &segment_bits_per_ctx[s],
+                      node_index ? &segment_node_bit_pos[s] : nullptr,
+                      degree_index ? &segment_references[s] : nullptr);
+      segment_data[s] = std::move(writer).GetData();
+    };
+    if (num_tiles > 1) {
+      fprintf(stderr, "Compressing %lu segments in %lu column tiles%20s\n",
+              num_segments, num_tiles, "");
+    } else {
+      fprintf(stderr, "Compressing %lu segments%20s\n", num_segments, "");
+    }
+    if (parallel_streams) {
+      pool.Run(num_streams, encode_segment);
+    } else {
+      for (size_t s = 0; s < num_streams; s++) encode_segment(s, 0);
+    }
+
+    // Sections are stored after the segments, in the order of the table.
+    size_t num_sections = (node_index ? 1 : 0) + (degree_index ? 2 : 0) +
+                          (column_counts ? 1 : 0);
+    size_t header_size = 12 + (num_tiles > 1 ? 4 + 8 * num_tiles : 0) +
+                         16 * num_streams +
+                         (num_sections ? 4 + 24 * num_sections : 0);
+    std::vector<size_t> segment_offsets(num_streams);
+    size_t byte_offset = header_size;
+    for (size_t s = 0; s < num_streams; s++) {
+      segment_offsets[s] = byte_offset;
+      byte_offset += segment_data[s].size();
+    }
+    std::vector<uint8_t> index_data;
+    if (node_index) {
+      std::vector<size_t> node_bit_pos;
+      node_bit_pos.reserve(N);
+      for (size_t s = 0; s < num_segments; s++) {
+        for (size_t pos : segment_node_bit_pos[s]) {
+          node_bit_pos.push_back(segment_offsets[s] * 8 + pos);
+        }
+      }
+      ZKR_ASSERT(node_bit_pos.size() == N);
+      EncodeNodeIndex(node_bit_pos, &index_data);
+    }
+    std::vector<uint8_t> degree_index_data, reference_data;
+    if (degree_index) {
+      std::vector<size_t> cumulative_degrees(N + 1);
+      for (size_t i = 0; i < N; i++) {
+        cumulative_degrees[i + 1] = cumulative_degrees[i] + g.Degree(i);
+      }
+      EncodeNodeIndex(cumulative_degrees, &degree_index_data);
+      std::vector<uint8_t> references;
+      references.reserve(N);
+      for (size_t s = 0; s < num_segments; s++) {
+        references.insert(references.end(), segment_references[s].begin(),
+                          segment_references[s].end());
+      }
+      EncodeReferenceOffsets(references, &reference_data);
+    }
+    std::vector<uint8_t> column_count_data;
+    if (column_counts) {
+      std::vector<uint32_t> counts(N);
+      for (size_t i = 0; i < N; i++) {
+        for (uint32_t neighbour : g.Neighbours(i)) counts[neighbour]++;
+      }
+      EncodeColumnCounts(counts, &column_count_data);
+    }
+
+    BitWriter writer;
+    writer.Reserve(header_size * 8);
+    writer.Write(48, N | kSegmentedContainerBit);
+    writer.Write(1, allow_random_access);
+    writer.Write(kFormatFlagsBits, FloorLog2Nonzero(num_ans_states) |
+                                       (num_sections ? kSectionsFlag : 0) |
+                                       (num_tiles > 1 ? kColumnTilesFlag : 0));
+    writer.Write(32, num_segments);
+    const auto write64 = [&writer](size_t value) {
+      writer.Write(32, value & 0xFFFFFFFF);
+      writer.Write(32, value >> 32);
+    };
+    if (num_tiles > 1) {
+      writer.Write(32, num_tiles);
+      for (size_t t = 0; t < num_tiles; t++) {
+        write64(tile_columns[t]);
+      }
+    }
+    for (size_t s = 0; s < num_streams; s++) {
+      write64(segments[s % num_segments].first_node);
+      write64(segment_offsets[s]);
+    }
+    if (num_sections) writer.Write(32, num_sections);
+    if (node_index) {
+      write64(kNodeIndexSection);
+      write64(byte_offset);
+      write64(index_data.size());
+      byte_offset += index_data.size();
+    }
+    if (degree_index) {
+      write64(kDegreeIndexSection);
+      write64(byte_offset);
+      write64(degree_index_data.size());
+      byte_offset += degree_index_data.size();
+      write64(kReferenceOffsetSection);
+      write64(byte_offset);
+      write64(reference_data.size());
+      byte_offset += reference_data.size();
+    }
+    if (column_counts) {
+      write64(kColumnCountSection);
+      write64(byte_offset);
+      write64(column_count_data.size());
+    }
+    for (size_t s = 0; s < num_streams; s++) {
+      writer.AppendAligned(segment_data[s].data(), segment_data[s].size());
+      for (size_t i = 0; i < kNumContexts; i++) {
+        bits_per_ctx[i] += segment_bits_per_ctx[s][i];
+      }
+    }
+    writer.AppendAligned(index_data.data(), index_data.size());
+    writer.AppendAligned(degree_index_data.data(), degree_index_data.size());
+    writer.AppendAligned(reference_data.data(), reference_data.size());
+    writer.AppendAligned(column_count_data.data(), column_count_data.size());
+    data = std::move(writer).GetData();
+  }
+
+  for (size_t s = 0; s < num_tiles * segments.size(); s++) {
+    NodeRange range = stream_range(s);
+    size_t segment_chksum = 0;
+    for (size_t i = 0; i < range.size(); i++) {
+      edges += range.Degree(i);
+      for (uint32_t neighbour : range.Neighbours(i)) {
+        segment_chksum =
+            Checksum(segment_chksum, range.FirstNode() + i, neighbour);
+      }
+    }
+    chksum = segmented
+                 ? SegmentedChecksum(chksum, range.FirstNode(), segment_chksum)
+                 : segment_chksum;
   }
-  auto data = std::move(writer).GetData();
   auto stop = std::chrono::high_resolution_clock::now();
 
   if (absl::GetFlag(FLAGS_print_bits_breakdown)) {
@@ -7,7 +7,16 @@
 #include "uncompressed_graph.h"
 
 ABSL_DECLARE_FLAG(int32_t, num_rounds);
+ABSL_DECLARE_FLAG(int32_t, num_threads);
+ABSL_DECLARE_FLAG(int32_t, num_segments);
+ABSL_DECLARE_FLAG(int32_t, ans_states);
+ABSL_DECLARE_FLAG(int32_t, column_tile_size);
+ABSL_DECLARE_FLAG(int32_t, prefetch_distance);
+ABSL_DECLARE_FLAG(bool, huge_pages);
 ABSL_DECLARE_FLAG(bool, allow_random_access);
+ABSL_DECLARE_FLAG(bool, node_index);
+ABSL_DECLARE_FLAG(bool, degree_index);
+ABSL_DECLARE_FLAG(bool, column_counts);
 ABSL_DECLARE_FLAG(bool, greedy_random_access);
 
 namespace zuckerli {
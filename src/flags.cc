@@ -10,6 +10,30 @@ ABSL_FLAG(int32_t, ref_block, 32,
           "Number of previous lists to try to copy from");
 
 ABSL_FLAG(int32_t, num_rounds, 1, "Number of rounds for reference finding");
+ABSL_FLAG(int32_t, num_threads, 1,
+          "Number of threads used for encoding and decoding");
+ABSL_FLAG(int32_t, num_segments, 1,
+          "Number of independently coded segments (1 for the legacy format)");
+ABSL_FLAG(int32_t, ans_states, 1,
+          "Number of interleaved ANS states in sequential mode (1, 2, 4 or 8)");
+ABSL_FLAG(int32_t, column_tile_size, 0,
+          "Number of columns of each column tile, e.g. so that their slice of "
+          "a vector fits in the cache (0 disables column tiling)");
+ABSL_FLAG(int32_t, prefetch_distance, 8,
+          "Number of neighbours decoded ahead of their use by matrix-vector "
+          "products (0 to 32, 0 disables prefetching)");
+ABSL_FLAG(bool, huge_pages, false,
+          "Map compressed graphs with huge pages, if the kernel supports it");
 ABSL_FLAG(bool, allow_random_access, false, "Allow random access");
+ABSL_FLAG(bool, node_index, false,
+          "Store an index of the position of each node in random-access "
+          "files; such files cannot be read by older decoders");
+ABSL_FLAG(bool, degree_index, false,
+          "Store the degree and reference offset of each node in "
+          "random-access files, so that CompressedGraph reads degrees "
+          "without decoding");
+ABSL_FLAG(bool, column_counts, false,
+          "Store the number of occurrences of each node as a neighbour, so "
+          "that PageRank does not need to compute them");
 ABSL_FLAG(bool, greedy_random_access, false,
           "Greedy heuristic for random access");
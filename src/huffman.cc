@@ -269,6 +269,39 @@ bool HuffmanReader::Init(size_t num_contexts, BitReader* ZKR_RESTRICT br) {
   return true;
 }
 
+void HuffmanReader::InitMultiSymbol(size_t first_ctx, size_t num_ctxs) {
+  ZKR_ASSERT(first_ctx + num_ctxs <= kMaxNumContexts);
+  ZKR_ASSERT(num_ctxs <= 1u << IntegerCoder::Log2NumExplicit());
+  multi_first_ctx_ = first_ctx;
+  multi_num_ctxs_ = num_ctxs;
+  multi_info_.resize(num_ctxs << kMultiSymbolBits);
+  for (size_t c = 0; c < num_ctxs; c++) {
+    for (size_t bits = 0; bits < (1 << kMultiSymbolBits); bits++) {
+      HuffmanMultiSymbolInfo& entry =
+          multi_info_[(c << kMultiSymbolBits) | bits];
+      entry = {};
+      size_t ctx = first_ctx + c;
+      size_t pos = 0;
+      while (entry.count < kMaxSymbolsPerLookup) {
+        // Bits past the end of the lookup are taken to be 0: only keep
+        // symbols whose code is fully contained in the lookup.
+        const HuffmanDecoderInfo& info =
+            info_[ctx][(bits >> pos) & ((1 << kMaxHuffmanBits) - 1)];
+        if (entry.count != 0 &&
+            (info.nbits == 0 || pos + info.nbits > kMultiSymbolBits)) {
+          break;
+        }
+        entry.symbol[entry.count] = info.symbol;
+        entry.nbits[entry.count] = info.nbits;
+        entry.count++;
+        pos += info.nbits;
+        if (info.symbol >= num_ctxs) break;
+        ctx = first_ctx + info.symbol;
+      }
+    }
+  }
+}
+
 size_t HuffmanReader::Read(size_t ctx, BitReader* ZKR_RESTRICT br) {
   const uint32_t bits = br->PeekBits(kMaxHuffmanBits);
   br->Advance(info_[ctx][bits].nbits);
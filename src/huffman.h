@@ -28,6 +28,17 @@ struct HuffmanDecoderInfo {
   uint8_t symbol;
 };
 
+// Number of bits looked up at once by multi-symbol tables, and maximum number
+// of symbols decoded by one lookup.
+static constexpr size_t kMultiSymbolBits = 11;
+static constexpr size_t kMaxSymbolsPerLookup = 3;
+
+struct alignas(8) HuffmanMultiSymbolInfo {
+  uint8_t count;
+  uint8_t symbol[kMaxSymbolsPerLookup];
+  uint8_t nbits[kMaxSymbolsPerLookup];
+};
+
 // Encodes the given sequence of integers into a BitWriter. The context id
 // for each integer must be in the range [0, num_contexts).
 // Returns a vector of sorted indices of bits where nodes start.
@@ -50,12 +61,81 @@ class HuffmanReader {
 
   // For interface compatibilty with ANS reader.
   bool CheckFinalState() const { return true; }
+  void Restart() {}
+
+  // Optionally builds multi-symbol tables for the contexts in [first_ctx,
+  // first_ctx + num_ctxs), in which a symbol s < num_ctxs is always followed
+  // by a symbol in context first_ctx + s, and other symbols end the chain.
+  // Symbols that continue a chain must not have raw bits.
+  void InitMultiSymbol(size_t first_ctx, size_t num_ctxs);
+
+  ZKR_INLINE bool HasMultiSymbol(size_t ctx) const {
+    return ctx - multi_first_ctx_ < multi_num_ctxs_;
+  }
+  ZKR_INLINE size_t MultiSymbolFirstContext() const { return multi_first_ctx_; }
+
+  // Returns the chain of symbols at the start of the next kMultiSymbolBits of
+  // `br`, without consuming them. Requires HasMultiSymbol(ctx).
+  ZKR_INLINE const HuffmanMultiSymbolInfo& PeekMultiSymbol(
+      size_t ctx, BitReader* ZKR_RESTRICT br) const {
+    const uint32_t bits = br->PeekBits(kMultiSymbolBits);
+    return multi_info_[((ctx - multi_first_ctx_) << kMultiSymbolBits) | bits];
+  }
 
  private:
   // For each context, maps the next kMaxHuffmanBits in the bitstream into a
   // symbol and the number of bits that should actually be consumed from the
   // bitstream.
   HuffmanDecoderInfo info_[kMaxNumContexts][1 << kMaxHuffmanBits];
+  // Multi-symbol tables, 1 << kMultiSymbolBits entries per context.
+  std::vector<HuffmanMultiSymbolInfo> multi_info_;
+  size_t multi_first_ctx_ = 0;
+  size_t multi_num_ctxs_ = 0;
+};
+
+// Decodes chains of residuals with multi-symbol tables, if they were built.
+// A lookup decodes up to kMaxSymbolsPerLookup tokens but only consumes the
+// bits of the first one; the others are kept pending, and the bits of each
+// are consumed when it is requested in the context that the table assumed.
+// Only tokens without raw bits are chained, so the codes of pending tokens
+// stay at the front of the stream.
+template <>
+class ChainedIntegerReader<HuffmanReader> {
+ public:
+  explicit ChainedIntegerReader(HuffmanReader* huffman_reader)
+      : huffman_reader_(huffman_reader) {}
+
+  ZKR_INLINE size_t Read(size_t ctx, BitReader* ZKR_RESTRICT br) {
+    size_t token;
+    // Pending tokens were decoded assuming that each of them is read in the
+    // context given by the previous one.
+    if (pos_ < count_ && ctx == huffman_reader_->MultiSymbolFirstContext() +
+                                   entry_->symbol[pos_ - 1]) {
+      token = entry_->symbol[pos_];
+      br->Advance(entry_->nbits[pos_]);
+      pos_++;
+    } else if (huffman_reader_->HasMultiSymbol(ctx)) {
+      br->Refill();
+      entry_ = &huffman_reader_->PeekMultiSymbol(ctx, br);
+      token = entry_->symbol[0];
+      br->Advance(entry_->nbits[0]);
+      count_ = entry_->count;
+      pos_ = 1;
+    } else {
+      count_ = 0;
+      br->Refill();
+      token = huffman_reader_->Read(ctx, br);
+    }
+    return IntegerCoder::ReadFromToken(token, br);
+  }
+
+  ZKR_INLINE void Reset() { count_ = 0; }
+
+ private:
+  HuffmanReader* huffman_reader_;
+  const HuffmanMultiSymbolInfo* entry_ = nullptr;
+  size_t pos_ = 0;
+  size_t count_ = 0;
 };
 
 };  // namespace zuckerli
@@ -56,5 +56,56 @@ TEST(HuffmanTest, TestRoundtrip) {
   }
 }
 
+TEST(HuffmanTest, TestMultiSymbolChains) {
+  constexpr size_t kNumChains = 1 << 16;
+  constexpr size_t kFirstChainContext = 8;
+  constexpr size_t kNumChainContexts = 16;
+  constexpr size_t kNumContexts = kFirstChainContext + kNumChainContexts;
+
+  // Chains of integers in which each integer below kNumChainContexts selects
+  // the context of the next one, separated by integers in other contexts.
+  IntegerData data;
+  std::vector<size_t> chain_start;
+  std::mt19937 rng;
+  std::geometric_distribution<uint32_t> dist(0.3);
+  std::uniform_int_distribution<uint32_t> ctx_dist(0, kNumContexts - 1);
+  for (size_t i = 0; i < kNumChains; i++) {
+    data.Add(ctx_dist(rng) % kFirstChainContext, dist(rng));
+    chain_start.push_back(data.Size());
+    size_t ctx = kFirstChainContext + ctx_dist(rng) % kNumChainContexts;
+    size_t length = 1 + rng() % 12;
+    for (size_t j = 0; j < length; j++) {
+      size_t value = dist(rng) + (rng() % 16 == 0 ? 100 : 0);
+      data.Add(ctx, value);
+      if (value >= kNumChainContexts) break;
+      ctx = kFirstChainContext + value;
+    }
+  }
+  chain_start.push_back(data.Size() + 1);
+
+  BitWriter writer;
+  std::vector<double> unused_bits_per_ctx;
+  HuffmanEncode(data, kNumContexts, &writer, {}, &unused_bits_per_ctx);
+
+  std::vector<uint8_t> encoded = std::move(writer).GetData();
+  BitReader reader(encoded.data(), encoded.size());
+  HuffmanReader symbol_reader;
+  ASSERT_TRUE(symbol_reader.Init(kNumContexts, &reader));
+  symbol_reader.InitMultiSymbol(kFirstChainContext, kNumChainContexts);
+  ChainedIntegerReader<HuffmanReader> chain_reader(&symbol_reader);
+
+  size_t next_chain = 0;
+  for (size_t i = 0; i < data.Size(); i++) {
+    if (i + 1 == chain_start[next_chain]) {
+      chain_reader.Reset();
+      next_chain++;
+      ASSERT_EQ(IntegerCoder::Read(data.Context(i), &reader, &symbol_reader),
+                data.Value(i));
+    } else {
+      ASSERT_EQ(chain_reader.Read(data.Context(i), &reader), data.Value(i));
+    }
+  }
+}
+
 }  // namespace
 }  // namespace zuckerli
@@ -88,12 +88,17 @@ class IntegerCoder {
   template <typename EntropyCoder>
   static ZKR_INLINE size_t Read(size_t ctx, BitReader *ZKR_RESTRICT reader,
                                 EntropyCoder *ZKR_RESTRICT entropy_coder) {
+    reader->Refill();
+    size_t token = entropy_coder->Read(ctx, reader);
+    return ReadFromToken(token, reader);
+  }
+  // Reads the raw bits of the integer represented by `token`, if any.
+  static ZKR_INLINE size_t ReadFromToken(size_t token,
+                                         BitReader *ZKR_RESTRICT reader) {
     uint32_t split_exponent = Log2NumExplicit();
     uint32_t split_token = 1 << split_exponent;
     uint32_t msb_in_token = NumTokenMSB();
     uint32_t lsb_in_token = NumTokenLSB();
-    reader->Refill();
-    size_t token = entropy_coder->Read(ctx, reader);
     if (token < split_token) return token;
     uint32_t nbits = split_exponent - (msb_in_token + lsb_in_token) +
                      ((token - split_token) >> (msb_in_token + lsb_in_token));
@@ -123,6 +128,25 @@ class IntegerCoder {
   }
 };
 
+// Reads sequences of integers in which the context of each integer, except the
+// first, only depends on the token of the previous one, as for residuals.
+// Entropy coders may specialize this to decode several tokens per lookup; the
+// generic version reads one integer at a time. Reset() must be called whenever
+// anything else is read from the bitstream in between.
+template <typename EntropyCoder>
+class ChainedIntegerReader {
+ public:
+  explicit ChainedIntegerReader(EntropyCoder *entropy_coder)
+      : entropy_coder_(entropy_coder) {}
+  ZKR_INLINE size_t Read(size_t ctx, BitReader *ZKR_RESTRICT reader) {
+    return IntegerCoder::Read(ctx, reader, entropy_coder_);
+  }
+  ZKR_INLINE void Reset() {}
+
+ private:
+  EntropyCoder *entropy_coder_;
+};
+
 class IntegerData {
  public:
   size_t Size() {
@@ -0,0 +1,66 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace zuckerli {
+
+namespace {
+constexpr size_t kHugePageSize = 2 << 20;
+
+// Returns an address aligned to kHugePageSize where `size` bytes can be
+// mapped.
+void *ReserveAligned(size_t size) {
+  size_t reserved_size = size + kHugePageSize;
+  void *reserved = mmap(nullptr, reserved_size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) return nullptr;
+  uintptr_t begin = reinterpret_cast<uintptr_t>(reserved);
+  uintptr_t aligned = DivCeil(begin, kHugePageSize) * kHugePageSize;
+  // Keep [aligned, aligned + size) reserved, it is replaced by MAP_FIXED.
+  if (aligned != begin) munmap(reserved, aligned - begin);
+  size_t tail = begin + reserved_size - (aligned + size);
+  if (tail != 0) munmap(reinterpret_cast<void *>(aligned + size), tail);
+  return reinterpret_cast<void *>(aligned);
+}
+}  // namespace
+
+MappedFile::MappedFile(const std::string &path, Access access,
+                       bool huge_pages, bool populate) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) ZKR_ABORT("Cannot open %s", path.c_str());
+  struct stat st;
+  ZKR_ASSERT(fstat(fd, &st) == 0);
+  size_ = st.st_size;
+  if (size_ == 0) {
+    close(fd);
+    return;
+  }
+  void *address = huge_pages ? ReserveAligned(size_) : nullptr;
+  int flags = MAP_SHARED | (address != nullptr ? MAP_FIXED : 0);
+#ifdef MAP_POPULATE
+  if (populate) flags |= MAP_POPULATE;
+#endif
+  void *data = mmap(address, size_, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) ZKR_ABORT("Cannot map %s", path.c_str());
+  data_ = static_cast<const uint8_t *>(data);
+  if (access == Access::kSequential) {
+    // Read ahead aggressively; pages behind the decoder may be reclaimed early.
+    madvise(data, size_, MADV_SEQUENTIAL);
+    madvise(data, size_, MADV_WILLNEED);
+  } else {
+    madvise(data, size_, MADV_RANDOM);
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages) madvise(data, size_, MADV_HUGEPAGE);
+#endif
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+}  // namespace zuckerli
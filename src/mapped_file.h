@@ -0,0 +1,46 @@
+#ifndef ZUCKERLI_MAPPED_FILE_H
+#define ZUCKERLI_MAPPED_FILE_H
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include "common.h"
+
+namespace zuckerli {
+
+// Read-only memory mapping of a whole file, used to load graphs without
+// copying them.
+class MappedFile {
+ public:
+  enum class Access {
+    // The file is read from start to end (whole-graph decoding).
+    kSequential,
+    // Small parts of the file are read in any order (CompressedGraph).
+    kRandom,
+  };
+
+  // Aborts if the file cannot be mapped. With `huge_pages`, the mapping is
+  // aligned to huge pages and the kernel is asked to back it with them, if it
+  // supports it for files. With `populate`, the whole file is read in before
+  // the constructor returns, where the platform supports it.
+  MappedFile(const std::string &path, Access access, bool huge_pages = false,
+             bool populate = false);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ZKR_INLINE const uint8_t *data() const { return data_; }
+  ZKR_INLINE size_t size() const { return size_; }
+  ZKR_INLINE span<const uint8_t> bytes() const {
+    return span<const uint8_t>(data_, size_);
+  }
+
+ private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_MAPPED_FILE_H
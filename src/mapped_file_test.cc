@@ -0,0 +1,43 @@
+#include "mapped_file.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+namespace zuckerli {
+namespace {
+
+std::string WriteFile(const std::string &name,
+                      const std::vector<uint8_t> &contents) {
+  std::string path = testing::TempDir() + "/" + name;
+  FILE *f = fopen(path.c_str(), "wb");
+  ZKR_ASSERT(f);
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+  return path;
+}
+
+TEST(MappedFileTest, TestContents) {
+  std::vector<uint8_t> contents(12345);
+  for (size_t i = 0; i < contents.size(); i++) contents[i] = i * 7;
+  std::string path = WriteFile("mapped", contents);
+  for (MappedFile::Access access :
+       {MappedFile::Access::kSequential, MappedFile::Access::kRandom}) {
+    for (bool huge_pages : {false, true}) {
+      MappedFile file(path, access, huge_pages);
+      ASSERT_EQ(file.size(), contents.size());
+      EXPECT_EQ(std::vector<uint8_t>(file.bytes().begin(), file.bytes().end()),
+                contents);
+    }
+  }
+}
+
+TEST(MappedFileTest, TestEmpty) {
+  MappedFile file(WriteFile("empty", {}), MappedFile::Access::kSequential);
+  EXPECT_TRUE(file.bytes().empty());
+}
+
+}  // namespace
+}  // namespace zuckerli
@@ -1,308 +1,546 @@
-#ifndef ZUCKERLI_DECODE_H
-#define ZUCKERLI_DECODE_H
-#include <chrono>
-#include <limits>
+#ifndef ZUCKERLI_MULTIPLY_H
+#define ZUCKERLI_MULTIPLY_H
+#include <algorithm>
+#include <type_traits>
 #include <vector>
 
-#include "ans.h"
-#include "bit_reader.h"
-#include "checksum.h"
 #include "common.h"
-#include "context_model.h"
-#include "huffman.h"
-#include "integer_coder.h"
+#include "container.h"
+#include "decode.h"
+#include "thread_pool.h"
 
 namespace zuckerli {
+    // Number of decoded neighbours whose entry of the input vector is being
+    // prefetched while SpMV decodes the next ones (see SpMVVisitor).
+    static constexpr size_t kDefaultPrefetchDistance = 8;
+    static constexpr size_t kMaxPrefetchDistance = 32;
+
     namespace detail {
 
-        template <typename Reader, typename CB, typename value_t=double >
-        bool DecodeGraphImpl(size_t N, bool allow_random_access, Reader* reader,
-                             BitReader* br, const CB& cb,
-                             std::vector<size_t>* node_start_indices
-                ,const std::vector<value_t>* invec, std::vector<value_t>* outvec
-        ) {
-            using IntegerCoder = zuckerli::IntegerCoder;
-            // Storage for the previous up-to-MaxNodesBackwards() lists to be used as a
-            // reference.
-            std::vector<std::vector<uint32_t>> prev_lists(
-                    std::min(MaxNodesBackwards(), N));
-            //std::vector<uint32_t> residuals;
-            std::vector<uint32_t> block_lengths;
-
-            for (size_t i = 0; i < prev_lists.size(); i++) prev_lists[i].clear();
-            size_t rle_min =
-                    allow_random_access ? kRleMin : std::numeric_limits<size_t>::max();
-            // The three quantities below get reset to after kDegreeReferenceChunkSize
-            // adjacency lists if in random-access mode.
-            //
-            // Reference degree for degree delta coding.
-            size_t last_degree = 0;
-            // Last degree delta for context modeling.
-            size_t last_degree_delta = 0;
-            // Last reference offset for context modeling.
-            size_t last_reference_offset = 0;
-            for (size_t current_node = 0; current_node < N; current_node++) {
-                size_t i_mod = current_node % MaxNodesBackwards();
-                prev_lists[i_mod].clear();
-                block_lengths.clear();
-                size_t degree;
-                if (node_start_indices) node_start_indices->push_back(br->NumBitsRead());
-                if ((allow_random_access &&
-                     current_node % kDegreeReferenceChunkSize == 0) ||
-                    current_node == 0) {
-                    degree = IntegerCoder::Read(kFirstDegreeContext, br, reader);
-                    last_degree_delta =
-                            degree;  // special case: we assume a node -1 with degree 0
-                    last_reference_offset = 0;
-                } else {
-                    size_t ctx = DegreeContext(last_degree_delta);
-                    last_degree_delta = IntegerCoder::Read(ctx, br, reader);
-                    degree =
-                            last_degree +
-                            UnpackSigned(
-                                    last_degree_delta);  // this can be negative, hence calling this
-                }
-                last_degree = degree;
-                if (degree > N) return ZKR_FAILURE("Invalid degree");
-                if (degree == 0) continue;
-
-                // If this is not the first node, read the offset of the list to be used as
-                // a reference.
-                size_t reference_offset = 0;
-                if (current_node != 0) {
-                    reference_offset = IntegerCoder::Read(
-                            ReferenceContext(last_reference_offset), br, reader);
-                    last_reference_offset = reference_offset;
-                }
-                if (reference_offset > current_node)
-                    return ZKR_FAILURE("Invalid reference_offset");
+        // Computes outvec[node] = sum of invec over the neighbours of node.
+        // Copied edges are not visited one by one: the row of the reference
+        // is already in outvec, so only the blocks of it that are skipped
+        // have to be subtracted. Only the entries of the decoded rows are
+        // written, so outvec does not need to be cleared. The sum of a row is
+        // kept in an accum_t, e.g. double for float vectors.
+        //
+        // Entries of invec are mostly cache misses, so they are prefetched as
+        // soon as the neighbour is decoded, and only added to the sum
+        // `prefetch_distance` neighbours later; the pending ones are added at
+        // the end of the row, in order, so that the result does not depend
+        // on the distance.
+        template <typename value_t = double, typename accum_t = value_t>
+        struct SpMVVisitor : public DecodeVisitor {
+            const value_t* ZKR_RESTRICT invec;
+            value_t* ZKR_RESTRICT outvec;
+            accum_t sum = 0;
+            // At most kMaxPrefetchDistance; 0 disables prefetching.
+            size_t prefetch_distance = kDefaultPrefetchDistance;
+            uint32_t pending[kMaxPrefetchDistance];
+            size_t pending_begin = 0;
+            size_t pending_end = 0;
 
-                // If a reference_offset is used, read the list of blocks of (alternating)
-                // copied and skipped edges.
-                size_t num_to_copy = 0;
-                if (reference_offset != 0) {
+            ZKR_INLINE void RowBegin(size_t node, size_t degree) {
+                sum = 0;
+            }
 
-                    size_t block_count = IntegerCoder::Read(kBlockCountContext, br, reader);
-                    size_t block_end = 0;  // end of current block
-                    for (size_t j = 0; j < block_count; j++) {
-                        size_t ctx = j == 0
-                                     ? kBlockContext
-                                     : (j % 2 == 0 ? kBlockContextEven : kBlockContextOdd);
-                        size_t block_len;
-                        if (j == 0) {
-                            block_len = IntegerCoder::Read(ctx, br, reader);
-                        } else {
-                            block_len = IntegerCoder::Read(ctx, br, reader) + 1;
-                        }
-                        block_end += block_len;
-                        block_lengths.push_back(block_len);
-                    }
-                    if (prev_lists[(current_node - reference_offset) % MaxNodesBackwards()]
-                                .size() < block_end) {
-                        return ZKR_FAILURE("Invalid block copy pattern");
-                    }
-                    // Last block is implicit and goes to the end of the reference list.
-                    block_lengths.push_back(
-                            prev_lists[(current_node - reference_offset) % MaxNodesBackwards()]
-                                    .size() -
-                            block_end);
-                    // Blocks in even positions are to be copied.
-                    for (size_t i = 0; i < block_lengths.size(); i += 2) {
-                        num_to_copy += block_lengths[i];
-                    }
+            ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+                if (prefetch_distance == 0) {
+                    sum += invec[neighbour];
+                    return;
                 }
-
-                // Read all the edges that are not copied.
-
-                // reference_offset node for delta-coding of neighbours.
-                size_t last_dest_plus_one = 0;  // will not be used
-                // Number of edges to read.
-                size_t num_residuals = degree - num_to_copy;
-                // Last delta for the residual edges, used for context modeling.
-                size_t last_residual_delta = 0;
-                // Current position in the reference list (because we are making a sorted
-                // merged list).
-                size_t ref_pos = 0;
-                // Number of nodes of the current block that should still be copied.
-                size_t num_to_copy_from_current_block =
-                        block_lengths.empty() ? 0 : block_lengths[0];
-                // Index of the next block.
-                size_t next_block = 1;
-                // If we don't need to copy anything from the first block, and we have at
-                // least another even-positioned block, advance the position in the
-                // reference_offset list accordingly.
-                if (num_to_copy_from_current_block == 0 && block_lengths.size() > 2) {
-                    ref_pos = block_lengths[1];
-                    num_to_copy_from_current_block = block_lengths[2];
-                    next_block = 3;
+                __builtin_prefetch(invec + neighbour);
+                if (pending_end - pending_begin == prefetch_distance) {
+                    sum += invec[pending[pending_begin++ % kMaxPrefetchDistance]];
                 }
-                // ID of reference list.
-                size_t ref_id = (current_node - reference_offset) % MaxNodesBackwards();
-                // Number of consecutive zeros that have been decoded last.
-                // Delta encoding with -1.
-                size_t contiguous_zeroes_len = 0;
-                // Number of further zeros that should not be read from the bitstream.
-                size_t num_zeros_to_skip = 0;
-                const auto append = [&](size_t x) {
-                    if (x >= N) return ZKR_FAILURE("Invalid residual");
-                    prev_lists[i_mod].push_back(x);
-                    cb(current_node, x);
-                    return true;
-                };
-                for (size_t j = 0; j < num_residuals; j++) {
-                    size_t destination_node;
-                    if (j == 0) {
-                        last_residual_delta =
-                                IntegerCoder::Read(FirstResidualContext(num_residuals), br, reader);
-                        destination_node = current_node + UnpackSigned(last_residual_delta);
-                    } else if (num_zeros_to_skip >
-                               0) {  // If in a zero run, don't read anything.
-                        last_residual_delta = 0;
-                        destination_node = last_dest_plus_one;
-                    } else {
-                        last_residual_delta = IntegerCoder::Read(
-                                ResidualContext(last_residual_delta), br, reader);
-                        destination_node = last_dest_plus_one + last_residual_delta;
-                    }
-                    // Compute run of zeros if we read a zero and we are not already in one.
-                    if (last_residual_delta == 0 && num_zeros_to_skip == 0) {
-                        contiguous_zeroes_len++;
-                    } else {
-                        contiguous_zeroes_len = 0;
-                    }
-                    // If we are in a run of zeros, decrease its length.
-                    if (num_zeros_to_skip > 0) {
-                        num_zeros_to_skip--;
-                    }
-                    // Merge the edges copied from the reference_offset list with the ones
-                    // read from the bitstream.
-                    while (num_to_copy_from_current_block > 0 &&
-                           prev_lists[ref_id][ref_pos] <= destination_node) {
-                        num_to_copy_from_current_block--;
-                        ZKR_RETURN_IF_ERROR(append(prev_lists[ref_id][ref_pos]));
-                        // If our delta coding would produce an edge to destination_node, but y
-                        // with y<=destination_node is copied from the reference_offset list, we
-                        // increase destination_node. In other words, it's delta coding with
-                        // respect to both lists (prev_lists and residuals).
-                        if (j != 0 && prev_lists[ref_id][ref_pos] >= last_dest_plus_one) {
-                            destination_node++;
-                        }
-                        ref_pos++;
-                        if (num_to_copy_from_current_block == 0 &&
-                            next_block + 1 < block_lengths.size()) {
-                            ref_pos += block_lengths[next_block];
-                            num_to_copy_from_current_block = block_lengths[next_block + 1];
-                            next_block += 2;
-                        }
-                    }
-                    // If the current run of zeros is large enough, read how many further
-                    // zeros to decode from the bitstream.
-                    if (contiguous_zeroes_len >= rle_min) {
-                        num_zeros_to_skip = IntegerCoder::Read(kRleContext, br, reader);
-                        contiguous_zeroes_len = 0;
+                pending[pending_end++ % kMaxPrefetchDistance] = neighbour;
+            }
+            ZKR_INLINE void AddPending() {
+                for (; pending_begin != pending_end; pending_begin++) {
+                    sum += invec[pending[pending_begin % kMaxPrefetchDistance]];
+                }
+            }
+            ZKR_INLINE void SkippedBlock(size_t node, const uint32_t* neighbours,
+                                         size_t count) {
+                AddPending();
+                for (size_t i = 0; i < count; i++) {
+                    if (prefetch_distance != 0 && i + prefetch_distance < count) {
+                        __builtin_prefetch(invec + neighbours[i + prefetch_distance]);
                     }
+                    sum -= invec[neighbours[i]];
+                }
+            }
+            ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {
+                AddPending();
+                if (reference_offset != 0) {
+                    sum += outvec[node - reference_offset];
+                }
+                outvec[node] = sum;
+            }
+        };
 
-                    ZKR_RETURN_IF_ERROR(append(destination_node));
+        // Sums rows like SpMVVisitor, for kernels that do not store the plain
+        // row sums in outvec: the sums of the last MaxNodesBackwards() rows
+        // are kept aside for the rows that use them as a reference. Derived
+        // visitors call FinishRow() from RowEnd().
+        template <typename value_t = double, typename accum_t = value_t>
+        struct RowSumVisitor : public SpMVVisitor<value_t, accum_t> {
+            // Indexed by node modulo a power of two.
+            std::vector<accum_t> row_sums;
+            size_t row_sums_mask;
 
-                    //multiplication
-                    (*outvec)[current_node] += (*invec)[destination_node];
+            RowSumVisitor()
+                    : row_sums(size_t{1}
+                               << (FloorLog2Nonzero(MaxNodesBackwards()) + 1)),
+                      row_sums_mask(row_sums.size() - 1) {}
 
-                    last_dest_plus_one = destination_node + 1;
+            // Returns the sum of the row of `node`.
+            ZKR_INLINE accum_t FinishRow(size_t node, size_t reference_offset) {
+                this->AddPending();
+                if (reference_offset != 0) {
+                    this->sum +=
+                            row_sums[(node - reference_offset) & row_sums_mask];
                 }
-                ZKR_ASSERT(ref_pos + num_to_copy_from_current_block <=
-                           prev_lists[ref_id].size());
-                // Process the rest of the block-copy list.
-                while (num_to_copy_from_current_block > 0) {
-                    num_to_copy_from_current_block--;
-                    ZKR_RETURN_IF_ERROR(append(prev_lists[ref_id][ref_pos]));
-                    ref_pos++;
-                    if (num_to_copy_from_current_block == 0 &&
-                        next_block + 1 < block_lengths.size()) {
-                        ref_pos += block_lengths[next_block];
-                        num_to_copy_from_current_block = block_lengths[next_block + 1];
-                        next_block += 2;
-                    }
+                row_sums[node & row_sums_mask] = this->sum;
+                return this->sum;
+            }
+        };
+
+        // Computes the product of one column tile of a column-tiled matrix
+        // with invec (see container.h), and adds it to outvec, or stores it
+        // there for the first tile. Reference rows are rows of the same
+        // tile, whose sums are not those in outvec.
+        template <typename value_t = double, typename accum_t = value_t>
+        struct TileSpMVVisitor : public RowSumVisitor<value_t, accum_t> {
+            bool first_tile = true;
+
+            ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {
+                accum_t sum = this->FinishRow(node, reference_offset);
+                if (first_tile) {
+                    this->outvec[node] = sum;
+                } else {
+                    this->outvec[node] += sum;
                 }
+            }
+        };
 
-                //multiplication
-                if (reference_offset>0) {
-                    (*outvec)[current_node] += (*outvec)[current_node - reference_offset];
-                    size_t lpos=0, rpos;
-                    const size_t ref_id =  (current_node - reference_offset) % MaxNodesBackwards();
-                    for (size_t b_i = 1; b_i < block_lengths.size(); b_i += 2) { //not copied
-                        lpos += block_lengths[b_i-1];
-                        rpos = lpos + block_lengths[b_i];
-                        for(size_t pos=lpos; pos<rpos; ++pos) {
-                            auto col = prev_lists[ref_id][pos];
-                            (*outvec)[current_node] -= (*invec)[col];
-                        }
-                        lpos = rpos;
-                    }
+        // Computes the products of A with k vectors at once, stored
+        // row-major: entry i of vector j is at i * k + j. Each row is decoded
+        // once and applied to all the vectors, the same way as in
+        // SpMVVisitor; with K != 0, k is the compile-time constant K, so
+        // that the loops over the k lanes are unrolled and vectorized.
+        template <typename value_t, size_t K>
+        struct SpMMVisitor : public DecodeVisitor {
+            const value_t* ZKR_RESTRICT invecs;
+            value_t* ZKR_RESTRICT outvecs;
+            size_t k = K;
+
+            ZKR_INLINE size_t lanes() const { return K != 0 ? K : k; }
+            ZKR_INLINE void RowBegin(size_t node, size_t degree) {
+                value_t* out = outvecs + node * lanes();
+                for (size_t j = 0; j < lanes(); j++) out[j] = 0;
+            }
+            ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+                value_t* out = outvecs + node * lanes();
+                const value_t* in = invecs + neighbour * lanes();
+                for (size_t j = 0; j < lanes(); j++) out[j] += in[j];
+            }
+            ZKR_INLINE void SkippedBlock(size_t node, const uint32_t* neighbours,
+                                         size_t count) {
+                value_t* out = outvecs + node * lanes();
+                for (size_t i = 0; i < count; i++) {
+                    const value_t* in = invecs + neighbours[i] * lanes();
+                    for (size_t j = 0; j < lanes(); j++) out[j] -= in[j];
                 }
             }
-            if (!reader->CheckFinalState()) {
-                return ZKR_FAILURE("Invalid stream");
+            ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {
+                if (reference_offset == 0) return;
+                value_t* out = outvecs + node * lanes();
+                const value_t* ref = outvecs + (node - reference_offset) * lanes();
+                for (size_t j = 0; j < lanes(); j++) out[j] += ref[j];
             }
+        };
 
-            //debug multiplication
-//  for(auto e : *outvec)
-//      printf("%f ", e);
-//  printf("\n");
-            return true;
+        // Computes outvec += A^T * invec: each edge (node, neighbour) adds
+        // invec[node] to outvec[neighbour]. Copied edges are scattered one by
+        // one, since the reference row does not help here. The output can be
+        // wider than the input, to accumulate float vectors in double.
+        template <typename value_t = double, typename accum_t = value_t>
+        struct TransposedSpMVVisitor : public DecodeVisitor {
+            const value_t* ZKR_RESTRICT invec;
+            accum_t* ZKR_RESTRICT outvec;
+            accum_t value = 0;
+
+            ZKR_INLINE void RowBegin(size_t node, size_t degree) {
+                value = invec[node];
+            }
+            ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+                outvec[neighbour] += value;
+            }
+            ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {
+                outvec[neighbour] += value;
+            }
+        };
+
+        // Calls f(std::integral_constant<size_t, K>()) with K = k for the
+        // usual numbers of vectors, and K = 0 (k known at runtime) otherwise.
+        template <typename F>
+        bool DispatchLanes(size_t k, const F& f) {
+            switch (k) {
+                case 1: return f(std::integral_constant<size_t, 1>());
+                case 2: return f(std::integral_constant<size_t, 2>());
+                case 4: return f(std::integral_constant<size_t, 4>());
+                case 8: return f(std::integral_constant<size_t, 8>());
+                case 16: return f(std::integral_constant<size_t, 16>());
+                case 32: return f(std::integral_constant<size_t, 32>());
+                case 64: return f(std::integral_constant<size_t, 64>());
+                default: return f(std::integral_constant<size_t, 0>());
+            }
         }
 
     }  // namespace detail
 
-    bool DecodeGraph(const std::vector<uint8_t>& compressed,
-                     const std::vector<double>& invec,
-                     std::vector<double>& outvec,
-                     size_t* checksum = nullptr,
-                     std::vector<size_t>* node_start_indices = nullptr
+    // Computes outvec = A * invec. Segments of segmented files write disjoint
+    // ranges of outvec, so they are processed concurrently on the threads of
+    // `pool`, if any; the tiles of column-tiled files are processed one
+    // after the other. Vectors can be float or double; the sum of each
+    // row (of each tile) is computed in accum_t (e.g. DecodeGraph<float,
+    // double>).
+    template <typename value_t, typename accum_t = value_t>
+    bool DecodeGraph(GraphDecoder* decoder,
+                            const std::vector<value_t>& invec,
+                            std::vector<value_t>& outvec,
+                            size_t* checksum = nullptr,
+                            std::vector<size_t>* node_start_indices = nullptr,
+                            ThreadPool* pool = nullptr,
+                            size_t prefetch_distance = kDefaultPrefetchDistance
     ) {
-        if (compressed.empty()) return ZKR_FAILURE("Empty file");
-//  auto start = std::chrono::high_resolution_clock::now();
-        BitReader reader(compressed.data(), compressed.size());
-        size_t N = reader.ReadBits(48);
+        if (prefetch_distance > kMaxPrefetchDistance) {
+            return ZKR_FAILURE("Prefetch distance too large");
+        }
+        const GraphHeader& header = decoder->header();
+        size_t N = header.num_nodes;
+        if (invec.size() < N) return ZKR_FAILURE("Input vector too short");
 
-        //invec & outvec
         outvec.resize(N);
-        fill(outvec.begin(), outvec.end(), 0x0);
-
-        bool allow_random_access = reader.ReadBits(1);
-        size_t edges = 0, chksum = 0;
-        auto edge_callback = [&](size_t a, size_t b) {
-            edges++;
-            chksum = Checksum(chksum, a, b);
-        };
+        if (node_start_indices) node_start_indices->resize(N);
 
-        if (allow_random_access) {
-            HuffmanReader huff_reader;
-            huff_reader.Init(kNumContexts, &reader);
-            ZKR_RETURN_IF_ERROR(
-                    detail::DecodeGraphImpl(N, allow_random_access, &huff_reader, &reader,
-                                            edge_callback, node_start_indices
-                            ,&invec, &outvec
-                    ));
+        size_t num_segments = header.segments.size();
+        std::vector<char> segment_ok(num_segments);
+        if (!header.tiles.empty()) {
+            const size_t tile_segments = num_segments / header.tiles.size();
+            for (const ColumnTile& tile : header.tiles) {
+                detail::ForEachSegment(tile_segments, pool, [&](size_t s) {
+                    detail::TileSpMVVisitor<value_t, accum_t> visitor;
+                    visitor.invec = invec.data();
+                    visitor.outvec = outvec.data();
+                    visitor.prefetch_distance = prefetch_distance;
+                    visitor.first_tile = tile.first_segment == 0;
+                    segment_ok[tile.first_segment + s] =
+                            decoder->segment(tile.first_segment + s).Decode(
+                                    &visitor);
+                });
+            }
         } else {
-            ANSReader ans_reader;
-            ans_reader.Init(kNumContexts, &reader);
-            ZKR_RETURN_IF_ERROR(
-                    detail::DecodeGraphImpl(N, allow_random_access, &ans_reader, &reader,
-                                            edge_callback, node_start_indices
-                            ,&invec, &outvec
-                    ));
+            detail::ForEachSegment(num_segments, pool, [&](size_t s) {
+                detail::SpMVVisitor<value_t, accum_t> visitor;
+                visitor.invec = invec.data();
+                visitor.outvec = outvec.data();
+                visitor.prefetch_distance = prefetch_distance;
+                segment_ok[s] = decoder->segment(s).Decode(
+                        &visitor, node_start_indices);
+            });
+        }
+        for (size_t s = 0; s < num_segments; s++) {
+            if (!segment_ok[s]) return ZKR_FAILURE("Invalid segment");
+        }
+        return true;
+    }
+
+    template <typename value_t, typename accum_t = value_t>
+    bool DecodeGraph(span<const uint8_t> compressed,
+                            const std::vector<value_t>& invec,
+                            std::vector<value_t>& outvec,
+                            size_t* checksum = nullptr,
+                            std::vector<size_t>* node_start_indices = nullptr,
+                            ThreadPool* pool = nullptr,
+                            size_t prefetch_distance = kDefaultPrefetchDistance
+    ) {
+        GraphDecoder decoder;
+        ZKR_RETURN_IF_ERROR(decoder.Init(compressed, pool));
+        return DecodeGraph<value_t, accum_t>(&decoder, invec, outvec, checksum,
+                                             node_start_indices, pool,
+                                             prefetch_distance);
+    }
+
+    // Computes the products of A with the k vectors in `invecs`, stored
+    // row-major (entry i of vector j is invecs[i * k + j]), into `outvecs`,
+    // with the same layout. Rows are decoded once for all the vectors.
+    // Column-tiled files are not supported.
+    template <typename value_t>
+    bool MultiplyVectors(GraphDecoder* decoder, size_t k,
+                                const std::vector<value_t>& invecs,
+                                std::vector<value_t>& outvecs,
+                                ThreadPool* pool = nullptr) {
+        if (k == 0) return ZKR_FAILURE("No vectors");
+        const GraphHeader& header = decoder->header();
+        if (!header.tiles.empty()) {
+            return ZKR_FAILURE("Column-tiled graph");
+        }
+        size_t N = header.num_nodes;
+        if (invecs.size() < N * k) return ZKR_FAILURE("Input vectors too short");
+
+        outvecs.resize(N * k);
+
+        size_t num_segments = header.segments.size();
+        std::vector<char> segment_ok(num_segments);
+        detail::ForEachSegment(num_segments, pool, [&](size_t s) {
+            detail::DispatchLanes(k, [&](auto lanes) {
+                detail::SpMMVisitor<value_t, decltype(lanes)::value> visitor;
+                visitor.invecs = invecs.data();
+                visitor.outvecs = outvecs.data();
+                visitor.k = k;
+                segment_ok[s] = decoder->segment(s).Decode(&visitor);
+                return true;
+            });
+        });
+        for (size_t s = 0; s < num_segments; s++) {
+            if (!segment_ok[s]) return ZKR_FAILURE("Invalid segment");
         }
-//  auto stop = std::chrono::high_resolution_clock::now();
-//
-//  float elapsed =
-//      std::chrono::duration_cast<std::chrono::microseconds>(stop - start)
-//          .count();
-//
-//  fprintf(stderr, "Decompressed %.2f ME/s (%zu) from %.2f BPE. Checksum: %lx\n",
-//          edges / elapsed, edges, 8.0 * compressed.size() / edges, chksum);
-//  if (checksum) *checksum = chksum;
         return true;
     }
+
+    template <typename value_t>
+    bool MultiplyVectors(span<const uint8_t> compressed, size_t k,
+                                const std::vector<value_t>& invecs,
+                                std::vector<value_t>& outvecs,
+                                ThreadPool* pool = nullptr) {
+        GraphDecoder decoder;
+        ZKR_RETURN_IF_ERROR(decoder.Init(compressed, pool));
+        return MultiplyVectors(&decoder, k, invecs, outvecs, pool);
+    }
+
+    // Computes outvec = A^T * invec from the rows of A. Segments scatter
+    // into the same entries of outvec, so they are processed in order; see
+    // SpMVEngine::MultiplyTransposed for the parallel version.
+    template <typename value_t>
+    bool MultiplyTransposed(GraphDecoder* decoder,
+                                   const std::vector<value_t>& invec,
+                                   std::vector<value_t>& outvec) {
+        size_t N = decoder->num_nodes();
+        if (invec.size() < N) return ZKR_FAILURE("Input vector too short");
+
+        outvec.resize(N);
+        std::fill(outvec.begin(), outvec.end(), 0x0);
+
+        detail::TransposedSpMVVisitor<value_t> visitor;
+        visitor.invec = invec.data();
+        visitor.outvec = outvec.data();
+        for (size_t s = 0; s < decoder->num_segments(); s++) {
+            ZKR_RETURN_IF_ERROR(decoder->segment(s).Decode(&visitor));
+        }
+        return true;
+    }
+
+    template <typename value_t>
+    bool MultiplyTransposed(span<const uint8_t> compressed,
+                                   const std::vector<value_t>& invec,
+                                   std::vector<value_t>& outvec) {
+        GraphDecoder decoder;
+        ZKR_RETURN_IF_ERROR(decoder.Init(compressed));
+        return MultiplyTransposed(&decoder, invec, outvec);
+    }
+
+    // Computes outvec = A * invec for the same compressed matrix A any number
+    // of times, e.g. in iterative algorithms. The coding tables are read once
+    // by Init(), into a GraphDecoder that other kernels can share; then each
+    // segment of A, i.e. range of rows, is decoded by one thread of the pool
+    // and only writes its own slice of outvec. Segments are handed out to the
+    // threads as they become free, so files with a few segments per thread
+    // balance the load best. The column tiles of column-tiled files are
+    // multiplied one after the other, so that the entries of invec read by
+    // all the threads at a time are those of one tile.
+    class SpMVEngine {
+    public:
+        // `compressed` and `pool` must outlive the engine.
+        bool Init(span<const uint8_t> compressed, ThreadPool* pool) {
+            pool_ = pool;
+            partial_outvecs_.clear();
+            ZKR_RETURN_IF_ERROR(decoder_.Init(compressed, pool));
+            num_nodes_ = decoder_.num_nodes();
+            tiles_ = decoder_.header().tiles;
+            segment_ok_.resize(decoder_.num_segments());
+            return true;
+        }
+
+        size_t num_nodes() const { return num_nodes_; }
+        size_t num_segments() const { return decoder_.num_segments(); }
+        // 0 if the matrix is not column-tiled.
+        size_t num_tiles() const { return tiles_.size(); }
+        // Whether the file can be opened as a CompressedGraph.
+        bool allow_random_access() const {
+            return decoder_.header().allow_random_access;
+        }
+        // Rows of segment s.
+        const GraphSegment& segment(size_t s) const {
+            return decoder_.header().segments[s];
+        }
+
+        ThreadPool* pool() const { return pool_; }
+        // The decoders of the segments, e.g. for one-shot kernels such as
+        // ComputeOutDeg; they must not be used while the engine is.
+        GraphDecoder* decoder() { return &decoder_; }
+        size_t prefetch_distance() const { return prefetch_distance_; }
+
+        // Number of neighbours decoded ahead of the use of their entry of the
+        // input vector by Multiply(invec, outvec); 0 disables prefetching.
+        bool set_prefetch_distance(size_t distance) {
+            if (distance > kMaxPrefetchDistance) {
+                return ZKR_FAILURE("Prefetch distance too large");
+            }
+            prefetch_distance_ = distance;
+            return true;
+        }
+
+        // `invec` and `outvec` have num_nodes() entries and do not overlap.
+        // Rows are summed in accum_t.
+        template <typename value_t, typename accum_t = value_t>
+        bool Multiply(const value_t* invec, value_t* outvec) {
+            if (!tiles_.empty()) {
+                const size_t tile_segments = num_segments() / tiles_.size();
+                for (const ColumnTile& tile : tiles_) {
+                    pool_->Run(tile_segments, [&](size_t s, size_t thread) {
+                        detail::TileSpMVVisitor<value_t, accum_t> visitor;
+                        visitor.invec = invec;
+                        visitor.outvec = outvec;
+                        visitor.prefetch_distance = prefetch_distance_;
+                        visitor.first_tile = tile.first_segment == 0;
+                        segment_ok_[tile.first_segment + s] =
+                                decoder_.segment(tile.first_segment + s).Decode(
+                                        &visitor);
+                    });
+                }
+            } else {
+                pool_->Run(num_segments(), [&](size_t s, size_t thread) {
+                    detail::SpMVVisitor<value_t, accum_t> visitor;
+                    visitor.invec = invec;
+                    visitor.outvec = outvec;
+                    visitor.prefetch_distance = prefetch_distance_;
+                    segment_ok_[s] = decoder_.segment(s).Decode(&visitor);
+                });
+            }
+            for (char ok : segment_ok_) {
+                if (!ok) return ZKR_FAILURE("Invalid segment");
+            }
+            return true;
+        }
+
+        // Calls decode(segment, s, thread) for each segment index s on the
+        // pool, where `segment` is the detail::SegmentDecoder of segment s,
+        // for kernels that fuse other work with the product (e.g.
+        // PageRank); `decode` returns whether the segment is valid.
+        template <typename F>
+        bool DecodeSegments(const F& decode) {
+            pool_->Run(num_segments(), [&](size_t s, size_t thread) {
+                segment_ok_[s] = decode(decoder_.segment(s), s, thread);
+            });
+            for (char ok : segment_ok_) {
+                if (!ok) return ZKR_FAILURE("Invalid segment");
+            }
+            return true;
+        }
+
+        // Decodes segment s on the calling thread, e.g. for kernels that
+        // need the segments in order.
+        template <typename Visitor>
+        bool DecodeSegment(size_t s, Visitor* visitor) {
+            return decoder_.segment(s).Decode(visitor);
+        }
+
+        // Same as MultiplyVectors: `invecs` and `outvecs` hold k vectors of
+        // num_nodes() entries, stored row-major. Column-tiled matrices are
+        // not supported.
+        template <typename value_t>
+        bool Multiply(const value_t* invecs, value_t* outvecs, size_t k) {
+            if (k == 0) return ZKR_FAILURE("No vectors");
+            if (!tiles_.empty()) return ZKR_FAILURE("Column-tiled graph");
+            pool_->Run(num_segments(), [&](size_t s, size_t thread) {
+                detail::DispatchLanes(k, [&](auto lanes) {
+                    detail::SpMMVisitor<value_t, decltype(lanes)::value> visitor;
+                    visitor.invecs = invecs;
+                    visitor.outvecs = outvecs;
+                    visitor.k = k;
+                    segment_ok_[s] = decoder_.segment(s).Decode(&visitor);
+                    return true;
+                });
+            });
+            for (char ok : segment_ok_) {
+                if (!ok) return ZKR_FAILURE("Invalid segment");
+            }
+            return true;
+        }
+
+        // Computes outvec = A^T * invec. Each thread scatters the rows of
+        // its segments into its own copy of the output, which are then added
+        // up by blocks of columns, on all the threads; no atomics are needed.
+        // The partial outputs are double for any value_t.
+        template <typename value_t>
+        bool MultiplyTransposed(const value_t* invec, value_t* outvec) {
+            const size_t num_threads = pool_->NumThreads();
+            if (num_threads == 1 || decoder_.num_segments() == 1) {
+                std::fill(outvec, outvec + num_nodes_, 0);
+                detail::TransposedSpMVVisitor<value_t> visitor;
+                visitor.invec = invec;
+                visitor.outvec = outvec;
+                for (size_t s = 0; s < decoder_.num_segments(); s++) {
+                    ZKR_RETURN_IF_ERROR(decoder_.segment(s).Decode(&visitor));
+                }
+                return true;
+            }
+            // The buffers are kept zeroed between calls.
+            if (partial_outvecs_.size() != num_threads) {
+                partial_outvecs_.assign(
+                        num_threads, std::vector<double>(num_nodes_, 0.0));
+            }
+            pool_->Run(num_segments(), [&](size_t s, size_t thread) {
+                detail::TransposedSpMVVisitor<value_t, double> visitor;
+                visitor.invec = invec;
+                visitor.outvec = partial_outvecs_[thread].data();
+                segment_ok_[s] = decoder_.segment(s).Decode(&visitor);
+            });
+            pool_->ParallelFor(
+                    num_nodes_, kReductionBlockSize,
+                    [&](size_t begin, size_t end, size_t thread) {
+                        for (size_t i = begin; i < end; i++) {
+                            double sum = 0;
+                            for (std::vector<double>& partial :
+                                 partial_outvecs_) {
+                                sum += partial[i];
+                                partial[i] = 0;
+                            }
+                            outvec[i] = sum;
+                        }
+                    });
+            for (char ok : segment_ok_) {
+                if (!ok) return ZKR_FAILURE("Invalid segment");
+            }
+            return true;
+        }
+
+    private:
+        // Number of columns added up by each task of the reduction of
+        // MultiplyTransposed.
+        static constexpr size_t kReductionBlockSize = 1 << 14;
+
+        ThreadPool* pool_ = nullptr;
+        size_t num_nodes_ = 0;
+        std::vector<ColumnTile> tiles_;
+        size_t prefetch_distance_ = kDefaultPrefetchDistance;
+        GraphDecoder decoder_;
+        std::vector<char> segment_ok_;
+        // One output per thread of the pool, for MultiplyTransposed.
+        std::vector<std::vector<double>> partial_outvecs_;
+    };
 }  // namespace zuckerli
 
-#endif  // ZUCKERLI_DECODE_H
+#endif  // ZUCKERLI_MULTIPLY_H
@@ -1,14 +1,21 @@
+#include <algorithm>
 #include <cstdio>
 
 #include "common.h"
 #include "multiply.h"
 #include "encode.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 
 ABSL_FLAG(std::string, input_path, "", "Input file path");
 ABSL_FLAG(std::string, input_vector_path, "", "Input vector path");
 ABSL_FLAG(std::string, output_vector_path, "", "Output vector path");
+ABSL_FLAG(int32_t, num_vectors, 1,
+          "Number of vectors in the input file, stored row-major");
+ABSL_FLAG(bool, transpose, false,
+          "Multiply by the transpose of the matrix (single vector only)");
 
 int main(int argc, char** argv) {
     absl::ParseCommandLine(argc, argv);
@@ -16,16 +23,20 @@ int main(int argc, char** argv) {
     (void) absl::GetFlag(FLAGS_allow_random_access);
     (void) absl::GetFlag(FLAGS_greedy_random_access);
 
-    //data
-    FILE *in = fopen(absl::GetFlag(FLAGS_input_path).c_str(), "r");
-    ZKR_ASSERT(in);
-
-    fseek(in, 0, SEEK_END);
-    size_t len = ftell(in);
-    fseek(in, 0, SEEK_SET);
+    if (absl::GetFlag(FLAGS_num_vectors) < 1) {
+        fprintf(stderr, "Invalid --num_vectors: must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    const size_t num_vectors = absl::GetFlag(FLAGS_num_vectors);
+    if (absl::GetFlag(FLAGS_transpose) && num_vectors != 1) {
+        fprintf(stderr, "--transpose only supports --num_vectors=1\n");
+        return EXIT_FAILURE;
+    }
 
-    std::vector<uint8_t> data(len);
-    ZKR_ASSERT(fread(data.data(), 1, len, in) == len);
+    //data
+    zuckerli::MappedFile data(absl::GetFlag(FLAGS_input_path),
+                              zuckerli::MappedFile::Access::kSequential,
+                              absl::GetFlag(FLAGS_huge_pages));
 
     //invec
     FILE *in_invec = fopen(absl::GetFlag(FLAGS_input_vector_path).c_str(), "r");
@@ -40,7 +51,20 @@ int main(int argc, char** argv) {
 
     //outvec
     std::vector<double> outvec;
-    if (!zuckerli::DecodeGraph(data, invec, outvec)) {
+    zuckerli::ThreadPool pool(
+            std::max<int32_t>(absl::GetFlag(FLAGS_num_threads), 1));
+    bool ok;
+    if (absl::GetFlag(FLAGS_transpose)) {
+        ok = zuckerli::MultiplyTransposed(data.bytes(), invec, outvec);
+    } else if (num_vectors == 1) {
+        ok = zuckerli::DecodeGraph(data.bytes(), invec, outvec, /*checksum=*/nullptr,
+                                   /*node_start_indices=*/nullptr,
+                                   &pool, absl::GetFlag(FLAGS_prefetch_distance));
+    } else {
+        ok = zuckerli::MultiplyVectors(data.bytes(), num_vectors, invec, outvec,
+                                       &pool);
+    }
+    if (!ok) {
         fprintf(stderr, "Invalid graph\n");
         return EXIT_FAILURE;
     }
@@ -1,28 +1,23 @@
-// --input_path web-edu --input_vector_path invec3032 --output_vector_path web-edu.zkr.out --par_degree 4
-// /home/tosoni/CLionProjects/zuckerli/gen_graphs
+// --input_path web-edu.zkr --input_vector_path invec3032 --output_vector_path web-edu.zkr.out --par_degree 4
+// The matrix should have a few segments per thread (encoder --num_segments).
 
 #include <cstdio>
 
 #include "common.h"
 #include "multiply.h"
 #include "encode.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 
-#include <thread>
-
-ABSL_FLAG(std::string, input_path, "", "Input file path");
+ABSL_FLAG(std::string, input_path, "",
+          "Input matrix, one .zkr file with a few segments per thread (part "
+          "files name.T.t.zkr are no longer read)");
 ABSL_FLAG(std::string, input_vector_path, "", "Input vector path");
 ABSL_FLAG(std::string, output_vector_path, "", "Output vector path");
 ABSL_FLAG(std::string, par_degree, "", "Parallelism degree");
 
-void mutiply_part(const std::vector<uint8_t>& data, std::vector<double>& invec, std::vector<double>& outvec) {
-    if (!zuckerli::DecodeGraph(data, invec, outvec)) {
-        fprintf(stderr, "Invalid graph\n");
-        std::exit(EXIT_FAILURE);
-    }
-}
-
 int main(int argc, char** argv) {
     absl::ParseCommandLine(argc, argv);
     // Ensure that encoder-only flags are recognized by the decoder too.
@@ -31,59 +26,47 @@ int main(int argc, char** argv) {
 
     //args
     const size_t NT = atoi(absl::GetFlag(FLAGS_par_degree).c_str());
-    assert(NT);
-
-    //params
-    std::vector<std::thread> threads;
+    ZKR_ASSERT(NT);
 
     //data
-    std::vector<std::vector<uint8_t>> datavec;
-    datavec.reserve(NT);
-
-    for(size_t tid=0; tid<NT; ++tid) {
-        std::string infilepath;
-        infilepath += absl::GetFlag(FLAGS_input_path);
-        infilepath += ".";
-        infilepath += std::to_string(NT);
-        infilepath += ".";
-        infilepath += std::to_string(tid);
-        infilepath += ".zkr";
-
-//        std::cout << infilepath << std::endl;
-
-        FILE *in = fopen(infilepath.c_str(), "r");
-        ZKR_ASSERT(in);
-
-        fseek(in, 0, SEEK_END);
-        size_t len = ftell(in);
-        fseek(in, 0, SEEK_SET);
-
-        datavec.emplace_back(len);
-        ZKR_ASSERT(fread(datavec[tid].data(), 1, len, in) == len);
-
-        fclose(in);
+    zuckerli::MappedFile data(absl::GetFlag(FLAGS_input_path),
+                              zuckerli::MappedFile::Access::kSequential,
+                              absl::GetFlag(FLAGS_huge_pages));
+    zuckerli::ThreadPool pool(NT, /*pin_threads=*/true);
+    zuckerli::SpMVEngine engine;
+    if (!engine.Init(data.bytes(), &pool)) {
+        fprintf(stderr, "Invalid graph\n");
+        return EXIT_FAILURE;
     }
+    if (!engine.set_prefetch_distance(absl::GetFlag(FLAGS_prefetch_distance))) {
+        fprintf(stderr, "Invalid prefetch distance\n");
+        return EXIT_FAILURE;
+    }
+    const size_t nnodes = engine.num_nodes();
 
     //invec
     FILE *in_invec = fopen(absl::GetFlag(FLAGS_input_vector_path).c_str(), "r");
     ZKR_ASSERT(in_invec);
 
     fseek(in_invec, 0, SEEK_END);
-    size_t len_invec = ftell(in_invec);
+    size_t len_invec = ftell(in_invec) / sizeof(double);
     fseek(in_invec, 0, SEEK_SET);
+    if (len_invec < nnodes) {
+        fprintf(stderr, "Input vector too short\n");
+        return EXIT_FAILURE;
+    }
 
     std::vector<double> invec(len_invec);
-    ZKR_ASSERT(fread(invec.data(), 1, len_invec, in_invec) == len_invec);
+    ZKR_ASSERT(fread(invec.data(), sizeof(double), len_invec, in_invec) == len_invec);
+    fclose(in_invec);
 
     //outvec
-    std::vector<double> outvec;
+    std::vector<double> outvec(nnodes);
 
     //multiplication
-    for (size_t tid = 0; tid < NT; ++tid) {
-        threads.emplace_back(mutiply_part, datavec[tid], std::ref(invec), std::ref(outvec));
-    }
-    for (size_t tid = 0; tid < NT; ++tid) {
-        threads[tid].join();
+    if (!engine.Multiply(invec.data(), outvec.data())) {
+        fprintf(stderr, "Invalid graph\n");
+        return EXIT_FAILURE;
     }
 
     //outfile
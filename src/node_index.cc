@@ -0,0 +1,100 @@
+#include "node_index.h"
+
+#include <algorithm>
+
+namespace zuckerli {
+
+namespace {
+constexpr size_t kHeaderWords = 3;
+
+void AppendWord(uint64_t value, std::vector<uint8_t> *out) {
+  size_t pos = out->size();
+  out->resize(pos + sizeof(value));
+  memcpy(out->data() + pos, &value, sizeof(value));
+}
+}  // namespace
+
+void EncodeNodeIndex(const std::vector<size_t> &values,
+                     std::vector<uint8_t> *out) {
+  size_t n = values.size();
+  size_t universe = n == 0 ? 0 : values.back() + 1;
+  size_t low_bits =
+      n != 0 && universe > n ? FloorLog2Nonzero(universe / n) : 0;
+  size_t num_high_bits = n + (universe >> low_bits) + 1;
+  std::vector<uint64_t> samples(DivCeil(n, kNodeIndexSampleRate));
+  std::vector<uint64_t> low(DivCeil(n * low_bits, 64));
+  std::vector<uint64_t> high(DivCeil(num_high_bits, 64));
+  for (size_t i = 0; i < n; i++) {
+    ZKR_ASSERT(i == 0 || values[i - 1] <= values[i]);
+    size_t high_pos = (values[i] >> low_bits) + i;
+    high[high_pos / 64] |= uint64_t{1} << (high_pos % 64);
+    if (i % kNodeIndexSampleRate == 0) {
+      samples[i / kNodeIndexSampleRate] = high_pos;
+    }
+    if (low_bits == 0) continue;
+    uint64_t low_value = values[i] & ((uint64_t{1} << low_bits) - 1);
+    size_t bit = i * low_bits;
+    low[bit / 64] |= low_value << (bit % 64);
+    if (bit % 64 + low_bits > 64) {
+      low[bit / 64 + 1] |= low_value >> (64 - bit % 64);
+    }
+  }
+  out->reserve(out->size() +
+               8 * (kHeaderWords + samples.size() + low.size() + high.size()));
+  AppendWord(n, out);
+  AppendWord(low_bits, out);
+  AppendWord(high.size(), out);
+  for (const std::vector<uint64_t> *words : {&samples, &low, &high}) {
+    for (uint64_t word : *words) AppendWord(word, out);
+  }
+}
+
+bool NodeIndex::Init(const uint8_t *data, size_t size, size_t num_values) {
+  if (size < 8 * kHeaderWords) return ZKR_FAILURE("Truncated node index");
+  num_values_ = Word(data, 0);
+  low_bits_ = Word(data, 1);
+  num_high_words_ = Word(data, 2);
+  if (num_values_ != num_values || low_bits_ >= 64 ||
+      num_high_words_ < DivCeil(num_values_ + 1, 64)) {
+    return ZKR_FAILURE("Invalid node index");
+  }
+  size_t num_samples = DivCeil(num_values_, kNodeIndexSampleRate);
+  size_t num_low_words = DivCeil(num_values_ * low_bits_, 64);
+  if ((size - 8 * kHeaderWords) / 8 <
+      num_samples + num_low_words + num_high_words_) {
+    return ZKR_FAILURE("Truncated node index");
+  }
+  samples_ = data + 8 * kHeaderWords;
+  low_ = samples_ + 8 * num_samples;
+  high_ = low_ + 8 * num_low_words;
+  return true;
+}
+
+void EncodeReferenceOffsets(const std::vector<uint8_t> &offsets,
+                            std::vector<uint8_t> *out) {
+  std::vector<uint64_t> words(DivCeil(offsets.size() * kReferenceOffsetBits,
+                                      64) +
+                              1);
+  for (size_t i = 0; i < offsets.size(); i++) {
+    ZKR_ASSERT(offsets[i] < (1u << kReferenceOffsetBits));
+    size_t bit = i * kReferenceOffsetBits;
+    words[bit / 64] |= uint64_t{offsets[i]} << (bit % 64);
+    if (bit % 64 + kReferenceOffsetBits > 64) {
+      words[bit / 64 + 1] |= uint64_t{offsets[i]} >> (64 - bit % 64);
+    }
+  }
+  out->reserve(out->size() + 8 * words.size());
+  for (uint64_t word : words) AppendWord(word, out);
+}
+
+bool ReferenceOffsets::Init(const uint8_t *data, size_t size,
+                            size_t num_values) {
+  if (size / 8 < DivCeil(num_values * kReferenceOffsetBits, 64) + 1) {
+    return ZKR_FAILURE("Truncated reference offsets");
+  }
+  num_values_ = num_values;
+  data_ = data;
+  return true;
+}
+
+}  // namespace zuckerli
@@ -0,0 +1,131 @@
+#ifndef ZUCKERLI_NODE_INDEX_H
+#define ZUCKERLI_NODE_INDEX_H
+#include <stdint.h>
+#include <string.h>
+
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+namespace zuckerli {
+
+// Elias-Fano representation of the non-decreasing sequence of bit positions at
+// which the nodes of a random-access graph start, stored as little-endian
+// 64-bit words:
+// - number of values n, number of low bits L, number of words of high bits
+// - DivCeil(n, kNodeIndexSampleRate) samples: position in the high bits of the
+//   one of value i * kNodeIndexSampleRate
+// - DivCeil(n * L, 64) words with the L low bits of each value
+// - the high bits: value i sets bit (value_i >> L) + i.
+// With L ~ log2(average bits per node), this takes about L + 2 bits per node,
+// and finding a value scans at most the ones of kNodeIndexSampleRate values.
+static constexpr size_t kNodeIndexSampleRate = 32;
+
+// Serializes the index of `values` and appends it to `out`.
+void EncodeNodeIndex(const std::vector<size_t> &values,
+                     std::vector<uint8_t> *out);
+
+// Read-only view of an index; does not own the memory it points to.
+class NodeIndex {
+ public:
+  // Checks that the `size` bytes at `data` are an index of `num_values`
+  // values.
+  bool Init(const uint8_t *data, size_t size, size_t num_values);
+
+  ZKR_INLINE size_t size() const { return num_values_; }
+
+  // Returns the i-th value; `i` must be smaller than size().
+  ZKR_INLINE size_t operator[](size_t i) const {
+    size_t value;
+    Read(i, 1, &value);
+    return value;
+  }
+
+  // Stores values [first, first + count) in `out`; first + count must not be
+  // larger than size(). Reading from a multiple of kNodeIndexSampleRate is
+  // fastest.
+  ZKR_INLINE void Read(size_t first, size_t count, size_t *out) const {
+    size_t i = first - first % kNodeIndexSampleRate;
+    size_t high_pos = Word(samples_, i / kNodeIndexSampleRate);
+    size_t word = high_pos / 64;
+    ZKR_ASSERT(word < num_high_words_);
+    uint64_t bits = Word(high_, word) & (~uint64_t{0} << (high_pos % 64));
+    // Ones of the values before `first` in the same sample are skipped.
+    for (; i < first + count; i++) {
+      while (bits == 0) {
+        ++word;
+        ZKR_ASSERT(word < num_high_words_);
+        bits = Word(high_, word);
+      }
+      if (i >= first) {
+        size_t high = word * 64 + __builtin_ctzll(bits) - i;
+        out[i - first] = (high << low_bits_) | LowBits(i);
+      }
+      bits &= bits - 1;
+    }
+  }
+
+ private:
+  // Loads the i-th little-endian 64-bit word of `words`.
+  static ZKR_INLINE uint64_t Word(const uint8_t *words, size_t i) {
+    uint64_t value;
+    memcpy(&value, words + i * 8, sizeof(value));
+    return value;
+  }
+
+  // The high bits always follow the low bits, so reading the word after the
+  // one that holds the first low bit of a value is always safe.
+  ZKR_INLINE size_t LowBits(size_t i) const {
+    if (low_bits_ == 0) return 0;
+    size_t bit = i * low_bits_;
+    uint64_t value = Word(low_, bit / 64) >> (bit % 64);
+    value |= (Word(low_, bit / 64 + 1) << 1) << (63 - bit % 64);
+    return value & ((uint64_t{1} << low_bits_) - 1);
+  }
+
+  size_t num_values_ = 0;
+  size_t low_bits_ = 0;
+  size_t num_high_words_ = 0;
+  const uint8_t *samples_ = nullptr;
+  const uint8_t *low_ = nullptr;
+  const uint8_t *high_ = nullptr;
+};
+
+// Packed array of the reference offset of each node of a random-access graph,
+// kReferenceOffsetBits bits per node in little-endian 64-bit words, followed
+// by a zero word. Nodes without a reference, or without edges, have 0.
+static constexpr size_t kReferenceOffsetBits = 6;
+
+// Serializes `offsets`, which must be below 2^kReferenceOffsetBits, and
+// appends them to `out`.
+void EncodeReferenceOffsets(const std::vector<uint8_t> &offsets,
+                            std::vector<uint8_t> *out);
+
+// Read-only view of an array of reference offsets; does not own the memory it
+// points to.
+class ReferenceOffsets {
+ public:
+  // Checks that the `size` bytes at `data` hold `num_values` offsets.
+  bool Init(const uint8_t *data, size_t size, size_t num_values);
+
+  ZKR_INLINE size_t size() const { return num_values_; }
+
+  // Returns the i-th offset; `i` must be smaller than size().
+  ZKR_INLINE size_t operator[](size_t i) const {
+    size_t bit = i * kReferenceOffsetBits;
+    uint64_t word, next;
+    memcpy(&word, data_ + bit / 64 * 8, sizeof(word));
+    memcpy(&next, data_ + bit / 64 * 8 + 8, sizeof(next));
+    uint64_t value = (word >> (bit % 64)) | ((next << 1) << (63 - bit % 64));
+    return value & ((uint64_t{1} << kReferenceOffsetBits) - 1);
+  }
+
+ private:
+  size_t num_values_ = 0;
+  const uint8_t *data_ = nullptr;
+};
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_NODE_INDEX_H
@@ -0,0 +1,77 @@
+#include "node_index.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace zuckerli {
+namespace {
+
+void Roundtrip(const std::vector<size_t> &values) {
+  std::vector<uint8_t> data;
+  EncodeNodeIndex(values, &data);
+  NodeIndex index;
+  ASSERT_TRUE(index.Init(data.data(), data.size(), values.size()));
+  ASSERT_EQ(index.size(), values.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    ASSERT_EQ(index[i], values[i]) << i;
+  }
+}
+
+TEST(NodeIndexTest, TestRoundtrip) {
+  std::mt19937 rng;
+  // Mostly short gaps, with some repeated values and some very long gaps.
+  std::uniform_int_distribution<size_t> gap(0, 200);
+  std::uniform_int_distribution<size_t> long_gap(0, 1 << 24);
+  std::uniform_int_distribution<size_t> kind(0, 99);
+  std::vector<size_t> values;
+  size_t value = 49;
+  for (size_t i = 0; i < 100000; i++) {
+    values.push_back(value);
+    size_t k = kind(rng);
+    value += k < 10 ? 0 : k < 12 ? long_gap(rng) : gap(rng);
+  }
+  Roundtrip(values);
+}
+
+TEST(NodeIndexTest, TestEdgeCases) {
+  Roundtrip({});
+  Roundtrip({0});
+  Roundtrip(std::vector<size_t>(100, 0));
+  Roundtrip(std::vector<size_t>(100, size_t{1} << 40));
+  Roundtrip({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+             18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33});
+}
+
+TEST(NodeIndexTest, TestInvalid) {
+  std::vector<size_t> values(1000);
+  for (size_t i = 0; i < values.size(); i++) values[i] = i * 100;
+  std::vector<uint8_t> data;
+  EncodeNodeIndex(values, &data);
+  NodeIndex index;
+  EXPECT_FALSE(index.Init(data.data(), data.size() - 8, values.size()));
+  EXPECT_FALSE(index.Init(data.data(), data.size(), values.size() + 1));
+  EXPECT_TRUE(index.Init(data.data(), data.size(), values.size()));
+}
+
+TEST(NodeIndexTest, TestReferenceOffsets) {
+  std::mt19937 rng;
+  for (size_t n : {0, 1, 10, 11, 1000}) {
+    std::vector<uint8_t> offsets(n);
+    for (uint8_t &offset : offsets) {
+      offset = rng() % (1 << kReferenceOffsetBits);
+    }
+    std::vector<uint8_t> data;
+    EncodeReferenceOffsets(offsets, &data);
+    ReferenceOffsets view;
+    EXPECT_FALSE(view.Init(data.data(), data.size() - 8, n));
+    ASSERT_TRUE(view.Init(data.data(), data.size(), n));
+    ASSERT_EQ(view.size(), n);
+    for (size_t i = 0; i < n; i++) {
+      ASSERT_EQ(view[i], offsets[i]) << i;
+    }
+  }
+}
+
+}  // namespace
+}  // namespace zuckerli
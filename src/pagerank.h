@@ -0,0 +1,978 @@
+#ifndef ZUCKERLI_PAGERANK_H
+#define ZUCKERLI_PAGERANK_H
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "compressed_graph.h"
+#include "multiply.h"
+#include "thread_pool.h"
+#include "top_k.h"
+
+namespace zuckerli {
+
+// Arithmetic of the rank vectors.
+enum class Precision {
+  kDouble,
+  // float vectors, which halves the memory traffic of the multiplication.
+  kFloat,
+  // float vectors; the sums of the rows and the rank of the dangling nodes
+  // are computed in double.
+  kMixed,
+};
+
+// Parses "double", "float" or "mixed".
+inline bool ParsePrecision(const std::string& name, Precision* precision) {
+  if (name == "double") {
+    *precision = Precision::kDouble;
+  } else if (name == "float") {
+    *precision = Precision::kFloat;
+  } else if (name == "mixed") {
+    *precision = Precision::kMixed;
+  } else {
+    return ZKR_FAILURE("Unknown precision %s", name.c_str());
+  }
+  return true;
+}
+
+// How each iteration updates the ranks.
+enum class PageRankMethod {
+  // Power iteration: the ranks of an iteration are computed from those of the
+  // previous one.
+  kJacobi,
+  // The ranks are updated in place, row by row, so that each row already
+  // uses the ranks computed before it in the same iteration. Usually needs
+  // fewer iterations than kJacobi, and keeps a single rank vector.
+  kGaussSeidel,
+  // As kGaussSeidel, with the segments updated at the same time by the
+  // threads of the pool; each thread sees the ranks of the others as they
+  // are when it reads them, so the result depends on the schedule.
+  kAsync,
+};
+
+// Parses "jacobi", "gauss_seidel" or "async".
+inline bool ParsePageRankMethod(const std::string& name,
+                                PageRankMethod* method) {
+  if (name == "jacobi") {
+    *method = PageRankMethod::kJacobi;
+  } else if (name == "gauss_seidel") {
+    *method = PageRankMethod::kGaussSeidel;
+  } else if (name == "async") {
+    *method = PageRankMethod::kAsync;
+  } else {
+    return ZKR_FAILURE("Unknown PageRank method %s", name.c_str());
+  }
+  return true;
+}
+
+struct PageRankStats {
+  size_t iterations = 0;
+  // L1 and L-infinity norms of the difference between the last two rank
+  // vectors.
+  double residual = 0;
+  double max_residual = 0;
+  // Whether the L1 residual went below PageRankOptions::tol.
+  bool converged = false;
+  // Rows recomputed by the last iteration, and edges it decoded, including
+  // the reference lists of the rows decoded one by one; only set by the
+  // in-place methods.
+  size_t updated_rows = 0;
+  size_t decoded_edges = 0;
+};
+
+// Transpose of a matrix, in which row j lists the rows of the matrix that
+// contain j: its edges are rows[offsets[j]] to rows[offsets[j + 1] - 1], in
+// no particular order. See TransposeMatrix().
+struct TransposedMatrix {
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> rows;
+
+  // Bytes needed for the transpose of a matrix of num_nodes rows and
+  // num_edges edges.
+  static size_t Bytes(size_t num_nodes, size_t num_edges) {
+    return (num_nodes + 1) * sizeof(uint64_t) + num_edges * sizeof(uint32_t);
+  }
+};
+
+struct PageRankOptions {
+  size_t max_iter = 100;
+  double dampf = 0.9;
+  // Iterations stop once the L1 residual is below tol, or after max_iter
+  // iterations; 0 always runs max_iter iterations.
+  double tol = 0;
+  PageRankMethod method = PageRankMethod::kJacobi;
+  // Whether each kJacobi iteration is a single pass over the vectors (see
+  // detail::FusedPageRank); column-tiled matrices always take three.
+  bool fused = true;
+  // If positive, in-place methods only recompute the rows that contain a node
+  // whose rank changed by at least active_tol in the previous iteration, with
+  // periodic full sweeps (see detail::InPlacePageRank). They are found from
+  // `transposed`, the transpose of the matrix, which must then be set.
+  double active_tol = 0;
+  const TransposedMatrix* transposed = nullptr;
+  // If set, a random-access view of the same matrix, from which the active
+  // rows are decoded one by one when they are at most seek_fraction of the
+  // rows.
+  CompressedGraph* graph = nullptr;
+  double seek_fraction = 0.05;
+  // If set, receives the nodes of the top_k largest ranks, from the largest
+  // one (see TopK()). They are selected in the pass that writes the ranks,
+  // rather than in another pass over them. Not supported by
+  // PersonalizedPageRank().
+  std::vector<uint64_t>* top = nullptr;
+  size_t top_k = 0;
+  // If set, called after each iteration, e.g. to log the residuals.
+  std::function<void(const PageRankStats&)> on_iteration;
+};
+
+namespace detail {
+// Number of nodes of each task of the element-wise steps of an iteration.
+static constexpr size_t kPageRankBlockSize = 1 << 14;
+
+// L1 and L-infinity norms of a part of the difference of two rank vectors.
+template <typename accum_t>
+struct Residual {
+  accum_t l1 = 0;
+  accum_t linf = 0;
+
+  ZKR_INLINE void Add(accum_t diff) {
+    l1 += diff;
+    linf = std::max(linf, diff);
+  }
+  Residual& operator+=(const Residual& other) {
+    l1 += other.l1;
+    linf = std::max(linf, other.linf);
+    return *this;
+  }
+};
+
+// Records the residual of an iteration; returns whether to stop. Iterations
+// that did not recompute all the rows (`can_stop` false) never stop.
+template <typename accum_t>
+bool EndIteration(const PageRankOptions& options, size_t iter,
+                  const Residual<accum_t>& residual, PageRankStats* stats,
+                  bool can_stop = true) {
+  stats->iterations = iter + 1;
+  stats->residual = residual.l1;
+  stats->max_residual = residual.linf;
+  stats->converged =
+      can_stop && options.tol > 0 && residual.l1 < options.tol;
+  if (options.on_iteration) options.on_iteration(*stats);
+  return stats->converged;
+}
+
+// Computes the next ranks from the product of the matrix with the ranks
+// scaled by the reciprocal of the outdegree, and stores them scaled the same
+// way, as the input of the next product. Also adds up the rank of the
+// dangling nodes and the change of the ranks of the segment.
+template <typename value_t, typename accum_t>
+struct PageRankVisitor : public RowSumVisitor<value_t, accum_t> {
+  // 0 for dangling nodes, whose scaled rank is their rank.
+  const value_t* ZKR_RESTRICT inv_outdeg;
+  accum_t dampf;
+  // Added to dampf * (sum of the row).
+  accum_t base;
+  accum_t dangling = 0;
+  Residual<accum_t> residual;
+
+  ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {
+    accum_t rank = dampf * this->FinishRow(node, reference_offset) + base;
+    accum_t old_rank = this->invec[node];
+    const value_t inv = inv_outdeg[node];
+    if (inv == 0) {
+      dangling += rank;
+      this->outvec[node] = rank;
+    } else {
+      old_rank /= inv;
+      this->outvec[node] = rank * inv;
+    }
+    residual.Add(std::abs(rank - old_rank));
+  }
+};
+
+// Power iteration with three passes over the vectors per iteration: scaling
+// of the ranks and sum of the dangling ones, product, damping.
+template <typename value_t, typename accum_t>
+bool PageRankUnfused(SpMVEngine* engine, const std::vector<uint32_t>& outdeg,
+                     const PageRankOptions& options,
+                     std::vector<value_t>* ranks, PageRankStats* stats) {
+  const size_t N = engine->num_nodes();
+  ThreadPool* pool = engine->pool();
+  const accum_t dampf = options.dampf;
+  const accum_t teleport = (1 - options.dampf) / N;
+  std::vector<value_t> invec(N);
+  ranks->assign(N, value_t(1.0 / N));
+  value_t* ZKR_RESTRICT r = ranks->data();
+  value_t* ZKR_RESTRICT x = invec.data();
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    accum_t dangling = pool->ParallelSum<accum_t>(
+        N, kPageRankBlockSize, [&](size_t begin, size_t end, size_t thread) {
+          accum_t block_dangling = 0;
+          for (size_t i = begin; i < end; i++) {
+            if (outdeg[i] == 0) {
+              block_dangling += r[i];
+              x[i] = r[i];
+            } else {
+              x[i] = accum_t(r[i]) / outdeg[i];
+            }
+          }
+          return block_dangling;
+        });
+    dangling /= N;
+
+    ZKR_RETURN_IF_ERROR((engine->Multiply<value_t, accum_t>(x, r)));
+
+    Residual<accum_t> residual = pool->ParallelSum<Residual<accum_t>>(
+        N, kPageRankBlockSize, [&](size_t begin, size_t end, size_t thread) {
+          Residual<accum_t> block_residual;
+          for (size_t i = begin; i < end; i++) {
+            accum_t old_rank =
+                outdeg[i] == 0 ? accum_t(x[i]) : accum_t(x[i]) * outdeg[i];
+            r[i] = dampf * (r[i] + dangling) + teleport;
+            block_residual.Add(std::abs(r[i] - old_rank));
+          }
+          return block_residual;
+        });
+    if (EndIteration(options, iter, residual, stats)) break;
+  }
+  if (options.top) *options.top = TopK(r, N, options.top_k, pool);
+  return true;
+}
+
+// Power iteration with a single pass over the vectors per iteration. The
+// ranks are kept scaled by the reciprocal of the outdegree, i.e. as the input
+// of the product, and each row is turned into the scaled rank of the next
+// iteration as soon as it is decoded; the sum of the dangling ranks for the
+// next iteration and the residual are computed in the same pass. The vectors
+// are thus streamed four times per iteration (scaled ranks, gathered and
+// read in order, reciprocal outdegrees, next scaled ranks) instead of seven.
+template <typename value_t, typename accum_t>
+bool FusedPageRank(SpMVEngine* engine, const std::vector<uint32_t>& outdeg,
+                   const PageRankOptions& options, std::vector<value_t>* ranks,
+                   PageRankStats* stats) {
+  const size_t N = engine->num_nodes();
+  ThreadPool* pool = engine->pool();
+  const accum_t dampf = options.dampf;
+  const accum_t teleport = (1 - options.dampf) / N;
+  const value_t initial_rank = 1.0 / N;
+  std::vector<value_t> inv_outdeg(N);
+  std::vector<value_t> x(N);
+  std::vector<value_t> next_x(N);
+  accum_t dangling = pool->ParallelSum<accum_t>(
+      N, kPageRankBlockSize, [&](size_t begin, size_t end, size_t thread) {
+        accum_t block_dangling = 0;
+        for (size_t i = begin; i < end; i++) {
+          if (outdeg[i] == 0) {
+            inv_outdeg[i] = 0;
+            x[i] = initial_rank;
+            block_dangling += initial_rank;
+          } else {
+            inv_outdeg[i] = accum_t(1) / outdeg[i];
+            x[i] = accum_t(initial_rank) * inv_outdeg[i];
+          }
+        }
+        return block_dangling;
+      });
+
+  // Segments are added up in order, so that the result does not depend on
+  // the number of threads.
+  std::vector<accum_t> segment_dangling(engine->num_segments());
+  std::vector<Residual<accum_t>> segment_residual(engine->num_segments());
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    const accum_t base = dampf * (dangling / N) + teleport;
+    ZKR_RETURN_IF_ERROR(engine->DecodeSegments(
+        [&](SegmentDecoder& segment, size_t s, size_t thread) {
+          PageRankVisitor<value_t, accum_t> visitor;
+          visitor.invec = x.data();
+          visitor.outvec = next_x.data();
+          visitor.prefetch_distance = engine->prefetch_distance();
+          visitor.inv_outdeg = inv_outdeg.data();
+          visitor.dampf = dampf;
+          visitor.base = base;
+          bool ok = segment.Decode(&visitor);
+          segment_dangling[s] = visitor.dangling;
+          segment_residual[s] = visitor.residual;
+          return ok;
+        }));
+    dangling = 0;
+    Residual<accum_t> residual;
+    for (size_t s = 0; s < segment_dangling.size(); s++) {
+      dangling += segment_dangling[s];
+      residual += segment_residual[s];
+    }
+    x.swap(next_x);
+    if (EndIteration(options, iter, residual, stats)) break;
+  }
+
+  ranks->resize(N);
+  value_t* ZKR_RESTRICT r = ranks->data();
+  ParallelTopK<value_t> top(options.top ? options.top_k : 0,
+                            pool->NumThreads());
+  pool->ParallelFor(N, kPageRankBlockSize,
+                    [&](size_t begin, size_t end, size_t thread) {
+                      for (size_t i = begin; i < end; i++) {
+                        r[i] = inv_outdeg[i] == 0
+                                   ? x[i]
+                                   : value_t(accum_t(x[i]) / inv_outdeg[i]);
+                        top.Push(thread, r[i], i);
+                      }
+                    });
+  if (options.top) *options.top = top.TakeSorted();
+  return true;
+}
+
+// Computes the new rank of each row as soon as it is decoded and stores it,
+// scaled by the reciprocal of the outdegree, in place of the old one. The sum
+// of a reference row was computed before the rows that follow it were
+// updated, so copied and skipped neighbours in [node - reference_offset,
+// node) are corrected with the value they had before their update, which is
+// kept for the last rows. `dangling` follows the updates of the dangling
+// nodes, so that each row uses the current total.
+//
+// If `active` is set, rows with active[node] == 0 keep their rank and are
+// not summed; rows that use one of them as a reference add their copied
+// neighbours one by one. If `changed` is set, the rows that are recomputed
+// set changed[node] to whether their rank changed by at least active_tol.
+//
+// With kConcurrent, other threads update the other segments of x at the same
+// time: x is accessed with relaxed atomic loads and stores, and copied
+// neighbours are added one by one, since the sum of the reference row may
+// hold older values of the entries of other threads.
+template <typename value_t, typename accum_t, bool kConcurrent>
+struct InPlacePageRankVisitor : public DecodeVisitor {
+  value_t* x;
+  const uint32_t* ZKR_RESTRICT outdeg;
+  accum_t dampf;
+  accum_t dampf_over_n;
+  accum_t teleport;
+  accum_t dangling;
+  // Change of `dangling` due to the rows of this visitor.
+  accum_t dangling_delta = 0;
+  Residual<accum_t> residual;
+  const char* active = nullptr;
+  char* changed = nullptr;
+  accum_t active_tol = 0;
+  // Rows whose rank was recomputed, and total degree of the rows that were
+  // decoded, recomputed or not.
+  size_t updated_rows = 0;
+  size_t decoded_edges = 0;
+
+  // The rings are indexed by node modulo a power of two above
+  // MaxNodesBackwards(), as in RowSumVisitor.
+  InPlacePageRankVisitor()
+      : mask_((size_t{1} << (FloorLog2Nonzero(MaxNodesBackwards()) + 1)) - 1),
+        row_sums_(kConcurrent ? 0 : mask_ + 1),
+        summed_(kConcurrent ? 0 : mask_ + 1),
+        old_x_(kConcurrent ? 0 : mask_ + 1) {}
+
+  ZKR_INLINE void RowBegin(size_t node, size_t degree) {
+    decoded_edges += degree;
+    skip_ = active != nullptr && !active[node];
+    copy_one_by_one_ = kConcurrent;
+    sum_ = 0;
+    reference_begin_ = node;
+  }
+
+  ZKR_INLINE void RowReference(size_t node, size_t reference_offset) {
+    reference_begin_ = node - reference_offset;
+    if (!kConcurrent && !summed_[reference_begin_ & mask_]) {
+      copy_one_by_one_ = true;
+    }
+  }
+
+  ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+    if (skip_) return;
+    sum_ += Load(neighbour);
+  }
+
+  ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {
+    if (skip_) return;
+    if (copy_one_by_one_) {
+      sum_ += Load(neighbour);
+    } else if (Updated(neighbour, node)) {
+      sum_ += Load(neighbour) - accum_t(old_x_[neighbour & mask_]);
+    }
+  }
+
+  ZKR_INLINE void SkippedBlock(size_t node, const uint32_t* neighbours,
+                               size_t count) {
+    if (skip_ || copy_one_by_one_) return;
+    for (size_t i = 0; i < count; i++) {
+      const size_t neighbour = neighbours[i];
+      sum_ -= Updated(neighbour, node) ? accum_t(old_x_[neighbour & mask_])
+                                       : Load(neighbour);
+    }
+  }
+
+  ZKR_INLINE void RowEnd(size_t node, size_t reference_offset) {
+    if (skip_) {
+      if (!kConcurrent) {
+        summed_[node & mask_] = false;
+        old_x_[node & mask_] = x[node];
+      }
+      return;
+    }
+    if (!kConcurrent) {
+      if (reference_offset != 0 && !copy_one_by_one_) {
+        sum_ += row_sums_[(node - reference_offset) & mask_];
+      }
+      row_sums_[node & mask_] = sum_;
+      summed_[node & mask_] = true;
+    }
+    const accum_t rank = dampf * sum_ + dampf_over_n * dangling + teleport;
+    const value_t old = Load(node);
+    if (!kConcurrent) old_x_[node & mask_] = old;
+    accum_t old_rank = old;
+    if (outdeg[node] == 0) {
+      Store(node, rank);
+      dangling += rank - old_rank;
+      dangling_delta += rank - old_rank;
+    } else {
+      old_rank *= outdeg[node];
+      Store(node, rank / outdeg[node]);
+    }
+    const accum_t diff = std::abs(rank - old_rank);
+    residual.Add(diff);
+    updated_rows++;
+    if (changed != nullptr) changed[node] = diff >= active_tol;
+  }
+
+ private:
+  ZKR_INLINE accum_t Load(size_t i) const {
+    if (kConcurrent) {
+      value_t value;
+      __atomic_load(x + i, &value, __ATOMIC_RELAXED);
+      return value;
+    }
+    return x[i];
+  }
+
+  ZKR_INLINE void Store(size_t i, value_t value) {
+    if (kConcurrent) {
+      __atomic_store(x + i, &value, __ATOMIC_RELAXED);
+    } else {
+      x[i] = value;
+    }
+  }
+
+  // Whether x[neighbour] changed after the sum of the reference row.
+  ZKR_INLINE bool Updated(size_t neighbour, size_t node) const {
+    return neighbour >= reference_begin_ && neighbour < node;
+  }
+
+  bool skip_ = false;
+  bool copy_one_by_one_ = false;
+  accum_t sum_ = 0;
+  size_t reference_begin_ = 0;
+  size_t mask_;
+  std::vector<accum_t> row_sums_;
+  // Whether the row was summed, i.e. its entry of row_sums_ is valid.
+  std::vector<char> summed_;
+  std::vector<value_t> old_x_;
+};
+
+// Scatters the edges of the matrix into the rows of its transpose: edge
+// (node, neighbour) stores node at position next[neighbour]++ of `rows`.
+// Segments are scattered concurrently, so the rows of the transpose are not
+// sorted. Positions past `size` are not written and clear `ok`.
+struct TransposeVisitor : public DecodeVisitor {
+  uint64_t* next;
+  uint32_t* rows;
+  size_t size;
+  bool ok = true;
+
+  ZKR_INLINE void ResidualEdge(size_t node, size_t neighbour) {
+    const uint64_t pos =
+        __atomic_fetch_add(next + neighbour, 1, __ATOMIC_RELAXED);
+    if (pos >= size) {
+      ok = false;
+      return;
+    }
+    rows[pos] = node;
+  }
+  ZKR_INLINE void CopiedEdge(size_t node, size_t neighbour) {
+    ResidualEdge(node, neighbour);
+  }
+};
+
+// Iterations between full sweeps with PageRankOptions::active_tol.
+static constexpr size_t kActiveRefreshPeriod = 8;
+
+// Number of active rows handed out at a time to the threads when rows are
+// decoded one by one.
+static constexpr size_t kActiveRowBlockSize = 1 << 10;
+
+// Gauss-Seidel (segments in order on the calling thread) or asynchronous
+// (segments on the pool) iteration on a single vector of scaled ranks; the
+// outdegrees are read from `outdeg` rather than kept as reciprocals, so that
+// no other vector is allocated.
+//
+// With options.active_tol, each iteration only recomputes the active rows,
+// i.e. those that contain a node whose rank changed by at least active_tol
+// in the previous iteration; they are found from the rows of
+// options.transposed of the changed nodes. Segments without active rows are
+// not decoded; if at most options.seek_fraction of the rows are active and
+// options.graph is set, the active rows are decoded one by one from it
+// instead of decoding their segments. The smaller changes, and those
+// of the dangling total, which all the rows use, are caught up by full
+// sweeps: every kActiveRefreshPeriod-th iteration, and the one after an
+// iteration whose residual is below tol, recompute all the rows; only those
+// can stop the iteration; if the latter do not reach tol, active_tol is
+// lowered tenfold.
+template <typename value_t, typename accum_t>
+bool InPlacePageRank(SpMVEngine* engine, const std::vector<uint32_t>& outdeg,
+                     const PageRankOptions& options,
+                     std::vector<value_t>* ranks, PageRankStats* stats) {
+  const size_t N = engine->num_nodes();
+  const size_t num_segments = engine->num_segments();
+  ThreadPool* pool = engine->pool();
+  const value_t initial_rank = 1.0 / N;
+  ranks->resize(N);
+  value_t* ZKR_RESTRICT x = ranks->data();
+  accum_t dangling = pool->ParallelSum<accum_t>(
+      N, kPageRankBlockSize, [&](size_t begin, size_t end, size_t thread) {
+        accum_t block_dangling = 0;
+        for (size_t i = begin; i < end; i++) {
+          if (outdeg[i] == 0) {
+            x[i] = initial_rank;
+            block_dangling += initial_rank;
+          } else {
+            x[i] = accum_t(initial_rank) / outdeg[i];
+          }
+        }
+        return block_dangling;
+      });
+
+  const bool delta = options.active_tol > 0;
+  accum_t active_tol = options.active_tol;
+  const TransposedMatrix* transposed = options.transposed;
+  std::vector<char> active(delta ? N : 0);
+  std::vector<char> changed(delta ? N : 0);
+  // Active rows of each segment, and list of the active rows when they are
+  // decoded one by one.
+  std::vector<size_t> segment_active(num_segments);
+  std::vector<uint32_t> active_rows;
+  // Whether the next iteration recomputes all the rows, and whether it does
+  // because the residual of the previous one is below tol.
+  bool full = true;
+  bool checking = false;
+
+  const auto init = [&](auto* visitor) {
+    visitor->x = x;
+    visitor->outdeg = outdeg.data();
+    visitor->dampf = options.dampf;
+    visitor->dampf_over_n = options.dampf / N;
+    visitor->teleport = (1 - options.dampf) / N;
+    visitor->dangling = dangling;
+    visitor->active = delta && !full ? active.data() : nullptr;
+    visitor->changed = delta ? changed.data() : nullptr;
+    visitor->active_tol = active_tol;
+  };
+  const bool concurrent =
+      options.method == PageRankMethod::kAsync && pool->NumThreads() > 1;
+  // Results of each segment, or block of active rows, as they are added up
+  // in order.
+  struct Part {
+    accum_t dangling_delta = 0;
+    Residual<accum_t> residual;
+    size_t updated_rows = 0;
+    size_t decoded_edges = 0;
+  };
+  std::vector<Part> parts;
+  const auto record = [&](size_t p, const auto& visitor) {
+    parts[p].dangling_delta = visitor.dangling_delta;
+    parts[p].residual = visitor.residual;
+    parts[p].updated_rows = visitor.updated_rows;
+    parts[p].decoded_edges = visitor.decoded_edges;
+  };
+  // Decodes the active rows in [begin, end) of active_rows one by one, into
+  // the buffer of `thread`.
+  std::vector<std::vector<uint32_t>> row_buffers(pool->NumThreads());
+  const auto decode_rows = [&](auto* visitor, size_t begin, size_t end,
+                               size_t thread) {
+    std::vector<uint32_t>& neighbours = row_buffers[thread];
+    for (size_t i = begin; i < end; i++) {
+      const size_t node = active_rows[i];
+      size_t decoded_edges = 0;
+      const size_t degree =
+          options.graph->NeighboursInto(node, &neighbours, &decoded_edges);
+      visitor->RowBegin(node, degree);
+      // Count the reference lists decoded for the row too.
+      visitor->decoded_edges -= degree;
+      visitor->decoded_edges += decoded_edges;
+      for (uint32_t neighbour : neighbours) {
+        visitor->ResidualEdge(node, neighbour);
+      }
+      visitor->RowEnd(node, 0);
+    }
+  };
+  // Activates the rows that contain a changed node, and clears `changed`.
+  const auto activate = [&]() {
+    std::fill(active.begin(), active.end(), 0);
+    pool->ParallelFor(N, kPageRankBlockSize,
+                      [&](size_t begin, size_t end, size_t thread) {
+                        for (size_t j = begin; j < end; j++) {
+                          if (!changed[j]) continue;
+                          changed[j] = 0;
+                          for (uint64_t e = transposed->offsets[j];
+                               e < transposed->offsets[j + 1]; e++) {
+                            __atomic_store_n(&active[transposed->rows[e]], 1,
+                                             __ATOMIC_RELAXED);
+                          }
+                        }
+                      });
+  };
+
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    size_t num_active = N;
+    if (delta && !full) {
+      pool->Run(num_segments, [&](size_t s, size_t thread) {
+        const GraphSegment& segment = engine->segment(s);
+        segment_active[s] =
+            std::count(active.begin() + segment.first_node,
+                       active.begin() + segment.first_node + segment.num_nodes,
+                       1);
+      });
+      num_active = 0;
+      for (size_t count : segment_active) num_active += count;
+    }
+    const bool seek = delta && !full && options.graph != nullptr &&
+                      num_active <= options.seek_fraction * N;
+    if (seek) {
+      active_rows.clear();
+      for (size_t i = 0; i < N; i++) {
+        if (active[i]) active_rows.push_back(i);
+      }
+    }
+    // Segments without active rows are skipped.
+    const auto needed = [&](size_t s) {
+      return !delta || full || segment_active[s] != 0;
+    };
+
+    if (concurrent) {
+      if (seek) {
+        parts.assign(DivCeil(active_rows.size(), kActiveRowBlockSize), Part());
+        pool->ParallelFor(
+            active_rows.size(), kActiveRowBlockSize,
+            [&](size_t begin, size_t end, size_t thread) {
+              InPlacePageRankVisitor<value_t, accum_t, true> visitor;
+              init(&visitor);
+              decode_rows(&visitor, begin, end, thread);
+              record(begin / kActiveRowBlockSize, visitor);
+            });
+      } else {
+        parts.assign(num_segments, Part());
+        ZKR_RETURN_IF_ERROR(engine->DecodeSegments(
+            [&](SegmentDecoder& segment, size_t s, size_t thread) {
+              if (!needed(s)) return true;
+              InPlacePageRankVisitor<value_t, accum_t, true> visitor;
+              init(&visitor);
+              bool ok = segment.Decode(&visitor);
+              record(s, visitor);
+              return ok;
+            }));
+      }
+    } else {
+      // A single part, and the dangling ranks carried from row to row.
+      parts.assign(1, Part());
+      InPlacePageRankVisitor<value_t, accum_t, false> visitor;
+      init(&visitor);
+      if (seek) {
+        decode_rows(&visitor, 0, active_rows.size(), /*thread=*/0);
+      } else {
+        for (size_t s = 0; s < num_segments; s++) {
+          if (needed(s)) ZKR_RETURN_IF_ERROR(engine->DecodeSegment(s, &visitor));
+        }
+      }
+      record(0, visitor);
+    }
+
+    Residual<accum_t> residual;
+    stats->updated_rows = 0;
+    stats->decoded_edges = 0;
+    for (const Part& part : parts) {
+      dangling += part.dangling_delta;
+      residual += part.residual;
+      stats->updated_rows += part.updated_rows;
+      stats->decoded_edges += part.decoded_edges;
+    }
+    const bool was_full = full;
+    if (EndIteration(options, iter, residual, stats, !delta || was_full)) {
+      break;
+    }
+    // The rows left out by active_tol changed too much for the full sweep
+    // that checked the residual of the partial ones.
+    if (delta && was_full && checking) active_tol /= 10;
+    checking = options.tol > 0 && residual.l1 < options.tol;
+    full = checking || (iter + 1) % kActiveRefreshPeriod == 0;
+    if (delta && !full) activate();
+  }
+
+  ParallelTopK<value_t> top(options.top ? options.top_k : 0,
+                            pool->NumThreads());
+  pool->ParallelFor(N, kPageRankBlockSize,
+                    [&](size_t begin, size_t end, size_t thread) {
+                      for (size_t i = begin; i < end; i++) {
+                        if (outdeg[i] != 0) x[i] = accum_t(x[i]) * outdeg[i];
+                        top.Push(thread, x[i], i);
+                      }
+                    });
+  if (options.top) *options.top = top.TakeSorted();
+  return true;
+}
+}  // namespace detail
+
+// Builds the transpose of the matrix of `engine`, whose row j has outdeg[j]
+// edges, in one pass over the matrix, on the pool of the engine. Fails if it
+// would take more than max_bytes.
+inline bool TransposeMatrix(SpMVEngine* engine,
+                            const std::vector<uint32_t>& outdeg,
+                            size_t max_bytes, TransposedMatrix* transposed) {
+  const size_t N = engine->num_nodes();
+  if (outdeg.size() != N) {
+    return ZKR_FAILURE("Column count does not match the matrix");
+  }
+  uint64_t num_edges = 0;
+  for (uint32_t count : outdeg) num_edges += count;
+  const size_t bytes = TransposedMatrix::Bytes(N, num_edges);
+  if (bytes > max_bytes) {
+    return ZKR_FAILURE("The transposed matrix needs %zu MB, above %zu MB",
+                       DivCeil(bytes, size_t{1} << 20), max_bytes >> 20);
+  }
+  // offsets[j + 1] starts at the first position of row j, and is the next
+  // free position of the row while the edges are scattered, so that it ends
+  // at the start of row j + 1.
+  std::vector<uint64_t>& offsets = transposed->offsets;
+  offsets.assign(N + 1, 0);
+  for (size_t j = 1; j < N; j++) offsets[j + 1] = offsets[j] + outdeg[j - 1];
+  transposed->rows.resize(num_edges);
+  ZKR_RETURN_IF_ERROR(engine->DecodeSegments(
+      [&](detail::SegmentDecoder& segment, size_t s, size_t thread) {
+        detail::TransposeVisitor visitor;
+        visitor.next = offsets.data() + 1;
+        visitor.rows = transposed->rows.data();
+        visitor.size = num_edges;
+        return segment.Decode(&visitor) && visitor.ok;
+      }));
+  uint64_t end = 0;
+  for (size_t j = 0; j < N; j++) {
+    end += outdeg[j];
+    if (offsets[j + 1] != end) {
+      return ZKR_FAILURE("Column count does not match the matrix");
+    }
+  }
+  return true;
+}
+
+// Computes the PageRank vector by power iteration from the uniform vector,
+// for the matrix A of `engine`, in which row i lists the nodes that link to i
+// and outdeg[j] is the number of rows in which j appears. Each iteration
+// computes
+//   ranks = dampf * (A * (ranks / outdeg) + dangling / N) + (1 - dampf) / N,
+// where dangling is the total rank of the nodes with outdeg 0. Ranks are
+// stored as value_t and summed as accum_t. The element-wise steps run on the
+// pool of the engine too. Partial residuals and dangling ranks are added up
+// in a fixed order, so that the result does not depend on the number of
+// threads. If not null, `stats` receives the number of iterations and the
+// last residuals.
+template <typename value_t, typename accum_t = value_t>
+bool PageRank(SpMVEngine* engine, const std::vector<uint32_t>& outdeg,
+              const PageRankOptions& options, std::vector<value_t>* ranks,
+              PageRankStats* stats = nullptr) {
+  if (outdeg.size() != engine->num_nodes()) {
+    return ZKR_FAILURE("Column count does not match the matrix");
+  }
+  PageRankStats local_stats;
+  if (stats == nullptr) stats = &local_stats;
+  *stats = PageRankStats();
+  if (options.active_tol > 0 && options.method == PageRankMethod::kJacobi) {
+    return ZKR_FAILURE("Active rows need an in-place method");
+  }
+  if (options.active_tol > 0 &&
+      (options.transposed == nullptr ||
+       options.transposed->offsets.size() != engine->num_nodes() + 1)) {
+    return ZKR_FAILURE("Active rows need the transposed matrix");
+  }
+  if (options.method != PageRankMethod::kJacobi) {
+    if (engine->num_tiles() != 0) {
+      return ZKR_FAILURE("In-place PageRank needs whole rows, not column tiles");
+    }
+    return detail::InPlacePageRank<value_t, accum_t>(engine, outdeg, options,
+                                                     ranks, stats);
+  }
+  if (options.fused && engine->num_tiles() == 0) {
+    return detail::FusedPageRank<value_t, accum_t>(engine, outdeg, options,
+                                                   ranks, stats);
+  }
+  return detail::PageRankUnfused<value_t, accum_t>(engine, outdeg, options,
+                                                   ranks, stats);
+}
+
+// Same as above, with the precision chosen at runtime; the ranks are returned
+// as double in any case.
+inline bool PageRank(SpMVEngine* engine, const std::vector<uint32_t>& outdeg,
+                     const PageRankOptions& options, Precision precision,
+                     std::vector<double>* ranks,
+                     PageRankStats* stats = nullptr) {
+  if (precision == Precision::kDouble) {
+    return PageRank<double>(engine, outdeg, options, ranks, stats);
+  }
+  std::vector<float> float_ranks;
+  if (precision == Precision::kFloat) {
+    ZKR_RETURN_IF_ERROR(
+        (PageRank<float>(engine, outdeg, options, &float_ranks, stats)));
+  } else {
+    ZKR_RETURN_IF_ERROR((PageRank<float, double>(engine, outdeg, options,
+                                                 &float_ranks, stats)));
+  }
+  ranks->assign(float_ranks.begin(), float_ranks.end());
+  return true;
+}
+
+namespace detail {
+// k sums at once, for ThreadPool::ParallelSum.
+template <typename T>
+struct LaneSums {
+  std::vector<T> lanes;
+
+  LaneSums& operator+=(const LaneSums& other) {
+    if (lanes.empty()) lanes.resize(other.lanes.size());
+    for (size_t j = 0; j < lanes.size(); j++) lanes[j] += other.lanes[j];
+    return *this;
+  }
+};
+
+// Entry (node, lane) of a teleport vector, with the share of its seed set.
+struct SeedEntry {
+  uint32_t node;
+  uint32_t lane;
+  double weight;
+
+  bool operator<(const SeedEntry& other) const {
+    return node != other.node ? node < other.node : lane < other.lane;
+  }
+};
+}  // namespace detail
+
+// Computes the personalized PageRank vectors of k = seeds.size() seed sets at
+// once, for the same matrix as PageRank(): for seed set j, with v_j the
+// uniform vector on the nodes of seeds[j] (repeated nodes count twice),
+//   ranks_j = dampf * A * (ranks_j / outdeg) + (dampf * dangling_j +
+//             1 - dampf) * v_j,
+// from ranks_j = v_j, where dangling_j is the rank of the dangling nodes,
+// which thus also go back to the seeds. The k vectors are stored row-major
+// in `ranks` (rank of node i for seed set j at i * k + j), so that each
+// iteration decodes each row once for all of them (see
+// SpMVEngine::Multiply(invecs, outvecs, k)). Iterations stop once the L1
+// residual of every vector is below options.tol; `stats` receives the
+// largest residuals. Only the Jacobi method is supported, and column-tiled
+// matrices are not.
+template <typename value_t>
+bool PersonalizedPageRank(SpMVEngine* engine,
+                          const std::vector<uint32_t>& outdeg,
+                          const std::vector<std::vector<uint32_t>>& seeds,
+                          const PageRankOptions& options,
+                          std::vector<value_t>* ranks,
+                          PageRankStats* stats = nullptr) {
+  const size_t N = engine->num_nodes();
+  const size_t k = seeds.size();
+  if (outdeg.size() != N) {
+    return ZKR_FAILURE("Column count does not match the matrix");
+  }
+  if (options.method != PageRankMethod::kJacobi || options.active_tol > 0) {
+    return ZKR_FAILURE("Personalized PageRank only supports Jacobi");
+  }
+  if (k == 0) return ZKR_FAILURE("No seed sets");
+  PageRankStats local_stats;
+  if (stats == nullptr) stats = &local_stats;
+  *stats = PageRankStats();
+
+  std::vector<detail::SeedEntry> entries;
+  for (size_t j = 0; j < k; j++) {
+    if (seeds[j].empty()) return ZKR_FAILURE("Empty seed set %zu", j);
+    for (uint32_t node : seeds[j]) {
+      if (node >= N) return ZKR_FAILURE("Invalid seed %u", node);
+      entries.push_back({node, uint32_t(j), 1.0 / seeds[j].size()});
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  ThreadPool* pool = engine->pool();
+  const value_t dampf = options.dampf;
+  ranks->assign(N * k, 0);
+  for (const detail::SeedEntry& entry : entries) {
+    (*ranks)[entry.node * k + entry.lane] += entry.weight;
+  }
+  std::vector<value_t> invecs(N * k);
+  value_t* ZKR_RESTRICT r = ranks->data();
+  value_t* ZKR_RESTRICT x = invecs.data();
+  // Blocks of the element-wise steps have kPageRankBlockSize entries.
+  const size_t block_nodes = DivCeil(detail::kPageRankBlockSize, k);
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    detail::LaneSums<value_t> dangling =
+        pool->ParallelSum<detail::LaneSums<value_t>>(
+            N, block_nodes, [&](size_t begin, size_t end, size_t thread) {
+              detail::LaneSums<value_t> block_dangling;
+              block_dangling.lanes.resize(k);
+              for (size_t i = begin; i < end; i++) {
+                value_t* xi = x + i * k;
+                const value_t* ri = r + i * k;
+                if (outdeg[i] == 0) {
+                  for (size_t j = 0; j < k; j++) {
+                    block_dangling.lanes[j] += ri[j];
+                    xi[j] = ri[j];
+                  }
+                } else {
+                  const value_t inv = value_t(1) / outdeg[i];
+                  for (size_t j = 0; j < k; j++) xi[j] = ri[j] * inv;
+                }
+              }
+              return block_dangling;
+            });
+    // Teleport and dangling rank of each seed set, spread on its seeds.
+    std::vector<value_t> seed_rank(k);
+    for (size_t j = 0; j < k; j++) {
+      seed_rank[j] = dampf * dangling.lanes[j] + (1 - dampf);
+    }
+
+    ZKR_RETURN_IF_ERROR(engine->Multiply(x, r, k));
+
+    detail::LaneSums<detail::Residual<value_t>> residual =
+        pool->ParallelSum<detail::LaneSums<detail::Residual<value_t>>>(
+            N, block_nodes, [&](size_t begin, size_t end, size_t thread) {
+              detail::LaneSums<detail::Residual<value_t>> block_residual;
+              block_residual.lanes.resize(k);
+              auto entry = std::lower_bound(
+                  entries.begin(), entries.end(),
+                  detail::SeedEntry{uint32_t(begin), 0, 0});
+              for (size_t i = begin; i < end; i++) {
+                value_t* ri = r + i * k;
+                const value_t* xi = x + i * k;
+                for (size_t j = 0; j < k; j++) ri[j] *= dampf;
+                for (; entry != entries.end() && entry->node == i; ++entry) {
+                  ri[entry->lane] += seed_rank[entry->lane] * entry->weight;
+                }
+                const value_t scale = outdeg[i] == 0 ? 1 : outdeg[i];
+                for (size_t j = 0; j < k; j++) {
+                  block_residual.lanes[j].Add(std::abs(ri[j] - xi[j] * scale));
+                }
+              }
+              return block_residual;
+            });
+    // The slowest vector decides.
+    detail::Residual<value_t> max_residual;
+    for (const detail::Residual<value_t>& lane : residual.lanes) {
+      max_residual.l1 = std::max(max_residual.l1, lane.l1);
+      max_residual.linf = std::max(max_residual.linf, lane.linf);
+    }
+    if (detail::EndIteration(options, iter, max_residual, stats)) break;
+  }
+  return true;
+}
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_PAGERANK_H
@@ -1,86 +1,390 @@
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE
-#endif
-#include <thread>
-#include <sched.h>
-
-inline static int set_core(std::thread *thread, int tid, const int ncores) {
-    // Set thread affinity
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(tid % ncores, &cpuset);
-    const int rc =pthread_setaffinity_np(thread->native_handle(),sizeof(cpu_set_t), &cpuset);
-    if (rc != 0) {
-        fprintf(stderr, "Error setting thread affinity: %d\n", rc);
-        exit(1);
-    }
-    return rc;
-};
-
-inline int set_core(pthread_t *thread, int tid, const int ncores) {
-    // Set thread affinity
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(tid % ncores, &cpuset); // Assign thread to a core in a round-robin fashion
-    const int rc = pthread_setaffinity_np(*thread, sizeof(cpu_set_t), &cpuset);
-    if (rc != 0) {
-        fprintf(stderr, "Error setting thread affinity: %d\n", rc);
-        exit(1);
-    }
-    return rc;
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "common.h"
+#include "compressed_graph.h"
+#include "encode.h"
+#include "mapped_file.h"
+#include "multiply.h"
+#include "outdeg.h"
+#include "pagerank.h"
+#include "thread_pool.h"
+#include "top_k.h"
+
+// Shared part of the PageRank drivers, which only differ in the size of their
+// thread pool. Each driver includes this file in its only source file, which
+// defines the flags below.
+
+ABSL_FLAG(std::string, input_path, "",
+          "Input matrix, one .zkr file (with a few segments per thread for "
+          "pageranker_pthread)");
+//ABSL_FLAG(std::string, input_vector_path, "", "Input vector path");
+//ABSL_FLAG(std::string, output_vector_path, "", "Output vector path");
+ABSL_FLAG(std::string, ccount_path, "", "Column count");
+
+ABSL_FLAG(std::string, verbose, "0", "verbose");
+ABSL_FLAG(std::string, maxiter, "100", "maximum number of iteration, def. 100");
+ABSL_FLAG(std::string, tol, "0", "stop when the L1 change of the ranks is below tol (default 0, always run maxiter iterations)");
+ABSL_FLAG(std::string, dampf, "0.9", "damping factor (default 0.9)");
+ABSL_FLAG(std::string, topk, "3", "show top K nodes (default 3)");
+ABSL_FLAG(std::string, precision, "double",
+          "arithmetic of the ranks: double, float or mixed (float storage, double sums)");
+ABSL_FLAG(std::string, method, "jacobi",
+          "update of the ranks: jacobi, gauss_seidel (in place, in order) or async (in place, all threads)");
+ABSL_FLAG(std::string, active_tol, "0",
+          "with gauss_seidel or async, only recompute the ranks whose inputs changed by at least active_tol (default 0, all)");
+ABSL_FLAG(std::string, active_max_mb, "1024",
+          "memory budget of the transposed matrix that --active_tol keeps, in MB (default 1024)");
+ABSL_FLAG(std::string, seeds_path, "",
+          "file of seed sets, one per line: compute their personalized PageRank instead");
+ABSL_FLAG(std::string, batch, "16", "seed sets iterated at once with --seeds_path (default 16)");
+ABSL_FLAG(bool, compare_double, false,
+          "also compute the ranks in double and report the error of --precision");
+
+// Reads the column counts of a matrix of n nodes from a file of n 32-bit
+// integers. Returns false, after an error message, if the file cannot be read
+// or does not hold exactly n counts.
+static bool read_column_counts(const std::string &path, size_t n,
+                               std::vector<uint32_t> &counts) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Cannot open column count file %s\n", path.c_str());
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    const size_t length = file.tellg();
+    if (length % sizeof(uint32_t) != 0 || length / sizeof(uint32_t) != n) {
+        fprintf(stderr,
+                "Column count file %s has %zu bytes, but the matrix has %zu "
+                "nodes (%zu bytes expected)\n",
+                path.c_str(), length, n, n * sizeof(uint32_t));
+        return false;
+    }
+    counts.resize(n);
+    file.seekg(0, std::ios::beg);
+    if (!file.read(reinterpret_cast<char *>(counts.data()),
+                   n * sizeof(uint32_t))) {
+        fprintf(stderr, "Cannot read column count file %s\n", path.c_str());
+        return false;
+    }
+    return true;
 }
 
-// heap based algorithm for finding the k largest ranks
-// in heap order
+// Reads seed sets for personalized PageRank, one per line, as node ids
+// separated by blanks; empty lines are skipped. Returns false, after an
+// error message, if the file cannot be read or an id is not below n.
+static bool read_seed_sets(const std::string &path, size_t n,
+                           std::vector<std::vector<uint32_t>> &seeds) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Cannot open seed file %s\n", path.c_str());
+        return false;
+    }
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); line_number++) {
+        std::istringstream fields(line);
+        std::vector<uint32_t> seed_set;
+        long long node;
+        while (fields >> node) {
+            if (node < 0 || (size_t)node >= n) {
+                fprintf(stderr, "Invalid seed %lld at line %zu\n", node, line_number);
+                return false;
+            }
+            seed_set.push_back(node);
+        }
+        if (!fields.eof()) {
+            fprintf(stderr, "Invalid seed at line %zu\n", line_number);
+            return false;
+        }
+        if (!seed_set.empty()) seeds.push_back(std::move(seed_set));
+    }
+    return true;
+}
 
-// A utility function to swap two elements
-static void swap(unsigned* a, unsigned* b) {
-    unsigned t = *a;
-    *a = *b;
-    *b = t;
+// Reports on stderr how far `ranks` are from `baseline` (the ranks computed
+// in double): L1 and largest absolute error, and how many of the top k nodes
+// of the baseline are among the top k of `ranks`.
+static void report_precision_error(std::vector<double> &ranks, std::vector<double> &baseline, int k,
+                                   zuckerli::ThreadPool *pool) {
+    const size_t n = ranks.size();
+    double l1 = 0, max_err = 0;
+    for (size_t i = 0; i < n; i++) {
+        const double err = std::abs(ranks[i] - baseline[i]);
+        l1 += err;
+        max_err = std::max(max_err, err);
+    }
+    k = std::min<size_t>(k, n);
+    std::vector<uint64_t> top = zuckerli::TopK(ranks.data(), n, k, pool);
+    std::vector<uint64_t> top_baseline = zuckerli::TopK(baseline.data(), n, k, pool);
+    std::sort(top.begin(), top.end());
+    std::sort(top_baseline.begin(), top_baseline.end());
+    std::vector<uint64_t> common;
+    std::set_intersection(top.begin(), top.end(), top_baseline.begin(), top_baseline.end(),
+                          std::back_inserter(common));
+    fprintf(stderr, "Error against double: L1 %g, max %g, top %d overlap %zu\n",
+            l1, max_err, k, common.size());
 }
 
-// Heapify a subtree rooted with node i which is an index in arr[].
-// n is size of heap. the key associated to entry arr[i] is v[arr[i]]
-static void minHeapify(std::vector<double> &v, unsigned arr[], unsigned n, unsigned i) {
-    unsigned smallest = i;  // Initialize smallest as root
-    unsigned left = 2*i + 1;
-    unsigned right = 2*i + 2;
+// Prints the usage of the driver `name`, whose own options are described by
+// `driver_options`, and exits.
+static void usage_and_exit(const char *name, const char *driver_options) {
+    fprintf(stderr, "Usage:\n\t  %s [options] --input_path matrix.zkr\n", name);
+    fprintf(stderr, "\t\t--ccount_path    column count file (default: stored in or computed from the matrix)\n");
+    fprintf(stderr, "\t\t--verbose        verbose, def. 0\n");
+    fputs(driver_options, stderr);
+    fprintf(stderr, "\t\t--maxiter        maximum number of iteration, def. 100\n");
+    fprintf(stderr, "\t\t--tol            stop if the L1 change of the ranks is below tol (default 0, ignore it)\n");
+    fprintf(stderr, "\t\t--dampf          damping factor (default 0.9)\n");
+    fprintf(stderr, "\t\t--topk           show top K nodes (default 3)\n");
+    fprintf(stderr, "\t\t--precision      double, float or mixed (default double)\n");
+    fprintf(stderr, "\t\t--method         jacobi, gauss_seidel or async (default jacobi)\n");
+    fprintf(stderr, "\t\t--active_tol     only recompute the ranks whose inputs changed by at least active_tol (default 0, all)\n");
+    fprintf(stderr, "\t\t--active_max_mb  memory budget of the transposed matrix for --active_tol (default 1024)\n");
+    fprintf(stderr, "\t\t--seeds_path     personalized PageRank of the seed sets in this file, one per line\n");
+    fprintf(stderr, "\t\t--batch          seed sets iterated at once (default 16)\n");
+    fprintf(stderr, "\t\t--compare_double report the error against double ranks\n");
+    exit(1);
+}
 
-    // If left child is smaller than root
-    if (left < n && v[arr[left]] < v[arr[smallest]])
-        smallest = left;
+// Runs the driver on the threads of `pool`, with the command line already
+// parsed; returns the exit code of the driver. `driver_options` is as in
+// usage_and_exit().
+static int run_pagerank(int argc, char **argv, zuckerli::ThreadPool *pool,
+                        const char *driver_options) {
+    // Ensure that encoder-only flags are recognized by the decoder too.
+    (void) absl::GetFlag(FLAGS_allow_random_access);
+    (void) absl::GetFlag(FLAGS_greedy_random_access);
 
-    // If right child is smaller than smallest so far
-    if (right < n && v[arr[right]] < v[arr[smallest]])
-        smallest = right;
+    //args
+    const int verbose=atoi(absl::GetFlag(FLAGS_verbose).c_str());
+    const int maxiter=atoi(absl::GetFlag(FLAGS_maxiter).c_str());
+    const double tol=atof(absl::GetFlag(FLAGS_tol).c_str());
+    const double dampf=atof(absl::GetFlag(FLAGS_dampf).c_str());
+    int topk=atoi(absl::GetFlag(FLAGS_topk).c_str());
+    if(verbose>0) {
+        fputs("==== Command line:\n",stderr);
+        for(int i=0;i<argc;i++)
+            fprintf(stderr, " %s",argv[i]);
+        fputs("\n",stderr);
+    }
+    // check command line
+    if(maxiter<1 || topk<1) {
+        fprintf(stderr, "Error! Options --maxiter and --topk must be at least one\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    if(tol<0) {
+        fprintf(stderr, "Error! Option --tol must be non-negative\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    if(dampf<0 || dampf>1) {
+        fprintf(stderr, "Error! Options --dampf must be in the range [0,1]\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    zuckerli::PageRankMethod method;
+    if (!zuckerli::ParsePageRankMethod(absl::GetFlag(FLAGS_method), &method)) {
+        fprintf(stderr, "Error! Option --method must be jacobi, gauss_seidel or async\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    const double active_tol=atof(absl::GetFlag(FLAGS_active_tol).c_str());
+    if(active_tol<0 || (active_tol>0 && method==zuckerli::PageRankMethod::kJacobi)) {
+        fprintf(stderr, "Error! Option --active_tol must be non-negative, and needs --method gauss_seidel or async\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    const int active_max_mb=atoi(absl::GetFlag(FLAGS_active_max_mb).c_str());
+    if(active_max_mb<0) {
+        fprintf(stderr, "Error! Option --active_max_mb must be non-negative\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    const std::string seeds_path = absl::GetFlag(FLAGS_seeds_path);
+    const int batch=atoi(absl::GetFlag(FLAGS_batch).c_str());
+    if(!seeds_path.empty() && (batch<1 || method!=zuckerli::PageRankMethod::kJacobi)) {
+        fprintf(stderr, "Error! Option --seeds_path needs --batch at least one and --method jacobi\n");
+        usage_and_exit(argv[0], driver_options);
+    }
+    zuckerli::Precision precision;
+    if (!zuckerli::ParsePrecision(absl::GetFlag(FLAGS_precision), &precision)) {
+        fprintf(stderr, "Error! Option --precision must be double, float or mixed\n");
+        usage_and_exit(argv[0], driver_options);
+    }
 
-    // If smallest is not root
-    if (smallest != i) {
-        swap(&arr[i], &arr[smallest]);
-        // Recursively heapify the affected sub-tree
-        minHeapify(v, arr, n, smallest);
+    //data
+    zuckerli::MappedFile data(absl::GetFlag(FLAGS_input_path),
+                              zuckerli::MappedFile::Access::kSequential,
+                              absl::GetFlag(FLAGS_huge_pages));
+    zuckerli::SpMVEngine engine;
+    if (!engine.Init(data.bytes(), pool)) {
+        fprintf(stderr, "Invalid graph\n");
+        return EXIT_FAILURE;
+    }
+    if (!engine.set_prefetch_distance(absl::GetFlag(FLAGS_prefetch_distance))) {
+        fprintf(stderr, "Invalid prefetch distance\n");
+        return EXIT_FAILURE;
+    }
+    //column counts: from --ccount_path, or else from the matrix itself
+    uint32_t nnodes;
+    std::vector<double> outvec;
+    std::vector<uint32_t> outdeg;
+    if (!absl::GetFlag(FLAGS_ccount_path).empty()) {
+        nnodes = engine.num_nodes();
+        if (!read_column_counts(absl::GetFlag(FLAGS_ccount_path), nnodes, outdeg)) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        // Decoded on the threads of the pool if the matrix does not store them.
+        const auto count_start = std::chrono::steady_clock::now();
+        bool from_section;
+        if (!zuckerli::ReadOrComputeOutDeg(engine.decoder(), outdeg, pool, &from_section)) {
+            fprintf(stderr, "Invalid graph\n");
+            return EXIT_FAILURE;
+        }
+        nnodes = engine.num_nodes();
+        if (verbose > 0) {
+            fprintf(stderr, "Column counts %s in %.3f s\n",
+                    from_section ? "read from the matrix" : "computed",
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - count_start).count());
+        }
     }
-}
 
-// Function to find the k'th largest elements in an array
-// v[0..n-1], arr[0..k-1] is the output array already allocated
-static void kLargest(std::vector<double> &v, unsigned arr[], unsigned n, unsigned k) {
-    assert(k<=n);
-    assert(k>0);
-    // init arr[] with the first k elements
-    for(unsigned i=0;i<k;i++) arr[i] = i;
-    // Build a min heap of first (k) elements in arr[]
-    for (long int i = k / 2 - 1; i >= 0; i--)
-        minHeapify(v, arr, k, i);
-    // Iterate through the rest of the array elements
-    for (unsigned i = k; i < n; i++) {
-        // If current element is larger than root of the heap
-        if (v[i] > v[arr[0]]) {
-            // Replace root with current element
-            arr[0] = i;
-            // Heapify the root
-            minHeapify(v, arr, k, 0);
+    //business logic
+    zuckerli::PageRankOptions options;
+    options.max_iter = maxiter;
+    options.dampf = dampf;
+    options.tol = tol;
+    options.method = method;
+    options.active_tol = active_tol;
+    // The rows that use a changed rank are found from the transposed matrix,
+    // built once for all the runs below.
+    zuckerli::TransposedMatrix transposed;
+    if (active_tol > 0) {
+        uint64_t nedges = 0;
+        for (uint32_t count : outdeg) nedges += count;
+        const size_t transposed_mb = zuckerli::DivCeil(
+                zuckerli::TransposedMatrix::Bytes(outdeg.size(), nedges), size_t{1} << 20);
+        if (transposed_mb > size_t(active_max_mb)) {
+            fprintf(stderr, "Error! The transposed matrix for --active_tol needs %zu MB, above --active_max_mb\n",
+                    transposed_mb);
+            return EXIT_FAILURE;
+        }
+        const auto transpose_start = std::chrono::steady_clock::now();
+        if (!zuckerli::TransposeMatrix(&engine, outdeg, size_t(active_max_mb) << 20, &transposed)) {
+            fprintf(stderr, "Invalid graph\n");
+            return EXIT_FAILURE;
+        }
+        options.transposed = &transposed;
+        if (verbose > 0) {
+            fprintf(stderr, "Matrix transposed in %.3f s\n",
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - transpose_start).count());
+        }
+    }
+    // Random-access files let sparse iterations decode the active rows only.
+    std::unique_ptr<zuckerli::CompressedGraph> graph;
+    if (active_tol > 0 && engine.allow_random_access()) {
+        graph.reset(new zuckerli::CompressedGraph(absl::GetFlag(FLAGS_input_path),
+                                                  absl::GetFlag(FLAGS_huge_pages)));
+        options.graph = graph.get();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const auto elapsed = [&start]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    // With --active_tol, the work of each iteration is always logged.
+    if (verbose > 0 || active_tol > 0) {
+        options.on_iteration = [&](const zuckerli::PageRankStats& stats) {
+            fprintf(stderr, "Iteration %zu: L1 residual %.3e, Linf residual %.3e, %.3f s",
+                    stats.iterations, stats.residual, stats.max_residual, elapsed());
+            if (active_tol > 0) {
+                fprintf(stderr, ", %zu ranks updated, %zu edges decoded",
+                        stats.updated_rows, stats.decoded_edges);
+            }
+            fputs("\n", stderr);
+        };
+    }
+    if (!seeds_path.empty()) {
+        std::vector<std::vector<uint32_t>> seeds;
+        if (!read_seed_sets(seeds_path, nnodes, seeds)) return EXIT_FAILURE;
+        topk = std::min<int>(topk, nnodes);
+        std::vector<double> ranks;
+        for (size_t first = 0; first < seeds.size(); first += batch) {
+            std::vector<std::vector<uint32_t>> batch_seeds(
+                    seeds.begin() + first, seeds.begin() + std::min<size_t>(first + batch, seeds.size()));
+            const size_t k = batch_seeds.size();
+            zuckerli::PageRankStats stats;
+            if (!zuckerli::PersonalizedPageRank(&engine, outdeg, batch_seeds, options, &ranks, &stats)) {
+                fprintf(stderr, "Invalid graph\n");
+                return EXIT_FAILURE;
+            }
+            if (verbose > 0) {
+                fprintf(stderr, "Seed sets %zu-%zu: %zu iterations, L1 residual %.3e, %.3f s\n",
+                        first, first + k - 1, stats.iterations, stats.residual, elapsed());
+            }
+            // report topk nodes id's of each seed set on stdout
+            for (size_t j = 0; j < k; j++) {
+                fprintf(stdout, "Top %zu:", first + j);
+                for (uint64_t node : zuckerli::TopK(ranks.data() + j, nnodes, topk, pool, k)) {
+                    fprintf(stdout, " %" PRIu64, node);
+                }
+                fprintf(stdout, "\n");
+            }
         }
+        fprintf(stderr, "Computed %zu personalized PageRank vectors in %.3f s\n", seeds.size(), elapsed());
+        return EXIT_SUCCESS;
     }
-}
\ No newline at end of file
+    // the top ranks are selected by the pass that writes them out
+    std::vector<uint64_t> top;
+    options.top = &top;
+    options.top_k = std::min<int>(topk, nnodes);
+    zuckerli::PageRankStats stats;
+    if (!zuckerli::PageRank(&engine, outdeg, options, precision, &outvec, &stats)) {
+        fprintf(stderr, "Invalid graph\n");
+        return EXIT_FAILURE;
+    }
+    if (stats.converged) {
+        fprintf(stderr, "Reached tolerance %g after %zu iterations in %.3f s (L1 residual %.3e, Linf residual %.3e)\n",
+                tol, stats.iterations, elapsed(), stats.residual, stats.max_residual);
+    } else {
+        fprintf(stderr, "Ran %zu iterations in %.3f s (L1 residual %.3e, Linf residual %.3e)\n",
+                stats.iterations, elapsed(), stats.residual, stats.max_residual);
+    }
+    if (absl::GetFlag(FLAGS_compare_double) && precision != zuckerli::Precision::kDouble) {
+        std::vector<double> baseline;
+        options.on_iteration = nullptr;
+        options.top = nullptr;
+        if (!zuckerli::PageRank(&engine, outdeg, options, zuckerli::Precision::kDouble, &baseline)) {
+            fprintf(stderr, "Invalid graph\n");
+            return EXIT_FAILURE;
+        }
+        report_precision_error(outvec, baseline, topk, pool);
+    }
+
+//    for(auto const &e : outvec) std::cout << e << std::endl;
+
+    if(verbose>0) {
+        double sum = 0.0;
+        for(int i=0;i<nnodes;i++) sum += outvec[i];
+        fprintf(stderr, "Sum of ranks: %f (should be 1)\n",sum);
+    }
+
+    // report topk nodes sorted by decreasing rank
+    if (verbose>0) {
+        fprintf(stderr, "Top %zu ranks:\n", top.size());
+        for (uint64_t node : top) fprintf(stderr, "  %" PRIu64 " %lf\n", node, outvec[node]);
+    }
+    // report topk nodes id's only on stdout
+    fprintf(stdout,"Top:");
+    for (uint64_t node : top) fprintf(stdout, " %" PRIu64, node);
+    fprintf(stdout,"\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#ifndef ZUCKERLI_REFERENCE_WINDOW_H
+#define ZUCKERLI_REFERENCE_WINDOW_H
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+namespace zuckerli {
+
+// Adjacency lists of the last `num_lists` nodes, which can be used as
+// references by the list being decoded. Lists are stored back to back in a
+// single buffer; when the new list does not fit at the end of it, the lists
+// still in the window are moved to its beginning (growing the buffer to twice
+// their total size if needed), so that each edge is moved O(1) times on
+// average and the buffer is only reallocated when the window gets larger.
+// Slots are indexed by the node id modulo a power of two.
+class ReferenceWindow {
+ public:
+  explicit ReferenceWindow(size_t num_lists)
+      : num_lists_(num_lists),
+        slot_mask_((size_t{1} << (FloorLog2Nonzero(num_lists) + 1)) - 1),
+        slots_(slot_mask_ + 1) {}
+
+  // Forgets all the lists.
+  void Reset() {
+    std::fill(slots_.begin(), slots_.end(), Slot());
+    end_ = 0;
+  }
+
+  // Adds an empty list of `degree` edges for `node`, which must follow the
+  // node of the previous call, and returns where to write its edges. Lists of
+  // the previous num_lists - 1 nodes stay valid, but pointers to them must be
+  // obtained again.
+  ZKR_INLINE uint32_t *AddList(size_t node, size_t degree) {
+    if (end_ + degree > capacity_) MakeRoom(node, degree);
+    Slot &slot = slots_[node & slot_mask_];
+    slot.begin = end_;
+    slot.size = degree;
+    end_ += degree;
+    return buffer_.get() + slot.begin;
+  }
+
+  ZKR_INLINE const uint32_t *List(size_t node) const {
+    return buffer_.get() + slots_[node & slot_mask_].begin;
+  }
+  ZKR_INLINE size_t Size(size_t node) const {
+    return slots_[node & slot_mask_].size;
+  }
+
+ private:
+  struct Slot {
+    size_t begin = 0;
+    size_t size = 0;
+  };
+
+  void MakeRoom(size_t node, size_t degree) {
+    // The lists of [node - num_lists + 1, node) are contiguous and end at
+    // end_. Slots of older nodes, or of nodes before the last Reset(), were
+    // not written since and start at or before the first one of them.
+    size_t live_begin = slots_[(node - num_lists_ + 1) & slot_mask_].begin;
+    size_t live_size = end_ - live_begin;
+    size_t needed = 2 * (live_size + degree);
+    if (needed > capacity_) {
+      std::unique_ptr<uint32_t[]> buffer(new uint32_t[needed]);
+      memcpy(buffer.get(), buffer_.get() + live_begin,
+             live_size * sizeof(uint32_t));
+      buffer_ = std::move(buffer);
+      capacity_ = needed;
+    } else {
+      memmove(buffer_.get(), buffer_.get() + live_begin,
+              live_size * sizeof(uint32_t));
+    }
+    for (Slot &slot : slots_) {
+      slot.begin = slot.begin >= live_begin ? slot.begin - live_begin : 0;
+    }
+    end_ = live_size;
+  }
+
+  size_t num_lists_;
+  size_t slot_mask_;
+  std::vector<Slot> slots_;
+  std::unique_ptr<uint32_t[]> buffer_;
+  size_t capacity_ = 0;
+  size_t end_ = 0;
+};
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_REFERENCE_WINDOW_H
@@ -0,0 +1,49 @@
+#include "reference_window.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+namespace zuckerli {
+namespace {
+
+// Compares the window with a copy of all the lists, with degrees that
+// sometimes grow far past the current buffer size.
+void CheckWindow(size_t num_lists, size_t first_node, size_t num_nodes,
+                 ReferenceWindow *window) {
+  std::mt19937 rng(num_lists);
+  std::uniform_int_distribution<size_t> small_degree(0, 20);
+  std::uniform_int_distribution<size_t> large_degree(0, 2000);
+  std::uniform_int_distribution<size_t> kind(0, 99);
+  std::vector<std::vector<uint32_t>> lists(num_nodes);
+  for (size_t i = 0; i < num_nodes; i++) {
+    size_t node = first_node + i;
+    size_t degree = kind(rng) < 5 ? large_degree(rng) : small_degree(rng);
+    uint32_t *list = window->AddList(node, degree);
+    for (size_t j = 0; j < degree; j++) {
+      lists[i].push_back(rng());
+      list[j] = lists[i].back();
+    }
+    for (size_t k = 0; k < num_lists && k <= i; k++) {
+      ASSERT_EQ(window->Size(node - k), lists[i - k].size());
+      const uint32_t *ref = window->List(node - k);
+      for (size_t j = 0; j < lists[i - k].size(); j++) {
+        ASSERT_EQ(ref[j], lists[i - k][j]) << node << " " << k;
+      }
+    }
+  }
+}
+
+TEST(ReferenceWindowTest, TestLists) {
+  for (size_t num_lists : {1, 2, 3, 32, 33, 64}) {
+    ReferenceWindow window(num_lists);
+    CheckWindow(num_lists, 0, 1000, &window);
+    // A new range of nodes after a reset.
+    window.Reset();
+    CheckWindow(num_lists, 12345, 1000, &window);
+  }
+}
+
+}  // namespace
+}  // namespace zuckerli
@@ -11,14 +11,102 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <stdio.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
+#include "compressed_graph.h"
 #include "decode.h"
 #include "encode.h"
 #include "gtest/gtest.h"
+#include "multiply.h"
+#include "outdeg.h"
+#include "pagerank.h"
+#include "thread_pool.h"
 #include "uncompressed_graph.h"
 
 namespace zuckerli {
 namespace {
 
+// Writes a random graph with web-like locality (lists that are similar to
+// the previous ones, neighbours close to the node) to a temporary file, and
+// returns its path.
+std::string WriteRandomGraph(const std::string &name, size_t num_nodes) {
+  std::mt19937 rng;
+  std::vector<std::vector<uint32_t>> adj(num_nodes);
+  for (size_t i = 0; i < num_nodes; i++) {
+    if (i > 0 && rng() % 4 != 0) {
+      for (uint32_t x : adj[i - 1 - rng() % std::min<size_t>(i, 8)]) {
+        if (rng() % 8 != 0) adj[i].push_back(x);
+      }
+    }
+    size_t degree = rng() % 16;
+    for (size_t j = 0; j < degree; j++) {
+      adj[i].push_back(rng() % 2 ? (i + rng() % 64) % num_nodes
+                                 : rng() % num_nodes);
+    }
+    std::sort(adj[i].begin(), adj[i].end());
+    adj[i].erase(std::unique(adj[i].begin(), adj[i].end()), adj[i].end());
+  }
+  std::string path = testing::TempDir() + "/" + name;
+  FILE *f = fopen(path.c_str(), "wb");
+  ZKR_ASSERT(f);
+  uint64_t fingerprint = UncompressedGraph::kFingerprint;
+  uint32_t n = num_nodes;
+  uint64_t start = 0;
+  fwrite(&fingerprint, sizeof(fingerprint), 1, f);
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(&start, sizeof(start), 1, f);
+  for (const auto &list : adj) {
+    start += list.size();
+    fwrite(&start, sizeof(start), 1, f);
+  }
+  for (const auto &list : adj) {
+    fwrite(list.data(), sizeof(uint32_t), list.size(), f);
+  }
+  fclose(f);
+  return path;
+}
+
+std::string WriteCompressed(const std::string &name,
+                            const std::vector<uint8_t> &compressed) {
+  std::string path = testing::TempDir() + "/" + name;
+  FILE *f = fopen(path.c_str(), "wb");
+  ZKR_ASSERT(f);
+  fwrite(compressed.data(), 1, compressed.size(), f);
+  fclose(f);
+  return path;
+}
+
+// Checks that random access to the compressed graph at `path` returns the
+// lists of `g`, through each of the ways to read them.
+void CheckCompressedGraph(const UncompressedGraph &g, const std::string &path) {
+  CompressedGraph cg(path);
+  ASSERT_EQ(cg.size(), g.size());
+  std::vector<uint32_t> into = {1, 2, 3};
+  CompressedGraph::Scratch scratch;
+  for (size_t i = 0; i < g.size(); i++) {
+    EXPECT_EQ(cg.Degree(i), g.Degree(i));
+    std::vector<uint32_t> expected(g.Neighbours(i).begin(),
+                                   g.Neighbours(i).end());
+    EXPECT_EQ(cg.Neighbours(i), expected);
+    EXPECT_EQ(cg.NeighboursInto(i, &into), expected.size());
+    EXPECT_EQ(into, expected);
+    // The reference lists are decoded too.
+    size_t decoded_edges = 0;
+    cg.NeighboursInto(i, &into, &decoded_edges);
+    EXPECT_GE(decoded_edges, expected.size());
+    NeighbourCursor cursor(&cg, i, &scratch);
+    EXPECT_EQ(cursor.degree(), expected.size());
+    EXPECT_EQ(std::vector<uint32_t>(cursor.begin(), cursor.end()), expected);
+  }
+}
+
 TEST(RoundtripTest, TestSmallGraphSequential) {
   UncompressedGraph g(
                       TESTDATA "/small");
@@ -40,5 +128,791 @@ TEST(RoundtripTest, TestSmallGraphRandomAccess) {
   EXPECT_EQ(checksum, decoder_checksum);
 }
 
+TEST(RoundtripTest, TestMultithreadedReferenceSelection) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("multithreaded", 5000));
+  absl::SetFlag(&FLAGS_num_rounds, 2);
+  for (bool allow_random_access : {false, true}) {
+    absl::SetFlag(&FLAGS_num_threads, 1);
+    std::vector<uint8_t> serial = EncodeGraph(g, allow_random_access);
+    for (int32_t num_threads : {2, 3, 8}) {
+      absl::SetFlag(&FLAGS_num_threads, num_threads);
+      EXPECT_EQ(serial, EncodeGraph(g, allow_random_access));
+    }
+    EXPECT_TRUE(DecodeGraph(serial));
+  }
+}
+
+TEST(RoundtripTest, TestSegmented) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("segmented", 5000));
+  absl::SetFlag(&FLAGS_num_segments, 5);
+  for (bool allow_random_access : {false, true}) {
+    size_t checksum = 0, decoder_checksum = 0;
+    std::vector<uint8_t> compressed =
+        EncodeGraph(g, allow_random_access, &checksum);
+    std::vector<size_t> node_start_indices;
+    EXPECT_TRUE(
+        DecodeGraph(compressed, &decoder_checksum, &node_start_indices));
+    EXPECT_EQ(checksum, decoder_checksum);
+    std::vector<size_t> parallel_node_start_indices;
+    ThreadPool pool(3);
+    EXPECT_TRUE(DecodeGraph(compressed, &decoder_checksum,
+                            &parallel_node_start_indices, &pool));
+    EXPECT_EQ(checksum, decoder_checksum);
+    EXPECT_EQ(node_start_indices, parallel_node_start_indices);
+    // The same tables, for several decodes and kernels.
+    GraphDecoder decoder;
+    ASSERT_TRUE(decoder.Init(compressed, &pool));
+    for (size_t repeat = 0; repeat < 2; repeat++) {
+      std::vector<size_t> reused_node_start_indices;
+      EXPECT_TRUE(DecodeGraph(&decoder, &decoder_checksum,
+                              &reused_node_start_indices, &pool));
+      EXPECT_EQ(checksum, decoder_checksum);
+      EXPECT_EQ(node_start_indices, reused_node_start_indices);
+    }
+    std::vector<uint32_t> outdeg, reused_outdeg;
+    ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+    ASSERT_TRUE(ComputeOutDeg(&decoder, reused_outdeg, &pool));
+    EXPECT_EQ(outdeg, reused_outdeg);
+    if (!allow_random_access) continue;
+
+    CheckCompressedGraph(g, WriteCompressed("segmented.zkr", compressed));
+  }
+}
+
+TEST(RoundtripTest, TestNodeIndex) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("node_index", 5000));
+  for (int32_t num_segments : {1, 4}) {
+    absl::SetFlag(&FLAGS_num_segments, num_segments);
+    for (bool node_index : {false, true}) {
+      absl::SetFlag(&FLAGS_node_index, node_index);
+      size_t checksum = 0, decoder_checksum = 0;
+      std::vector<uint8_t> compressed =
+          EncodeGraph(g, /*allow_random_access=*/true, &checksum);
+      std::vector<size_t> node_start_indices;
+      EXPECT_TRUE(
+          DecodeGraph(compressed, &decoder_checksum, &node_start_indices));
+      EXPECT_EQ(checksum, decoder_checksum);
+      GraphHeader header;
+      ASSERT_TRUE(
+          ReadGraphHeader(compressed.data(), compressed.size(), &header));
+      const GraphSection *section = FindSection(header, kNodeIndexSection);
+      ASSERT_EQ(section != nullptr, node_index);
+      if (node_index) {
+        NodeIndex index;
+        ASSERT_TRUE(index.Init(compressed.data() + section->byte_offset,
+                               section->size, g.size()));
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_EQ(index[i], node_start_indices[i]);
+        }
+      }
+      CheckCompressedGraph(g, WriteCompressed("node_index.zkr", compressed));
+    }
+  }
+}
+
+TEST(RoundtripTest, TestDegreeIndex) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("degree_index", 5000));
+  absl::SetFlag(&FLAGS_degree_index, true);
+  for (int32_t num_segments : {1, 4}) {
+    absl::SetFlag(&FLAGS_num_segments, num_segments);
+    // Without a node index, CompressedGraph builds it and still uses the
+    // degree index.
+    for (bool node_index : {false, true}) {
+      absl::SetFlag(&FLAGS_node_index, node_index);
+      size_t checksum = 0, decoder_checksum = 0;
+      std::vector<uint8_t> compressed =
+          EncodeGraph(g, /*allow_random_access=*/true, &checksum);
+      EXPECT_TRUE(DecodeGraph(compressed, &decoder_checksum));
+      EXPECT_EQ(checksum, decoder_checksum);
+      GraphHeader header;
+      ASSERT_TRUE(
+          ReadGraphHeader(compressed.data(), compressed.size(), &header));
+      const GraphSection *section = FindSection(header, kDegreeIndexSection);
+      ASSERT_NE(section, nullptr);
+      NodeIndex degrees;
+      ASSERT_TRUE(degrees.Init(compressed.data() + section->byte_offset,
+                               section->size, g.size() + 1));
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_EQ(degrees[i + 1] - degrees[i], g.Degree(i));
+      }
+      ASSERT_NE(FindSection(header, kReferenceOffsetSection), nullptr);
+      CheckCompressedGraph(g, WriteCompressed("degree_index.zkr", compressed));
+    }
+  }
+  // Sequential files have no degree index.
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  GraphHeader header;
+  ASSERT_TRUE(ReadGraphHeader(compressed.data(), compressed.size(), &header));
+  EXPECT_EQ(FindSection(header, kDegreeIndexSection), nullptr);
+}
+
+TEST(RoundtripTest, TestAdjacencyCache) {
+  UncompressedGraph g(WriteRandomGraph("adjacency_cache", 5000));
+  std::string path = WriteCompressed(
+      "adjacency_cache.zkr", EncodeGraph(g, /*allow_random_access=*/true));
+  CompressedGraph cg(path);
+  EXPECT_EQ(cg.CacheStats().misses, 0);
+  // Room for about a tenth of the lists.
+  cg.EnableCache(100000, /*num_shards=*/4);
+  // Copies share the cache.
+  CompressedGraph copy = cg;
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < g.size(); i++) {
+      std::vector<uint32_t> expected(g.Neighbours(i).begin(),
+                                     g.Neighbours(i).end());
+      EXPECT_EQ(copy.Neighbours(i), expected);
+      // The list was just decoded, or it had no edges.
+      EXPECT_EQ(copy.Neighbours(i), expected);
+      std::vector<uint32_t> into;
+      size_t decoded_edges = 1;
+      copy.NeighboursInto(i, &into, &decoded_edges);
+      EXPECT_EQ(into, expected);
+      EXPECT_EQ(decoded_edges, 0);
+    }
+  }
+  AdjacencyCacheStats stats = cg.CacheStats();
+  EXPECT_GE(stats.hits, g.size());
+  EXPECT_GT(stats.misses, 0);
+  EXPECT_GT(stats.evictions, 0);
+  EXPECT_LE(stats.bytes, 100000);
+}
+
+TEST(RoundtripTest, TestNeighbourCursor) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("neighbour_cursor", 5000));
+  for (bool degree_index : {false, true}) {
+    absl::SetFlag(&FLAGS_degree_index, degree_index);
+    CompressedGraph cg(
+        WriteCompressed("neighbour_cursor.zkr",
+                        EncodeGraph(g, /*allow_random_access=*/true)));
+    for (bool cache : {false, true}) {
+      if (cache) cg.EnableCache(1 << 20);
+      for (size_t i = 0; i < g.size(); i++) {
+        // Stop after a few neighbours, and meanwhile decode the lists of the
+        // neighbours with cursors that have their own scratch.
+        NeighbourCursor cursor(&cg, i);
+        CompressedGraph::Scratch scratch;
+        uint32_t neighbour;
+        for (size_t j = 0; j < 3 && j < g.Degree(i); j++) {
+          ASSERT_TRUE(cursor.Next(&neighbour));
+          EXPECT_EQ(neighbour, g.Neighbours(i)[j]);
+          NeighbourCursor inner(&cg, neighbour, &scratch);
+          EXPECT_EQ(std::vector<uint32_t>(inner.begin(), inner.end()),
+                    std::vector<uint32_t>(g.Neighbours(neighbour).begin(),
+                                          g.Neighbours(neighbour).end()));
+        }
+        if (g.Degree(i) <= 3) {
+          EXPECT_FALSE(cursor.Next(&neighbour));
+        }
+      }
+    }
+  }
+}
+
+TEST(RoundtripTest, TestColumnCounts) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("column_counts", 5000));
+  std::vector<uint32_t> expected_outdeg(g.size());
+  for (size_t i = 0; i < g.size(); i++) {
+    for (uint32_t x : g.Neighbours(i)) expected_outdeg[x]++;
+  }
+  ThreadPool pool(2);
+  absl::SetFlag(&FLAGS_node_index, true);
+  for (bool allow_random_access : {false, true}) {
+    for (bool column_counts : {false, true}) {
+      absl::SetFlag(&FLAGS_column_counts, column_counts);
+      size_t checksum = 0, decoder_checksum = 0;
+      std::vector<uint8_t> compressed =
+          EncodeGraph(g, allow_random_access, &checksum);
+      EXPECT_TRUE(DecodeGraph(compressed, &decoder_checksum));
+      EXPECT_EQ(checksum, decoder_checksum);
+      GraphHeader header;
+      ASSERT_TRUE(
+          ReadGraphHeader(compressed.data(), compressed.size(), &header));
+      ASSERT_EQ(FindSection(header, kColumnCountSection) != nullptr,
+                column_counts);
+      // The node index is stored as well.
+      ASSERT_EQ(FindSection(header, kNodeIndexSection) != nullptr,
+                allow_random_access);
+      std::vector<uint32_t> outdeg;
+      bool from_section;
+      ASSERT_TRUE(ReadOrComputeOutDeg(compressed, outdeg, &pool,
+                                      &from_section));
+      EXPECT_EQ(from_section, column_counts);
+      EXPECT_EQ(outdeg, expected_outdeg);
+      if (allow_random_access) {
+        CheckCompressedGraph(g, WriteCompressed("column_counts.zkr",
+                                                compressed));
+      }
+    }
+  }
+
+  // A column count is at most the number of rows.
+  std::vector<uint32_t> expected(200);
+  expected[1] = 127;
+  expected[2] = 128;
+  expected[3] = 200;
+  std::vector<uint8_t> data;
+  EncodeColumnCounts(expected, &data);
+  EXPECT_EQ(data.size(), 202);
+  std::vector<uint32_t> counts;
+  EXPECT_TRUE(DecodeColumnCounts(data.data(), data.size(), 200, counts));
+  EXPECT_EQ(counts, expected);
+  // Missing, trailing and out-of-range counts.
+  EXPECT_FALSE(DecodeColumnCounts(data.data(), data.size(), 201, counts));
+  EXPECT_FALSE(DecodeColumnCounts(data.data(), data.size() - 1, 200, counts));
+  EXPECT_FALSE(DecodeColumnCounts(data.data(), data.size(), 199, counts));
+  expected[3] = 201;
+  data.clear();
+  EncodeColumnCounts(expected, &data);
+  EXPECT_FALSE(DecodeColumnCounts(data.data(), data.size(), 200, counts));
+}
+
+TEST(RoundtripTest, TestInterleavedANS) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("interleaved", 5000));
+  for (int32_t num_segments : {1, 3}) {
+    absl::SetFlag(&FLAGS_num_segments, num_segments);
+    for (int32_t ans_states : {4, 8}) {
+      absl::SetFlag(&FLAGS_ans_states, ans_states);
+      size_t checksum = 0, decoder_checksum = 0;
+      std::vector<uint8_t> compressed =
+          EncodeGraph(g, /*allow_random_access=*/false, &checksum);
+      GraphHeader header;
+      ASSERT_TRUE(
+          ReadGraphHeader(compressed.data(), compressed.size(), &header));
+      EXPECT_EQ(header.num_ans_states, ans_states);
+      EXPECT_TRUE(DecodeGraph(compressed, &decoder_checksum));
+      EXPECT_EQ(checksum, decoder_checksum);
+    }
+  }
+}
+
+TEST(RoundtripTest, TestDecodeVisitors) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("visitors", 5000));
+  std::vector<double> invec(g.size());
+  for (size_t i = 0; i < g.size(); i++) invec[i] = 1.0 / (i + 1);
+  std::vector<double> expected_outvec(g.size());
+  std::vector<uint32_t> expected_outdeg(g.size());
+  for (size_t i = 0; i < g.size(); i++) {
+    for (uint32_t x : g.Neighbours(i)) {
+      expected_outvec[i] += invec[x];
+      expected_outdeg[x]++;
+    }
+  }
+  for (int32_t num_segments : {1, 3}) {
+    absl::SetFlag(&FLAGS_num_segments, num_segments);
+    for (bool allow_random_access : {false, true}) {
+      std::vector<uint8_t> compressed = EncodeGraph(g, allow_random_access);
+
+      // One-shot decodes and repeated products on the same threads, the
+      // latter into a vector that is not cleared in between.
+      ThreadPool pool(2);
+      std::vector<uint64_t> offsets;
+      std::vector<uint32_t> neighbours;
+      ASSERT_TRUE(DecodeGraphToCSR(compressed, &offsets, &neighbours, &pool));
+      ASSERT_EQ(offsets.size(), g.size() + 1);
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_EQ(std::vector<uint32_t>(neighbours.begin() + offsets[i],
+                                        neighbours.begin() + offsets[i + 1]),
+                  std::vector<uint32_t>(g.Neighbours(i).begin(),
+                                        g.Neighbours(i).end()));
+      }
+
+      std::vector<double> outvec;
+      ASSERT_TRUE(
+          DecodeGraph(compressed, invec, outvec, nullptr, nullptr, &pool));
+      ASSERT_EQ(outvec.size(), g.size());
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_NEAR(outvec[i], expected_outvec[i], 1e-9);
+      }
+
+      SpMVEngine engine;
+      ASSERT_TRUE(engine.Init(compressed, &pool));
+      ASSERT_EQ(engine.num_nodes(), g.size());
+      std::vector<double> engine_outvec(g.size(), 1.0);
+      for (size_t iter = 0; iter < 2; iter++) {
+        ASSERT_TRUE(engine.Multiply(invec.data(), engine_outvec.data()));
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_NEAR(engine_outvec[i], expected_outvec[i], 1e-9);
+        }
+      }
+
+      // Prefetching does not change the order of the additions.
+      std::vector<double> no_prefetch_outvec(g.size());
+      ASSERT_TRUE(engine.set_prefetch_distance(0));
+      ASSERT_TRUE(engine.Multiply(invec.data(), no_prefetch_outvec.data()));
+      for (size_t distance : {size_t{1}, size_t{5}, kMaxPrefetchDistance}) {
+        ASSERT_TRUE(engine.set_prefetch_distance(distance));
+        ASSERT_TRUE(engine.Multiply(invec.data(), engine_outvec.data()));
+        EXPECT_EQ(engine_outvec, no_prefetch_outvec);
+      }
+      EXPECT_FALSE(engine.set_prefetch_distance(kMaxPrefetchDistance + 1));
+
+      std::vector<double> expected_transposed(g.size());
+      for (size_t i = 0; i < g.size(); i++) {
+        for (uint32_t x : g.Neighbours(i)) expected_transposed[x] += invec[i];
+      }
+      std::vector<double> transposed;
+      ASSERT_TRUE(MultiplyTransposed(compressed, invec, transposed));
+      ASSERT_EQ(transposed.size(), g.size());
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_NEAR(transposed[i], expected_transposed[i], 1e-9);
+      }
+      for (size_t iter = 0; iter < 2; iter++) {
+        ASSERT_TRUE(engine.MultiplyTransposed(invec.data(),
+                                              engine_outvec.data()));
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_NEAR(engine_outvec[i], expected_transposed[i], 1e-9);
+        }
+      }
+
+      std::vector<uint32_t> outdeg;
+      ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+      EXPECT_EQ(outdeg, expected_outdeg);
+      std::vector<uint32_t> pool_outdeg;
+      ASSERT_TRUE(ComputeOutDeg(compressed, pool_outdeg, &pool));
+      EXPECT_EQ(pool_outdeg, expected_outdeg);
+    }
+  }
+}
+
+TEST(RoundtripTest, TestColumnTiles) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("tiles", 5000));
+  std::vector<double> invec(g.size());
+  for (size_t i = 0; i < g.size(); i++) invec[i] = 1.0 / (i + 1);
+  std::vector<double> expected_outvec(g.size());
+  std::vector<uint32_t> expected_outdeg(g.size());
+  for (size_t i = 0; i < g.size(); i++) {
+    for (uint32_t x : g.Neighbours(i)) {
+      expected_outvec[i] += invec[x];
+      expected_outdeg[x]++;
+    }
+  }
+  absl::SetFlag(&FLAGS_column_tile_size, 1200);
+  for (int32_t num_segments : {1, 3}) {
+    absl::SetFlag(&FLAGS_num_segments, num_segments);
+    for (bool allow_random_access : {false, true}) {
+      size_t checksum = 0;
+      std::vector<uint8_t> compressed =
+          EncodeGraph(g, allow_random_access, &checksum);
+      GraphHeader header;
+      ASSERT_TRUE(
+          ReadGraphHeader(compressed.data(), compressed.size(), &header));
+      ASSERT_EQ(header.tiles.size(), 5);
+      EXPECT_EQ(header.tiles.back().first_column, 4800);
+      EXPECT_EQ(header.tiles.back().num_columns, 200);
+      EXPECT_EQ(header.segments.size(), 5 * num_segments);
+
+      ThreadPool pool(2);
+      size_t decoded_checksum = 0;
+      ASSERT_TRUE(DecodeGraph(compressed, &decoded_checksum, nullptr, &pool));
+      EXPECT_EQ(decoded_checksum, checksum);
+
+      std::vector<double> outvec;
+      ASSERT_TRUE(
+          DecodeGraph(compressed, invec, outvec, nullptr, nullptr, &pool));
+      ASSERT_EQ(outvec.size(), g.size());
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_NEAR(outvec[i], expected_outvec[i], 1e-9);
+      }
+
+      SpMVEngine engine;
+      ASSERT_TRUE(engine.Init(compressed, &pool));
+      EXPECT_EQ(engine.num_tiles(), 5);
+      std::vector<double> engine_outvec(g.size(), 1.0);
+      for (size_t iter = 0; iter < 2; iter++) {
+        ASSERT_TRUE(engine.Multiply(invec.data(), engine_outvec.data()));
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_NEAR(engine_outvec[i], expected_outvec[i], 1e-9);
+        }
+      }
+
+      // Products that scatter the edges do not depend on the order of the
+      // rows.
+      std::vector<uint32_t> outdeg;
+      ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+      EXPECT_EQ(outdeg, expected_outdeg);
+
+      std::vector<uint64_t> offsets;
+      std::vector<uint32_t> neighbours;
+      EXPECT_FALSE(DecodeGraphToCSR(compressed, &offsets, &neighbours));
+    }
+  }
+}
+
+TEST(RoundtripTest, TestMultiplyVectors) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("spmm", 3000));
+  absl::SetFlag(&FLAGS_num_segments, 3);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  ThreadPool pool(2);
+  SpMVEngine engine;
+  ASSERT_TRUE(engine.Init(compressed, &pool));
+  // Both compile-time and runtime numbers of vectors.
+  for (size_t k : {3, 8}) {
+    std::vector<double> invecs(g.size() * k);
+    for (size_t i = 0; i < invecs.size(); i++) invecs[i] = 1.0 / (i + 1);
+    std::vector<double> expected(g.size() * k);
+    for (size_t i = 0; i < g.size(); i++) {
+      for (uint32_t x : g.Neighbours(i)) {
+        for (size_t j = 0; j < k; j++) expected[i * k + j] += invecs[x * k + j];
+      }
+    }
+    std::vector<double> outvecs;
+    ASSERT_TRUE(MultiplyVectors(compressed, k, invecs, outvecs, &pool));
+    ASSERT_EQ(outvecs.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_NEAR(outvecs[i], expected[i], 1e-9);
+    }
+    std::vector<double> engine_outvecs(g.size() * k);
+    ASSERT_TRUE(engine.Multiply(invecs.data(), engine_outvecs.data(), k));
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_NEAR(engine_outvecs[i], expected[i], 1e-9);
+    }
+  }
+}
+
+// Power iteration on the uncompressed graph, as computed by PageRank.
+std::vector<double> ReferencePageRank(const UncompressedGraph &g,
+                                      const std::vector<uint32_t> &outdeg,
+                                      const PageRankOptions &options) {
+  size_t n = g.size();
+  std::vector<double> ranks(n, 1.0 / n), next(n);
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    double dangling = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (outdeg[i] == 0) dangling += ranks[i];
+    }
+    dangling /= n;
+    for (size_t i = 0; i < n; i++) {
+      double sum = 0;
+      for (uint32_t x : g.Neighbours(i)) sum += ranks[x] / outdeg[x];
+      next[i] = options.dampf * (sum + dangling) + (1 - options.dampf) / n;
+    }
+    ranks.swap(next);
+  }
+  return ranks;
+}
+
+TEST(RoundtripTest, TestPageRank) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("pagerank", 3000));
+  absl::SetFlag(&FLAGS_num_segments, 4);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  std::vector<uint32_t> outdeg;
+  ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+  PageRankOptions options;
+  options.max_iter = 20;
+  std::vector<double> expected = ReferencePageRank(g, outdeg, options);
+  std::vector<uint64_t> top;
+  options.top = &top;
+  options.top_k = 10;
+  for (size_t num_threads : {1, 3}) {
+    ThreadPool pool(num_threads);
+    SpMVEngine engine;
+    ASSERT_TRUE(engine.Init(compressed, &pool));
+    for (bool fused : {false, true}) {
+      options.fused = fused;
+      for (Precision precision :
+           {Precision::kDouble, Precision::kFloat, Precision::kMixed}) {
+        std::vector<double> ranks;
+        PageRankStats stats;
+        ASSERT_TRUE(
+            PageRank(&engine, outdeg, options, precision, &ranks, &stats));
+        ASSERT_EQ(ranks.size(), g.size());
+        EXPECT_EQ(stats.iterations, options.max_iter);
+        // The residual after 20 iterations is about dampf^20 times the
+        // first one, i.e. at most 2 * 0.9^20.
+        EXPECT_GT(stats.residual, 0);
+        EXPECT_LT(stats.residual, 0.25);
+        // Ranks are about 1 / 3000; float keeps about 7 digits of them.
+        double tolerance = precision == Precision::kDouble ? 1e-12 : 1e-8;
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_NEAR(ranks[i], expected[i], tolerance) << i;
+        }
+        EXPECT_EQ(top, TopK(ranks.data(), ranks.size(), 10, &pool));
+      }
+    }
+  }
+}
+
+TEST(RoundtripTest, TestPageRankTolerance) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("pagerank_tol", 3000));
+  absl::SetFlag(&FLAGS_num_segments, 4);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  std::vector<uint32_t> outdeg;
+  ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+  ThreadPool pool(2);
+  SpMVEngine engine;
+  ASSERT_TRUE(engine.Init(compressed, &pool));
+  for (bool fused : {false, true}) {
+    PageRankOptions options;
+    options.max_iter = 1000;
+    options.tol = 1e-9;
+    options.fused = fused;
+    std::vector<PageRankStats> iterations;
+    options.on_iteration = [&](const PageRankStats &stats) {
+      iterations.push_back(stats);
+    };
+    std::vector<double> ranks;
+    PageRankStats stats;
+    ASSERT_TRUE(PageRank(&engine, outdeg, options, &ranks, &stats));
+    EXPECT_TRUE(stats.converged);
+    EXPECT_LT(stats.iterations, options.max_iter);
+    EXPECT_LT(stats.residual, options.tol);
+    EXPECT_LE(stats.max_residual, stats.residual);
+    ASSERT_EQ(iterations.size(), stats.iterations);
+    for (size_t i = 0; i < iterations.size(); i++) {
+      EXPECT_EQ(iterations[i].iterations, i + 1);
+      EXPECT_EQ(iterations[i].converged, i + 1 == iterations.size());
+    }
+
+    options.max_iter = stats.iterations;
+    std::vector<double> expected = ReferencePageRank(g, outdeg, options);
+    for (size_t i = 0; i < g.size(); i++) {
+      EXPECT_NEAR(ranks[i], expected[i], 1e-12) << i;
+    }
+  }
+}
+
+// Gauss-Seidel iteration on the uncompressed graph, as computed by PageRank
+// with PageRankMethod::kGaussSeidel.
+std::vector<double> ReferenceGaussSeidel(const UncompressedGraph &g,
+                                         const std::vector<uint32_t> &outdeg,
+                                         const PageRankOptions &options) {
+  size_t n = g.size();
+  std::vector<double> ranks(n, 1.0 / n);
+  double dangling = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (outdeg[i] == 0) dangling += ranks[i];
+  }
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    for (size_t i = 0; i < n; i++) {
+      double sum = 0;
+      for (uint32_t x : g.Neighbours(i)) sum += ranks[x] / outdeg[x];
+      double rank =
+          options.dampf * (sum + dangling / n) + (1 - options.dampf) / n;
+      if (outdeg[i] == 0) dangling += rank - ranks[i];
+      ranks[i] = rank;
+    }
+  }
+  return ranks;
+}
+
+TEST(RoundtripTest, TestPageRankInPlace) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("pagerank_in_place", 3000));
+  absl::SetFlag(&FLAGS_num_segments, 4);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  std::vector<uint32_t> outdeg;
+  ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+  PageRankOptions options;
+  options.max_iter = 10;
+  options.method = PageRankMethod::kGaussSeidel;
+  std::vector<double> expected = ReferenceGaussSeidel(g, outdeg, options);
+  std::vector<uint64_t> top;
+  options.top = &top;
+  options.top_k = 10;
+  for (size_t num_threads : {1, 3}) {
+    ThreadPool pool(num_threads);
+    SpMVEngine engine;
+    ASSERT_TRUE(engine.Init(compressed, &pool));
+    std::vector<double> ranks;
+    ASSERT_TRUE(PageRank(&engine, outdeg, options, &ranks));
+    for (size_t i = 0; i < g.size(); i++) {
+      EXPECT_NEAR(ranks[i], expected[i], 1e-12) << i;
+    }
+    EXPECT_EQ(top, TopK(ranks.data(), ranks.size(), 10, &pool));
+  }
+  options.top = nullptr;
+
+  // All methods reach the same ranks.
+  ThreadPool pool(3);
+  SpMVEngine engine;
+  ASSERT_TRUE(engine.Init(compressed, &pool));
+  options.max_iter = 1000;
+  options.tol = 1e-12;
+  options.method = PageRankMethod::kJacobi;
+  std::vector<double> jacobi_ranks;
+  PageRankStats jacobi_stats;
+  ASSERT_TRUE(PageRank(&engine, outdeg, options, &jacobi_ranks, &jacobi_stats));
+  ASSERT_TRUE(jacobi_stats.converged);
+  for (PageRankMethod method :
+       {PageRankMethod::kGaussSeidel, PageRankMethod::kAsync}) {
+    options.method = method;
+    std::vector<double> ranks;
+    PageRankStats stats;
+    ASSERT_TRUE(PageRank(&engine, outdeg, options, &ranks, &stats));
+    EXPECT_TRUE(stats.converged);
+    for (size_t i = 0; i < g.size(); i++) {
+      EXPECT_NEAR(ranks[i], jacobi_ranks[i], 1e-11) << i;
+    }
+  }
+}
+
+TEST(RoundtripTest, TestPageRankActiveRows) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("pagerank_active", 3000));
+  size_t num_edges = 0;
+  for (size_t i = 0; i < g.size(); i++) num_edges += g.Degree(i);
+  absl::SetFlag(&FLAGS_num_segments, 4);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/true);
+  CompressedGraph cg(WriteCompressed("pagerank_active.zkr", compressed));
+  std::vector<uint32_t> outdeg;
+  ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+  ThreadPool pool(3);
+  SpMVEngine engine;
+  ASSERT_TRUE(engine.Init(compressed, &pool));
+  ASSERT_TRUE(engine.allow_random_access());
+
+  PageRankOptions options;
+  options.max_iter = 1000;
+  options.tol = 1e-12;
+  std::vector<double> expected;
+  ASSERT_TRUE(PageRank(&engine, outdeg, options, &expected));
+  options.active_tol = 1e-9;
+  EXPECT_FALSE(PageRank(&engine, outdeg, options, &expected));
+
+  // Row j of the transpose lists the rows that contain j.
+  TransposedMatrix transposed;
+  const size_t bytes = TransposedMatrix::Bytes(g.size(), num_edges);
+  EXPECT_FALSE(TransposeMatrix(&engine, outdeg, bytes - 1, &transposed));
+  ASSERT_TRUE(TransposeMatrix(&engine, outdeg, bytes, &transposed));
+  std::vector<std::vector<uint32_t>> expected_transposed(g.size());
+  for (size_t i = 0; i < g.size(); i++) {
+    for (uint32_t j : g.Neighbours(i)) expected_transposed[j].push_back(i);
+  }
+  for (size_t j = 0; j < g.size(); j++) {
+    std::vector<uint32_t> rows(
+        transposed.rows.begin() + transposed.offsets[j],
+        transposed.rows.begin() + transposed.offsets[j + 1]);
+    std::sort(rows.begin(), rows.end());
+    EXPECT_EQ(rows, expected_transposed[j]) << j;
+  }
+  // Active rows need the transpose.
+  options.method = PageRankMethod::kGaussSeidel;
+  EXPECT_FALSE(PageRank(&engine, outdeg, options, &expected));
+  options.transposed = &transposed;
+
+  for (PageRankMethod method :
+       {PageRankMethod::kGaussSeidel, PageRankMethod::kAsync}) {
+    // Without seeking, and seeking whenever not all rows are recomputed.
+    for (bool seek : {false, true}) {
+      options.method = method;
+      options.graph = seek ? &cg : nullptr;
+      options.seek_fraction = 1;
+      size_t partial_iterations = 0;
+      options.on_iteration = [&](const PageRankStats &stats) {
+        EXPECT_LE(stats.updated_rows, g.size());
+        if (stats.updated_rows < g.size()) {
+          partial_iterations++;
+          EXPECT_FALSE(stats.converged);
+          // Segments with an active row are decoded whole; rows decoded one
+          // by one also decode their reference lists.
+          if (!seek) {
+            EXPECT_LE(stats.decoded_edges, num_edges);
+          }
+        } else {
+          EXPECT_EQ(stats.decoded_edges, num_edges);
+        }
+      };
+      std::vector<double> ranks;
+      PageRankStats stats;
+      ASSERT_TRUE(PageRank(&engine, outdeg, options, &ranks, &stats));
+      EXPECT_TRUE(stats.converged);
+      EXPECT_EQ(stats.updated_rows, g.size());
+      EXPECT_GT(partial_iterations, 0);
+      for (size_t i = 0; i < g.size(); i++) {
+        EXPECT_NEAR(ranks[i], expected[i], 1e-11) << i;
+      }
+    }
+  }
+}
+
+// Personalized PageRank of one seed set on the uncompressed graph, as
+// computed by PersonalizedPageRank.
+std::vector<double> ReferencePersonalizedPageRank(
+    const UncompressedGraph &g, const std::vector<uint32_t> &outdeg,
+    const std::vector<uint32_t> &seeds, const PageRankOptions &options) {
+  size_t n = g.size();
+  std::vector<double> teleport(n), next(n);
+  for (uint32_t seed : seeds) teleport[seed] += 1.0 / seeds.size();
+  std::vector<double> ranks = teleport;
+  for (size_t iter = 0; iter < options.max_iter; iter++) {
+    double dangling = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (outdeg[i] == 0) dangling += ranks[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+      double sum = 0;
+      for (uint32_t x : g.Neighbours(i)) sum += ranks[x] / outdeg[x];
+      next[i] = options.dampf * sum +
+                (options.dampf * dangling + 1 - options.dampf) * teleport[i];
+    }
+    ranks.swap(next);
+  }
+  return ranks;
+}
+
+TEST(RoundtripTest, TestPersonalizedPageRank) {
+  absl::FlagSaver flag_saver;
+  UncompressedGraph g(WriteRandomGraph("ppr", 3000));
+  absl::SetFlag(&FLAGS_num_segments, 4);
+  std::vector<uint8_t> compressed =
+      EncodeGraph(g, /*allow_random_access=*/false);
+  std::vector<uint32_t> outdeg;
+  ASSERT_TRUE(ComputeOutDeg(compressed, outdeg));
+  std::vector<std::vector<uint32_t>> seeds = {
+      {0}, {5, 17, 2999}, {42, 42, 7}, {1000, 2000}, {3}};
+  PageRankOptions options;
+  options.max_iter = 20;
+  for (size_t num_threads : {1, 3}) {
+    ThreadPool pool(num_threads);
+    SpMVEngine engine;
+    ASSERT_TRUE(engine.Init(compressed, &pool));
+    // Batches of 1, 3 (any k) and 4 (specialized k) seed sets.
+    for (size_t k : {1, 3, 4}) {
+      std::vector<std::vector<uint32_t>> batch(seeds.begin(),
+                                               seeds.begin() + k);
+      std::vector<double> ranks;
+      PageRankStats stats;
+      ASSERT_TRUE(
+          PersonalizedPageRank(&engine, outdeg, batch, options, &ranks, &stats));
+      ASSERT_EQ(ranks.size(), g.size() * k);
+      EXPECT_EQ(stats.iterations, options.max_iter);
+      for (size_t j = 0; j < k; j++) {
+        std::vector<double> expected =
+            ReferencePersonalizedPageRank(g, outdeg, batch[j], options);
+        double sum = 0;
+        for (size_t i = 0; i < g.size(); i++) {
+          EXPECT_NEAR(ranks[i * k + j], expected[i], 1e-12) << i << " " << j;
+          sum += ranks[i * k + j];
+        }
+        EXPECT_NEAR(sum, 1, 1e-9);
+      }
+    }
+
+    std::vector<double> ranks;
+    EXPECT_FALSE(PersonalizedPageRank(&engine, outdeg, {{3000}}, options,
+                                      &ranks));
+    EXPECT_FALSE(PersonalizedPageRank(&engine, outdeg, {{1}, {}}, options,
+                                      &ranks));
+  }
+}
+
 }  // namespace
 }  // namespace zuckerli
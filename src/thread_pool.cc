@@ -0,0 +1,166 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "common.h"
+
+namespace zuckerli {
+
+namespace {
+ZKR_INLINE void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// CPUs that the calling thread may run on; empty if unknown.
+std::vector<size_t> AllowedCpus() {
+  std::vector<size_t> cpus;
+#ifdef __linux__
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpuset)) cpus.push_back(cpu);
+    }
+  }
+#endif
+  return cpus;
+}
+
+// Best effort: the pool works the same if the thread cannot be pinned.
+// Without `thread`, pins the calling thread.
+void PinThread(const std::vector<size_t> &cpus,
+               std::thread *thread = nullptr) {
+#ifdef __linux__
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  for (size_t cpu : cpus) CPU_SET(cpu, &cpuset);
+  if (thread == nullptr) {
+    sched_setaffinity(0, sizeof(cpuset), &cpuset);
+  } else {
+    pthread_setaffinity_np(thread->native_handle(), sizeof(cpuset), &cpuset);
+  }
+#endif
+}
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_threads) {
+  ZKR_ASSERT(num_threads >= 1);
+  std::vector<size_t> cpus = AllowedCpus();
+  size_t num_cpus =
+      cpus.empty() ? std::max<size_t>(std::thread::hardware_concurrency(), 1)
+                   : cpus.size();
+  spin_ = num_threads <= num_cpus;
+  pin_threads = pin_threads && !cpus.empty();
+  for (size_t t = 1; t < num_threads; t++) {
+    workers_.emplace_back([this, t]() { WorkerLoop(t); });
+    if (pin_threads) {
+      PinThread({cpus[t % num_cpus]}, &workers_.back());
+    }
+  }
+  if (pin_threads) {
+    caller_cpus_ = std::move(cpus);
+    pinned_caller_ = true;
+    PinThread({caller_cpus_[0]});
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  if (pinned_caller_) PinThread(caller_cpus_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+template <typename Pred>
+bool ThreadPool::SpinUntil(const Pred &pred) const {
+  if (spin_) {
+    // The cost of a pause varies a lot between CPUs, so the spin is bounded
+    // by time rather than by a number of iterations.
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::microseconds(kSpinMicroseconds);
+    do {
+      for (size_t i = 0; i < kSpinChecksPerClockRead; i++) {
+        if (pred()) return true;
+        CpuRelax();
+      }
+    } while (std::chrono::steady_clock::now() < deadline);
+  }
+  return pred();
+}
+
+void ThreadPool::RunTasks(size_t thread) {
+  for (size_t task = next_task_++; task < num_tasks_; task = next_task_++) {
+    (*f_)(task, thread);
+  }
+}
+
+void ThreadPool::Run(size_t num_tasks,
+                     const std::function<void(size_t, size_t)> &f) {
+  if (num_tasks == 0) return;
+  if (workers_.empty() || num_tasks == 1) {
+    for (size_t task = 0; task < num_tasks; task++) f(task, 0);
+    return;
+  }
+  f_ = &f;
+  num_tasks_ = num_tasks;
+  next_task_ = 0;
+  num_busy_ = workers_.size();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_++;
+  }
+  start_cv_.notify_all();
+  RunTasks(0);
+  const auto done = [this]() { return num_busy_ == 0; };
+  if (!SpinUntil(done)) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, done);
+  }
+  f_ = nullptr;
+}
+
+void ThreadPool::ParallelFor(
+    size_t size, size_t block_size,
+    const std::function<void(size_t, size_t, size_t)> &f) {
+  Run(DivCeil(size, block_size), [&](size_t block, size_t thread) {
+    size_t begin = block * block_size;
+    f(begin, std::min(begin + block_size, size), thread);
+  });
+}
+
+void ThreadPool::WorkerLoop(size_t thread) {
+  size_t generation = 0;
+  const auto woken = [&]() { return stop_ || generation_ != generation; };
+  while (true) {
+    if (!SpinUntil(woken)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, woken);
+    }
+    if (stop_) return;
+    generation = generation_;
+    RunTasks(thread);
+    if (--num_busy_ == 0) {
+      // Taking the lock orders the notification after the check of a caller
+      // that is about to park.
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_cv_.notify_one();
+    }
+  }
+}
+
+}  // namespace zuckerli
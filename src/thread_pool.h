@@ -0,0 +1,97 @@
+#ifndef ZUCKERLI_THREAD_POOL_H
+#define ZUCKERLI_THREAD_POOL_H
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+namespace zuckerli {
+
+// Fixed set of threads that run parallel loops, so that iterative algorithms
+// do not start new threads at each step. The thread that calls Run() takes
+// part in the loop, so a pool of n threads has n - 1 workers.
+//
+// Between loops, workers and the caller first spin for a short while, since
+// the steps of iterative algorithms follow each other closely, and then park
+// on a condition variable. Spinning is disabled when there are more threads
+// than CPUs that the process may run on.
+class ThreadPool {
+ public:
+  // If `pin_threads`, thread t (0 being the calling thread) runs on the t-th
+  // CPU, modulo their number, of those that the process may run on, where the
+  // platform supports it. The calling thread gets its previous CPUs back when
+  // the pool is destroyed.
+  explicit ThreadPool(size_t num_threads, bool pin_threads = false);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t NumThreads() const { return workers_.size() + 1; }
+
+  // Calls f(task, thread) for each task in [0, num_tasks), where `thread` in
+  // [0, NumThreads()) identifies the thread that runs the call; tasks are
+  // handed out in increasing order to the threads that are free. Returns when
+  // all the calls have returned. Must not be called concurrently, or from
+  // `f`.
+  void Run(size_t num_tasks, const std::function<void(size_t, size_t)> &f);
+
+  // Splits [0, size) into ranges of block_size items (the last one can be
+  // shorter) and calls f(begin, end, thread) for each of them, as Run().
+  void ParallelFor(size_t size, size_t block_size,
+                   const std::function<void(size_t, size_t, size_t)> &f);
+
+  // Returns the sum of f(begin, end, thread) over the ranges of
+  // ParallelFor(size, block_size, ...), starting from T(). The results of the
+  // ranges are added up in order, so that the sum does not depend on the
+  // number of threads.
+  template <typename T, typename F>
+  T ParallelSum(size_t size, size_t block_size, const F &f) {
+    std::vector<T> block_sums(DivCeil(size, block_size));
+    ParallelFor(size, block_size,
+                [&](size_t begin, size_t end, size_t thread) {
+                  block_sums[begin / block_size] = f(begin, end, thread);
+                });
+    T sum = T();
+    for (const T &block_sum : block_sums) sum += block_sum;
+    return sum;
+  }
+
+ private:
+  void WorkerLoop(size_t thread);
+  void RunTasks(size_t thread);
+  // Spins until pred() is true, for at most about kSpinMicroseconds; returns
+  // whether it is.
+  template <typename Pred>
+  bool SpinUntil(const Pred &pred) const;
+
+  static constexpr size_t kSpinMicroseconds = 50;
+  // The clock is read once every kSpinChecksPerClockRead checks of pred().
+  static constexpr size_t kSpinChecksPerClockRead = 16;
+
+  std::vector<std::thread> workers_;
+  bool spin_;
+  // Whether the CPUs of the calling thread were changed, and what they were.
+  bool pinned_caller_ = false;
+  std::vector<size_t> caller_cpus_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  // Incremented at each Run(), to wake up the workers; changes under mutex_,
+  // so that parked workers do not miss it.
+  std::atomic<size_t> generation_{0};
+  std::atomic<bool> stop_{false};
+  // Workers that have not finished the current loop yet.
+  std::atomic<size_t> num_busy_{0};
+  size_t num_tasks_ = 0;
+  std::atomic<size_t> next_task_{0};
+  const std::function<void(size_t, size_t)> *f_ = nullptr;
+};
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_THREAD_POOL_H
@@ -0,0 +1,77 @@
+#include "thread_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace zuckerli {
+namespace {
+
+TEST(ThreadPoolTest, TestRun) {
+  for (size_t num_threads : {1, 2, 4}) {
+    ThreadPool pool(num_threads);
+    ASSERT_EQ(pool.NumThreads(), num_threads);
+    // Loops of different sizes on the same threads.
+    for (size_t num_tasks : {0, 1, 3, 100, 1000}) {
+      std::vector<std::atomic<size_t>> calls(num_tasks);
+      std::atomic<bool> valid_thread{true};
+      pool.Run(num_tasks, [&](size_t task, size_t thread) {
+        calls[task]++;
+        if (thread >= num_threads) valid_thread = false;
+      });
+      for (size_t i = 0; i < num_tasks; i++) {
+        EXPECT_EQ(calls[i], 1) << i;
+      }
+      EXPECT_TRUE(valid_thread);
+    }
+  }
+}
+
+TEST(ThreadPoolTest, TestParallelFor) {
+  for (bool pin_threads : {false, true}) {
+    ThreadPool pool(3, pin_threads);
+    for (size_t size : {0, 1, 999, 1000, 1001}) {
+      std::vector<std::atomic<size_t>> calls(size);
+      pool.ParallelFor(size, 100, [&](size_t begin, size_t end, size_t thread) {
+        EXPECT_EQ(begin % 100, 0);
+        EXPECT_LE(end, size);
+        EXPECT_LE(end - begin, 100);
+        for (size_t i = begin; i < end; i++) calls[i]++;
+      });
+      for (size_t i = 0; i < size; i++) {
+        EXPECT_EQ(calls[i], 1) << i;
+      }
+    }
+  }
+}
+
+TEST(ThreadPoolTest, TestParallelSum) {
+  std::vector<double> values(10000);
+  for (size_t i = 0; i < values.size(); i++) values[i] = 1.0 / (i + 1);
+  double expected = 0;
+  for (size_t begin = 0; begin < values.size(); begin += 64) {
+    double block_sum = 0;
+    for (size_t i = begin; i < std::min(begin + 64, values.size()); i++) {
+      block_sum += values[i];
+    }
+    expected += block_sum;
+  }
+  // The same bits for any number of threads.
+  for (size_t num_threads : {1, 2, 4}) {
+    ThreadPool pool(num_threads);
+    for (size_t iter = 0; iter < 100; iter++) {
+      double sum = pool.ParallelSum<double>(
+          values.size(), 64, [&](size_t begin, size_t end, size_t thread) {
+            double block_sum = 0;
+            for (size_t i = begin; i < end; i++) block_sum += values[i];
+            return block_sum;
+          });
+      ASSERT_EQ(sum, expected);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace zuckerli
@@ -0,0 +1,122 @@
+#ifndef ZUCKERLI_TOP_K_H
+#define ZUCKERLI_TOP_K_H
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "thread_pool.h"
+
+namespace zuckerli {
+
+// Selection of the k largest values of a vector, e.g. of the PageRank
+// vector. Values are ordered by decreasing value and then by increasing node,
+// so that the selected nodes do not depend on the number of threads.
+template <typename value_t>
+class TopKHeap {
+ public:
+  explicit TopKHeap(size_t k) : k_(k) { heap_.reserve(k); }
+
+  ZKR_INLINE void Push(value_t value, uint64_t node) {
+    if (full_) {
+      // Most values are below the last of the k selected ones, i.e. the
+      // root.
+      if (value < threshold_ || !Before({value, node}, heap_.front())) return;
+      std::pop_heap(heap_.begin(), heap_.end(), Before);
+      heap_.back() = {value, node};
+      std::push_heap(heap_.begin(), heap_.end(), Before);
+      threshold_ = heap_.front().value;
+    } else if (k_ != 0) {
+      heap_.push_back({value, node});
+      std::push_heap(heap_.begin(), heap_.end(), Before);
+      full_ = heap_.size() == k_;
+      threshold_ = heap_.front().value;
+    }
+  }
+
+  // Push(values[i * stride], i) for i in [begin, end).
+  void PushRange(const value_t* values, uint64_t begin, uint64_t end,
+                 size_t stride = 1) {
+    for (uint64_t i = begin; i < end; i++) {
+      const value_t value = values[i * stride];
+      if (full_ && value < threshold_) continue;
+      Push(value, i);
+    }
+  }
+
+  void Merge(const TopKHeap& other) {
+    for (const Entry& entry : other.heap_) Push(entry.value, entry.node);
+  }
+
+  // The selected nodes, from the largest value; empties the heap.
+  std::vector<uint64_t> TakeSorted() {
+    std::sort_heap(heap_.begin(), heap_.end(), Before);
+    std::vector<uint64_t> nodes(heap_.size());
+    for (size_t i = 0; i < heap_.size(); i++) nodes[i] = heap_[i].node;
+    heap_.clear();
+    full_ = false;
+    return nodes;
+  }
+
+ private:
+  struct Entry {
+    value_t value;
+    uint64_t node;
+  };
+
+  static bool Before(const Entry& a, const Entry& b) {
+    return a.value != b.value ? a.value > b.value : a.node < b.node;
+  }
+
+  size_t k_;
+  std::vector<Entry> heap_;
+  bool full_ = false;
+  value_t threshold_ = value_t();
+};
+
+// One TopKHeap per thread of a pool, for the loops of ThreadPool::Run and
+// ParallelFor; a k of 0 selects nothing.
+template <typename value_t>
+class ParallelTopK {
+ public:
+  ParallelTopK(size_t k, size_t num_threads)
+      : heaps_(num_threads, TopKHeap<value_t>(k)) {}
+
+  ZKR_INLINE void Push(size_t thread, value_t value, uint64_t node) {
+    heaps_[thread].Push(value, node);
+  }
+
+  TopKHeap<value_t>& heap(size_t thread) { return heaps_[thread]; }
+
+  // The k largest of all the values pushed, from the largest one.
+  std::vector<uint64_t> TakeSorted() {
+    for (size_t t = 1; t < heaps_.size(); t++) heaps_[0].Merge(heaps_[t]);
+    return heaps_[0].TakeSorted();
+  }
+
+ private:
+  std::vector<TopKHeap<value_t>> heaps_;
+};
+
+namespace detail {
+// Number of values of each task of TopK().
+static constexpr size_t kTopKBlockSize = 1 << 16;
+}  // namespace detail
+
+// Returns the nodes i < n of the min(k, n) largest values[i * stride], from
+// the largest one, ties broken by the smallest node. Each thread of `pool`
+// selects the top k of the blocks it scans, and these are then merged.
+template <typename value_t>
+std::vector<uint64_t> TopK(const value_t* values, uint64_t n, size_t k,
+                           ThreadPool* pool, size_t stride = 1) {
+  ParallelTopK<value_t> top(k, pool->NumThreads());
+  pool->ParallelFor(n, detail::kTopKBlockSize,
+                    [&](size_t begin, size_t end, size_t thread) {
+                      top.heap(thread).PushRange(values, begin, end, stride);
+                    });
+  return top.TakeSorted();
+}
+
+}  // namespace zuckerli
+
+#endif  // ZUCKERLI_TOP_K_H
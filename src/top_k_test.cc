@@ -0,0 +1,62 @@
+#include "top_k.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace zuckerli {
+namespace {
+
+// Nodes of the k largest values, by sorting all of them.
+std::vector<uint64_t> SortedTopK(const std::vector<double>& values, size_t k) {
+  std::vector<uint64_t> nodes(values.size());
+  std::iota(nodes.begin(), nodes.end(), 0);
+  std::stable_sort(nodes.begin(), nodes.end(), [&](uint64_t a, uint64_t b) {
+    return values[a] > values[b];
+  });
+  nodes.resize(std::min(k, values.size()));
+  return nodes;
+}
+
+TEST(TopKTest, TestTopK) {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> dist(0, 999);
+  // Many ties, broken by the smallest node.
+  std::vector<double> values(300000);
+  for (double& value : values) value = dist(rng);
+  for (size_t num_threads : {1, 2, 4}) {
+    ThreadPool pool(num_threads);
+    for (size_t k : {0, 1, 3, 1000, 100000, 300000, 400000}) {
+      EXPECT_EQ(TopK(values.data(), values.size(), k, &pool),
+                SortedTopK(values, k))
+          << num_threads << " " << k;
+    }
+  }
+}
+
+TEST(TopKTest, TestStride) {
+  std::vector<double> values = {1, 8, 5, 7, 3, 9, 2, 0};
+  ThreadPool pool(2);
+  EXPECT_EQ(TopK(values.data(), 4, 2, &pool, /*stride=*/2),
+            std::vector<uint64_t>({1, 2}));
+  EXPECT_EQ(TopK(values.data() + 1, 4, 4, &pool, /*stride=*/2),
+            std::vector<uint64_t>({2, 0, 1, 3}));
+  EXPECT_TRUE(TopK(values.data(), 0, 4, &pool).empty());
+}
+
+TEST(TopKTest, TestHeap) {
+  TopKHeap<float> heap(2), other(2);
+  heap.Push(1, 5);
+  heap.Push(3, 1);
+  other.Push(2, 7);
+  other.Push(3, 0);
+  heap.Merge(other);
+  EXPECT_EQ(heap.TakeSorted(), std::vector<uint64_t>({0, 1}));
+  EXPECT_TRUE(heap.TakeSorted().empty());
+}
+
+}  // namespace
+}  // namespace zuckerli
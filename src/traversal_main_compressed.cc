@@ -4,6 +4,7 @@
 #include <stack>
 
 #include "compressed_graph.h"
+#include "encode.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "uncompressed_graph.h"
@@ -11,9 +12,12 @@
 ABSL_FLAG(std::string, input_path, "", "Input file path.");
 ABSL_FLAG(bool, dfs, false, "Run DFS (as opposed to BFS)?");
 ABSL_FLAG(bool, print, false, "Print node indices during traversal?");
+ABSL_FLAG(int32_t, cache_mb, 0,
+          "Cache up to this many MB of decoded adjacency lists (0: none).");
 
 void TimedBFS(zuckerli::CompressedGraph graph, bool print) {
   std::queue<uint32_t> nodes;
+  std::vector<uint32_t> neighbours;
   std::vector<bool> visited(graph.size(), false);
   int num_visited = 0;
 
@@ -28,7 +32,8 @@ void TimedBFS(zuckerli::CompressedGraph graph, bool print) {
       uint32_t current_node = nodes.front();
       nodes.pop();
       if (print) std::cout << current_node << " ";
-      for (uint32_t neighbour : graph.Neighbours(current_node)) {
+      graph.NeighboursInto(current_node, &neighbours);
+      for (uint32_t neighbour : neighbours) {
         if (!visited[neighbour]) {
           nodes.push(neighbour);
           visited[neighbour] = true;
@@ -47,6 +52,7 @@ void TimedBFS(zuckerli::CompressedGraph graph, bool print) {
 
 void TimedDFS(zuckerli::CompressedGraph graph, bool print) {
   std::stack<uint32_t> nodes;
+  std::vector<uint32_t> neighbours;
   std::vector<bool> visited(graph.size(), false);
   int num_visited = 0;
 
@@ -63,7 +69,8 @@ void TimedDFS(zuckerli::CompressedGraph graph, bool print) {
       uint32_t current_node = nodes.top();
       nodes.pop();
       if (print) std::cout << current_node << " ";
-      for (uint32_t neighbour : graph.Neighbours(current_node)) {
+      graph.NeighboursInto(current_node, &neighbours);
+      for (uint32_t neighbour : neighbours) {
         if (!visited[neighbour]) {
           nodes.push(neighbour);
           visited[neighbour] = true;
@@ -82,12 +89,22 @@ void TimedDFS(zuckerli::CompressedGraph graph, bool print) {
 
 int main(int argc, char* argv[]) {
   absl::ParseCommandLine(argc, argv);
-  zuckerli::CompressedGraph graph(absl::GetFlag(FLAGS_input_path));
+  zuckerli::CompressedGraph graph(absl::GetFlag(FLAGS_input_path),
+                                  absl::GetFlag(FLAGS_huge_pages));
   std::cout << "This graph has " << graph.size() << " nodes." << std::endl;
+  if (absl::GetFlag(FLAGS_cache_mb) > 0) {
+    graph.EnableCache(size_t(absl::GetFlag(FLAGS_cache_mb)) << 20);
+  }
   if (absl::GetFlag(FLAGS_dfs)) {
     TimedDFS(graph, absl::GetFlag(FLAGS_print));
   } else {
     TimedBFS(graph, absl::GetFlag(FLAGS_print));
   }
+  if (absl::GetFlag(FLAGS_cache_mb) > 0) {
+    zuckerli::AdjacencyCacheStats stats = graph.CacheStats();
+    std::cout << "Cache: " << stats.hits << " hits, " << stats.misses
+              << " misses, " << stats.evictions << " evictions, "
+              << stats.bytes / (1 << 20) << " MB used" << std::endl;
+  }
   return 0;
 }
@@ -13,48 +13,33 @@
 // limitations under the License.
 #include "uncompressed_graph.h"
 
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
 #include "common.h"
 
 namespace zuckerli {
 
-MemoryMappedFile::MemoryMappedFile(const std::string &filename) {
-  struct stat st;
-  //printf("ifname @%s@", filename.c_str());
-  //exit(0);
-  int ret = stat(filename.c_str(), &st);
-  ZKR_ASSERT(ret == 0);
-  size_ = st.st_size;
-  ZKR_ASSERT(size_ % sizeof(uint32_t) == 0);
-  size_ /= sizeof(uint32_t);
-  fd_ = open(filename.c_str(), O_RDONLY, 0);
-  auto flags = MAP_SHARED;
-#ifdef __linux__
-  flags |= MAP_POPULATE;
-#endif
-  data_ = (const uint32_t *)mmap(NULL, size_ * sizeof(uint32_t), PROT_READ,
-                                 flags, fd_, 0);
-  ZKR_ASSERT(data_ != MAP_FAILED);
-}
-
-MemoryMappedFile::~MemoryMappedFile() {
-  munmap((void *)data_, size_ * sizeof(uint32_t));
-  close(fd_);
-}
-
-UncompressedGraph::UncompressedGraph(const std::string &file) : f_(file) {
-  const uint32_t *data = f_.data();
-  if (kFingerprint != *(uint64_t *)data) {
+UncompressedGraph::UncompressedGraph(const std::string &file, bool populate)
+    : f_(file, MappedFile::Access::kSequential, /*huge_pages=*/false,
+         populate) {
+  const uint32_t *data = reinterpret_cast<const uint32_t *>(f_.data());
+  if (f_.size() < sizeof(kFingerprint) || kFingerprint != *(uint64_t *)data) {
     fprintf(stderr, "ERROR: invalid fingerprint\n");
     exit(1);
   }
+  // Fingerprint and number of nodes.
+  constexpr size_t kHeaderWords = 3;
+  size_t num_words = f_.size() / sizeof(uint32_t);
+  if (f_.size() % sizeof(uint32_t) != 0 || num_words < kHeaderWords) {
+    ZKR_ABORT("Invalid uncompressed graph %s", file.c_str());
+  }
   N = data[2];
-  neigh_start_ = (uint64_t *)(data + 3);
-  neighs_ = data + 2 * (N + 1) + 3;
+  if (num_words < kHeaderWords + 2 * (size_t(N) + 1)) {
+    ZKR_ABORT("Invalid uncompressed graph %s", file.c_str());
+  }
+  neigh_start_ = (uint64_t *)(data + kHeaderWords);
+  neighs_ = data + 2 * (N + 1) + kHeaderWords;
+  if (num_words < kHeaderWords + 2 * (size_t(N) + 1) + neigh_start_[N]) {
+    ZKR_ABORT("Invalid uncompressed graph %s", file.c_str());
+  }
 }
 
 }  // namespace zuckerli
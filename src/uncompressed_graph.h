@@ -20,49 +20,10 @@
 #include <string>
 
 #include "common.h"
+#include "mapped_file.h"
 
 namespace zuckerli {
 
-template <typename T>
-class span {
- public:
-  using iterator = const T *;
-  span(const T *data, size_t size) : data_(data), size_(size) {}
-  iterator begin() const { return data_; }
-  iterator end() const { return data_ + size_; }
-  const T &operator[](size_t pos) const { return data_[pos]; }
-  ZKR_INLINE T &at(size_t pos) {
-    ZKR_DASSERT(pos < size_);
-    return data_[pos];
-  }
-  ZKR_INLINE const T &at(size_t pos) const {
-    ZKR_DASSERT(pos < size_);
-    return data_[pos];
-  }
-  ZKR_INLINE size_t size() const { return size_; }
-
- private:
-  const T *data_;
-  size_t size_;
-};
-
-class MemoryMappedFile {
- public:
-  MemoryMappedFile(const std::string &filename);
-  ~MemoryMappedFile();
-  MemoryMappedFile(const MemoryMappedFile &) = delete;
-  void operator=(const MemoryMappedFile &) = delete;
-  MemoryMappedFile(MemoryMappedFile &&) = default;
-  MemoryMappedFile &operator=(MemoryMappedFile &&) = default;
-  ZKR_INLINE const uint32_t *data() const { return data_; }
-  ZKR_INLINE size_t size() const { return size_; }
-
- private:
-  size_t size_;
-  const uint32_t *ZKR_RESTRICT data_;
-  int fd_;
-};
-
 // Simple on-disk representation of a graph that can directly mapped into memory
 // (allowing reduced memory usage).
 // Format description:
@@ -78,7 +39,9 @@ class UncompressedGraph {
   // number of nodes.
   static constexpr uint64_t kFingerprint =
       (sizeof(uint64_t) << 4) | sizeof(uint32_t);
-  UncompressedGraph(const std::string &file);
+  // Exits with an error if the file cannot be mapped or is not a valid graph.
+  // With `populate`, the whole file is read in by the constructor.
+  explicit UncompressedGraph(const std::string &file, bool populate = true);
   ZKR_INLINE uint32_t size() const { return N; }
   ZKR_INLINE uint32_t Degree(size_t i) const {
     ZKR_DASSERT(i < size());
@@ -89,7 +52,7 @@ class UncompressedGraph {
   }
 
  private:
-  MemoryMappedFile f_;
+  MappedFile f_;
   uint32_t N;
   const uint64_t *ZKR_RESTRICT neigh_start_;
   const uint32_t *ZKR_RESTRICT neighs_;
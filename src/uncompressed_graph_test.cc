@@ -13,6 +13,10 @@
 // limitations under the License.
 #include "uncompressed_graph.h"
 
+#include <stdio.h>
+
+#include <string>
+
 #include "gtest/gtest.h"
 
 namespace zuckerli {
@@ -25,6 +29,18 @@ TEST(UncompressedGraphTest, TestInvalidSignature) {
                "invalid fingerprint");
 }
 
+TEST(UncompressedGraphTest, TestTruncatedGraph) {
+  std::string path = testing::TempDir() + "/truncated_graph";
+  FILE* f = fopen(path.c_str(), "wb");
+  ASSERT_NE(f, nullptr);
+  // The fingerprint and the number of nodes of TESTDATA "/small", without
+  // the rest.
+  uint32_t header[3] = {uint32_t(UncompressedGraph::kFingerprint), 0, 3};
+  ASSERT_EQ(fwrite(header, sizeof(header), 1, f), 1);
+  fclose(f);
+  EXPECT_DEATH(UncompressedGraph g(path), "Invalid uncompressed graph");
+}
+
 TEST(UncompressedGraphTest, TestSmallGraph) {
   UncompressedGraph g(
                       TESTDATA "/small");